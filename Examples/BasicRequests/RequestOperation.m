@@ -48,7 +48,13 @@
         request.error = error ? error : [NSError errorWithDomain:[[NSBundle mainBundle] bundleIdentifier] code:-1 userInfo:nil];
     }
     else {
-        request.rawXMLMappedResponse = [BKXMLMapper dictionaryMappedFromXMLData:data];
+        [self noteResponseLength:[data length]];
+        
+        // the mapper stops early (and returns nil) if we're cancelled while it's at work
+        NSDictionary *mappedResponse = [BKXMLMapper dictionaryMappedFromXMLData:data responseSchema:[request responseSchema] operation:self];
+        if (![self isCancelled]) {
+            request.rawXMLMappedResponse = mappedResponse;
+        }
     }
 }
 
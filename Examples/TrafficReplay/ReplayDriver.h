@@ -0,0 +1,53 @@
+//
+// ReplayDriver.h
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BugzKit.h"
+
+@class ReplayStatistics;
+
+// Replays trace entries (BKRequestTraceEntry) in order, as many times as asked. With a rate, requests are sent
+// open-loop at that many per second, whether or not earlier ones have completed, and each latency is measured from
+// when its request was due, so a server that falls behind shows up in the numbers instead of slowing the load
+// down. Otherwise the replay is closed-loop: a fixed number of requests are kept in flight.
+@interface ReplayDriver : NSObject
+{
+    BKAPIContext *APIContext;
+    NSArray *entries;
+    NSUInteger concurrency;
+    double rate;
+    NSUInteger repeatCount;
+    BOOL sendsResponseLengthHints;
+    NSOperationQueue *operationQueue;
+}
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext entries:(NSArray *)inEntries;
+- (ReplayStatistics *)run;      // blocks until every request has completed
+
+@property (assign) NSUInteger concurrency;          // closed-loop; default 1
+@property (assign) double rate;                     // requests per second, open-loop; 0 (the default) means closed-loop
+@property (assign) NSUInteger repeatCount;          // default 1
+@property (assign) BOOL sendsResponseLengthHints;   // ask the stub server for the traced response lengths
+@end
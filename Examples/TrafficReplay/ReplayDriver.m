@@ -0,0 +1,131 @@
+//
+// ReplayDriver.m
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "ReplayDriver.h"
+#import "ReplayOperation.h"
+#import "ReplayRequest.h"
+#import "ReplayStatistics.h"
+#import <dispatch/dispatch.h>
+
+// in open-loop mode the queue mustn't be what holds requests back
+static const NSInteger kOpenLoopOperationLimit = 100000;
+
+@implementation ReplayDriver
+- (void)dealloc
+{
+    [APIContext release], APIContext = nil;
+    [entries release], entries = nil;
+    [operationQueue release], operationQueue = nil;
+    [super dealloc];
+}
+
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext entries:(NSArray *)inEntries
+{
+    self = [super init];
+    if (self) {
+        APIContext = [inAPIContext retain];
+        entries = [inEntries copy];
+        concurrency = 1;
+        repeatCount = 1;
+        operationQueue = [[NSOperationQueue alloc] init];
+    }
+    
+    return self;
+}
+
+- (ReplayStatistics *)run
+{
+    ReplayStatistics *statistics = [[[ReplayStatistics alloc] init] autorelease];
+    NSUInteger entryCount = [entries count];
+    NSUInteger total = entryCount * repeatCount;
+    BOOL openLoop = (rate > 0.0);
+    
+    [operationQueue setMaxConcurrentOperationCount:(openLoop ? kOpenLoopOperationLimit : (NSInteger)MAX(concurrency, 1))];
+    
+    dispatch_semaphore_t slots = dispatch_semaphore_create(openLoop ? 0 : (long)MAX(concurrency, 1));
+    dispatch_group_t group = dispatch_group_create();
+    
+    [statistics beginMeasuring];
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    
+    for (NSUInteger index = 0; index < total; index++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        CFAbsoluteTime dueTime;
+        
+        if (openLoop) {
+            dueTime = startTime + (double)index / rate;
+            
+            NSTimeInterval wait = dueTime - CFAbsoluteTimeGetCurrent();
+            if (wait > 0.0) {
+                [NSThread sleepForTimeInterval:wait];
+            }
+        }
+        else {
+            dispatch_semaphore_wait(slots, DISPATCH_TIME_FOREVER);
+            dueTime = CFAbsoluteTimeGetCurrent();
+        }
+        
+        BKRequestTraceEntry *entry = [entries objectAtIndex:index % entryCount];
+        NSDictionary *parameters = entry.parameters;
+        
+        if (sendsResponseLengthHints && entry.responseLength) {
+            NSMutableDictionary *hinted = [NSMutableDictionary dictionaryWithDictionary:parameters];
+            [hinted setObject:[NSString stringWithFormat:@"%llu", entry.responseLength] forKey:@"stubResponseLength"];
+            parameters = hinted;
+        }
+        
+        ReplayRequest *request = [[[ReplayRequest alloc] initWithAPIContext:APIContext parameters:parameters] autorelease];
+        ReplayOperation *operation = [[[ReplayOperation alloc] initWithRequest:request] autorelease];
+        
+        dispatch_group_enter(group);
+        operation.onEnded = ^(ReplayOperation *inOperation) {
+            [statistics recordLatency:CFAbsoluteTimeGetCurrent() - dueTime succeeded:inOperation.succeeded responseLength:inOperation.decodedLength];
+            
+            if (!openLoop) {
+                dispatch_semaphore_signal(slots);
+            }
+            
+            dispatch_group_leave(group);
+        };
+        
+        [operationQueue addOperation:operation];
+        [pool drain];
+    }
+    
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    [statistics endMeasuring];
+    
+    dispatch_release(group);
+    dispatch_release(slots);
+    return statistics;
+}
+
+@synthesize concurrency;
+@synthesize rate;
+@synthesize repeatCount;
+@synthesize sendsResponseLengthHints;
+@end
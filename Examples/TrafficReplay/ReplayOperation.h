@@ -0,0 +1,40 @@
+//
+// ReplayOperation.h
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BugzKit.h"
+
+// An asynchronous request operation on top of NSURLConnection, so that the number of requests in flight isn't
+// bounded by the number of threads. Note that NSURLConnection only opens a few connections per host and queues
+// the rest; that waiting is part of the latency the replay tool reports, as it would be for a real client.
+@interface ReplayOperation : BKRequestOperation
+{
+    NSURLConnection *connection;
+    void (^onEnded)(ReplayOperation *inOperation);
+}
+@property (copy) void (^onEnded)(ReplayOperation *inOperation);     // invoked on the processing queue
+@property (readonly) BOOL succeeded;
+@end
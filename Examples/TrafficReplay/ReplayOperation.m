@@ -0,0 +1,134 @@
+//
+// ReplayOperation.m
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "ReplayOperation.h"
+
+static const NSTimeInterval kRequestTimeout = 60.0;
+
+@implementation ReplayOperation
+@synthesize onEnded;
+
+- (void)dealloc
+{
+    [connection release], connection = nil;
+    [onEnded release], onEnded = nil;
+    [super dealloc];
+}
+
+- (BOOL)usesAsynchronousFetch
+{
+    return YES;
+}
+
+- (void)beginAsynchronousFetch
+{
+    NSMutableURLRequest *URLRequest = [NSMutableURLRequest requestWithURL:request.requestURL cachePolicy:NSURLRequestReloadIgnoringLocalCacheData timeoutInterval:kRequestTimeout];
+    
+    if (request.usesPOSTRequest) {
+        [URLRequest setHTTPMethod:@"POST"];
+        [URLRequest setValue:request.HTTPRequestContentType forHTTPHeaderField:@"Content-Type"];
+        
+        NSInputStream *stream = request.requestInputStream;
+        if (stream) {
+            [URLRequest setHTTPBodyStream:stream];
+            [URLRequest setValue:[NSString stringWithFormat:@"%lu", (unsigned long)request.requestInputStreamSize] forHTTPHeaderField:@"Content-Length"];
+        }
+        else {
+            [URLRequest setHTTPBody:request.requestData];
+        }
+    }
+    
+    NSDictionary *headers = request.HTTPRequestHeaders;
+    for (NSString *field in headers) {
+        [URLRequest setValue:[headers objectForKey:field] forHTTPHeaderField:field];
+    }
+    
+    [connection release];
+    connection = [[NSURLConnection alloc] initWithRequest:URLRequest delegate:self startImmediately:NO];
+    [connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+    [connection start];
+}
+
+- (void)cancelFetch
+{
+    [connection cancel];
+    [connection release], connection = nil;
+}
+
+// off the run loop, the connection stops delivering data, and stops reading once its buffer is full
+- (void)pauseReceiving
+{
+    [connection unscheduleFromRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+}
+
+- (void)resumeReceiving
+{
+    [connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+}
+
+- (void)connection:(NSURLConnection *)inConnection didReceiveResponse:(NSURLResponse *)inResponse
+{
+    // NSURLConnection inflates compressed bodies by itself, so what we get is always plain XML
+    [self beginReceivingResponseWithContentEncoding:nil];
+}
+
+- (void)connection:(NSURLConnection *)inConnection didReceiveData:(NSData *)inData
+{
+    if (![self appendReceivedData:inData]) {
+        [self cancelFetch];
+        [self asynchronousFetchDidFinish];
+    }
+}
+
+- (void)connectionDidFinishLoading:(NSURLConnection *)inConnection
+{
+    [connection release], connection = nil;
+    [self asynchronousFetchDidFinish];
+}
+
+- (void)connection:(NSURLConnection *)inConnection didFailWithError:(NSError *)inError
+{
+    [connection release], connection = nil;
+    request.error = inError;
+    [self asynchronousFetchDidFinish];
+}
+
+- (BOOL)succeeded
+{
+    return ![self isCancelled] && !request.error && (request.rawXMLMappedResponse || request.processedResponse);
+}
+
+- (void)handleRequestOperationEnded
+{
+    if (onEnded) {
+        onEnded(self);
+        
+        // zap the block reference to break retain cycle (esp. if the block references to the op)
+        self.onEnded = nil;
+    }
+}
+@end
@@ -0,0 +1,59 @@
+//
+// ReplayRequest.m
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "ReplayRequest.h"
+
+@implementation ReplayRequest
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext parameters:(NSDictionary *)inParameters
+{
+    static NSSet *POSTCommands = nil;
+    
+    @synchronized([ReplayRequest class]) {
+        if (!POSTCommands) {
+            POSTCommands = [[NSSet alloc] initWithObjects:@"new", @"edit", @"assign", @"resolve", @"reactivate", @"close", @"reopen", @"reply", @"forward", @"email", @"setCurrentFilter", nil];
+        }
+    }
+    
+    self = [super initWithAPIContext:inAPIContext];
+    if (self) {
+        requestParameterDict = [inParameters copy];
+        usesPOST = [POSTCommands containsObject:[inParameters objectForKey:@"cmd"]];
+    }
+    
+    return self;
+}
+
+- (BOOL)requiresAuthToken
+{
+    return ![[requestParameterDict objectForKey:@"cmd"] isEqualToString:@"logon"];
+}
+
+- (BOOL)usesPOSTRequest
+{
+    return usesPOST;
+}
+@end
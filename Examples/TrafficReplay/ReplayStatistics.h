@@ -0,0 +1,65 @@
+//
+// ReplayStatistics.h
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import <libkern/OSAtomic.h>
+#import <sys/resource.h>
+
+// Collects the outcome of every replayed request, and the process's CPU time and memory over the run
+@interface ReplayStatistics : NSObject
+{
+    OSSpinLock lock;
+    double *latencies;
+    NSUInteger latencyCount;
+    NSUInteger latencyCapacity;
+    NSUInteger failureCount;
+    unsigned long long responseBytes;
+    
+    CFAbsoluteTime startTime;
+    CFAbsoluteTime endTime;
+    struct rusage startUsage;
+    struct rusage endUsage;
+    unsigned long long residentSize;
+}
+- (void)beginMeasuring;
+- (void)endMeasuring;
+
+// thread-safe; inLatency is from when the request was due to be sent until it completed
+- (void)recordLatency:(NSTimeInterval)inLatency succeeded:(BOOL)inSucceeded responseLength:(unsigned long long)inLength;
+
+- (NSTimeInterval)latencyAtPercentile:(double)inPercentile;     // nearest rank, over the successful requests
+- (NSString *)report;
+
+@property (readonly) NSUInteger completedCount;
+@property (readonly) NSUInteger failureCount;
+@property (readonly) NSTimeInterval elapsedTime;
+@property (readonly) double throughput;                 // successful requests per second
+@property (readonly) NSTimeInterval userCPUTime;
+@property (readonly) NSTimeInterval systemCPUTime;
+@property (readonly) unsigned long long residentSize;   // at the end of the run
+@property (readonly) unsigned long long peakResidentSize;
+@end
@@ -0,0 +1,183 @@
+//
+// ReplayStatistics.m
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "ReplayStatistics.h"
+#import <mach/mach.h>
+
+static const NSUInteger kInitialLatencyCapacity = 4096;
+
+static NSTimeInterval ReplayTimeIntervalFromTimeval(struct timeval inTime)
+{
+    return (NSTimeInterval)inTime.tv_sec + (NSTimeInterval)inTime.tv_usec / 1000000.0;
+}
+
+static int ReplayCompareDoubles(const void *inA, const void *inB)
+{
+    double a = *(const double *)inA;
+    double b = *(const double *)inB;
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+@implementation ReplayStatistics
+- (void)dealloc
+{
+    free(latencies);
+    [super dealloc];
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        lock = OS_SPINLOCK_INIT;
+        latencyCapacity = kInitialLatencyCapacity;
+        latencies = (double *)malloc(sizeof(double) * latencyCapacity);
+    }
+    
+    return self;
+}
+
+- (void)beginMeasuring
+{
+    getrusage(RUSAGE_SELF, &startUsage);
+    startTime = CFAbsoluteTimeGetCurrent();
+}
+
+- (void)endMeasuring
+{
+    endTime = CFAbsoluteTimeGetCurrent();
+    getrusage(RUSAGE_SELF, &endUsage);
+    
+    struct task_basic_info info;
+    mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &count) == KERN_SUCCESS) {
+        residentSize = info.resident_size;
+    }
+}
+
+- (void)recordLatency:(NSTimeInterval)inLatency succeeded:(BOOL)inSucceeded responseLength:(unsigned long long)inLength
+{
+    OSSpinLockLock(&lock);
+    
+    if (!inSucceeded) {
+        failureCount++;
+    }
+    else {
+        if (latencyCount == latencyCapacity) {
+            latencyCapacity *= 2;
+            latencies = (double *)realloc(latencies, sizeof(double) * latencyCapacity);
+        }
+        
+        latencies[latencyCount++] = inLatency;
+        responseBytes += inLength;
+    }
+    
+    OSSpinLockUnlock(&lock);
+}
+
+- (NSTimeInterval)latencyAtPercentile:(double)inPercentile
+{
+    OSSpinLockLock(&lock);
+    NSUInteger count = latencyCount;
+    double *sorted = (double *)malloc(sizeof(double) * (count ? count : 1));
+    memcpy(sorted, latencies, sizeof(double) * count);
+    OSSpinLockUnlock(&lock);
+    
+    NSTimeInterval result = 0.0;
+    if (count) {
+        qsort(sorted, count, sizeof(double), ReplayCompareDoubles);
+        
+        NSUInteger rank = (NSUInteger)ceil(inPercentile / 100.0 * (double)count);
+        result = sorted[(rank ? rank : 1) - 1];
+    }
+    
+    free(sorted);
+    return result;
+}
+
+- (NSString *)report
+{
+    NSTimeInterval elapsed = self.elapsedTime;
+    NSTimeInterval CPUTime = self.userCPUTime + self.systemCPUTime;
+    NSMutableString *report = [NSMutableString string];
+    
+    [report appendFormat:@"requests:    %lu succeeded, %lu failed in %.3f s\n", (unsigned long)self.completedCount, (unsigned long)failureCount, elapsed];
+    [report appendFormat:@"throughput:  %.1f requests/s, %.2f MB/s of XML\n", self.throughput, (elapsed > 0.0) ? (double)responseBytes / elapsed / (1024.0 * 1024.0) : 0.0];
+    [report appendFormat:@"latency:     p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+        [self latencyAtPercentile:50.0] * 1000.0, [self latencyAtPercentile:90.0] * 1000.0, [self latencyAtPercentile:99.0] * 1000.0,
+        [self latencyAtPercentile:99.9] * 1000.0, [self latencyAtPercentile:100.0] * 1000.0];
+    [report appendFormat:@"client CPU:  %.3f s user, %.3f s system (%.0f%% of one core)\n", self.userCPUTime, self.systemCPUTime, (elapsed > 0.0) ? CPUTime / elapsed * 100.0 : 0.0];
+    [report appendFormat:@"client RSS:  %.1f MB at the end, %.1f MB peak\n", (double)residentSize / (1024.0 * 1024.0), (double)self.peakResidentSize / (1024.0 * 1024.0)];
+    
+    return report;
+}
+
+- (NSUInteger)completedCount
+{
+    OSSpinLockLock(&lock);
+    NSUInteger count = latencyCount;
+    OSSpinLockUnlock(&lock);
+    return count;
+}
+
+- (NSUInteger)failureCount
+{
+    OSSpinLockLock(&lock);
+    NSUInteger count = failureCount;
+    OSSpinLockUnlock(&lock);
+    return count;
+}
+
+- (NSTimeInterval)elapsedTime
+{
+    return endTime - startTime;
+}
+
+- (double)throughput
+{
+    NSTimeInterval elapsed = self.elapsedTime;
+    return (elapsed > 0.0) ? (double)self.completedCount / elapsed : 0.0;
+}
+
+- (NSTimeInterval)userCPUTime
+{
+    return ReplayTimeIntervalFromTimeval(endUsage.ru_utime) - ReplayTimeIntervalFromTimeval(startUsage.ru_utime);
+}
+
+- (NSTimeInterval)systemCPUTime
+{
+    return ReplayTimeIntervalFromTimeval(endUsage.ru_stime) - ReplayTimeIntervalFromTimeval(startUsage.ru_stime);
+}
+
+- (unsigned long long)peakResidentSize
+{
+    // ru_maxrss is in bytes on Mac OS X
+    return (unsigned long long)endUsage.ru_maxrss;
+}
+
+@synthesize residentSize;
+@end
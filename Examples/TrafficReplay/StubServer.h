@@ -0,0 +1,67 @@
+//
+// StubServer.h
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
+
+// A FogBugz stand-in that serves synthetic responses on the loopback interface. Every command gets a generated
+// response of a given length (lists and searches are padded with items, so that parsing costs about the same as a
+// real response of that size), after a configurable latency. The script, a property list, sets the defaults and
+// overrides them per command:
+//
+//     latency             seconds before the response is sent (default 0.05)
+//     jitter              the latency varies uniformly by up to this much either way (default 0)
+//     gzip                compress responses for clients that accept it (default YES)
+//     responseLength      length of the generated XML (default 2048)
+//     commands            a dictionary from command (or "api.xml") to a dictionary of the keys above, plus
+//                         status (HTTP status code) and body (a literal response to serve instead)
+//
+// A request can ask for a response length with the stubResponseLength parameter, which is how the replay tool
+// reproduces the sizes in a trace. Connections are handled with dispatch sources, and the latency with timers,
+// so the server doesn't need a thread per connection.
+@interface StubServer : NSObject
+{
+    NSDictionary *script;
+    NSMutableDictionary *bodyCache;
+    int listeningSocket;
+    uint16_t port;
+    dispatch_queue_t acceptQueue;
+    dispatch_source_t acceptSource;
+    int32_t requestCount;
+}
+- (id)initWithScript:(NSDictionary *)inScript;
+- (BOOL)startOnPort:(uint16_t)inPort error:(NSError **)outError;     // 0 picks a free port
+- (void)stop;
+
+// the XML the server would send for inCommand, e.g. to time mapping it without the network
++ (NSData *)generatedResponseForCommand:(NSString *)inCommand length:(NSUInteger)inLength;
++ (NSData *)gzippedData:(NSData *)inData;     // what it would send to a client that accepts gzip
+
+@property (readonly) uint16_t port;
+@property (readonly) NSURL *serviceRoot;
+@property (readonly) NSUInteger requestCount;
+@end
@@ -0,0 +1,586 @@
+//
+// StubServer.m
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "StubServer.h"
+#import <arpa/inet.h>
+#import <fcntl.h>
+#import <libkern/OSAtomic.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <sys/socket.h>
+#import <unistd.h>
+#import <zlib.h>
+
+static const size_t kReadChunkSize = 16 * 1024;
+static const NSUInteger kMaximumHeaderLength = 64 * 1024;
+static const NSTimeInterval kDefaultLatency = 0.05;
+static const NSUInteger kDefaultResponseLength = 2048;
+
+// the XML element names of the generated lists: container, item, index key, name key
+static NSDictionary *StubListElementNames()
+{
+    static NSDictionary *names = nil;
+    
+    @synchronized([StubServer class]) {
+        if (!names) {
+            #define ELEMENTS(c, i, ix, s) [NSArray arrayWithObjects:c, i, ix, s, nil]
+            names = [[NSDictionary alloc] initWithObjectsAndKeys:
+                ELEMENTS(@"cases", @"case", @"ixBug", @"sTitle"), @"search",
+                ELEMENTS(@"filters", @"filter", @"sFilter", @"sName"), @"listFilters",
+                ELEMENTS(@"projects", @"project", @"ixProject", @"sProject"), @"listProjects",
+                ELEMENTS(@"areas", @"area", @"ixArea", @"sArea"), @"listAreas",
+                ELEMENTS(@"categories", @"category", @"ixCategory", @"sCategory"), @"listCategories",
+                ELEMENTS(@"priorities", @"priority", @"ixPriority", @"sPriority"), @"listPriorities",
+                ELEMENTS(@"people", @"person", @"ixPerson", @"sFullName"), @"listPeople",
+                ELEMENTS(@"snippets", @"snippet", @"ixSnippet", @"sSnippet"), @"listSnippets",
+                ELEMENTS(@"statuses", @"status", @"ixStatus", @"sStatus"), @"listStatuses",
+                ELEMENTS(@"fixfors", @"fixfor", @"ixFixFor", @"sFixFor"), @"listFixFors",
+                ELEMENTS(@"mailboxes", @"mailbox", @"ixMailbox", @"sEmail"), @"listMailboxes",
+                nil];
+            #undef ELEMENTS
+        }
+    }
+    
+    return names;
+}
+
+static NSData *StubGeneratedBody(NSString *inCommand, NSUInteger inLength)
+{
+    NSMutableString *xml = [NSMutableString stringWithString:@"<?xml version=\"1.0\" encoding=\"UTF-8\"?><response>"];
+    NSArray *names = [StubListElementNames() objectForKey:inCommand];
+    
+    if ([inCommand isEqualToString:@"api.xml"]) {
+        [xml appendString:@"<version>8</version><minversion>1</minversion><url>api.asp?</url>"];
+    }
+    else if ([inCommand isEqualToString:@"logon"]) {
+        [xml appendString:@"<token><![CDATA[stubtoken]]></token>"];
+    }
+    else if (names) {
+        NSString *container = [names objectAtIndex:0];
+        NSString *item = [names objectAtIndex:1];
+        NSString *indexKey = [names objectAtIndex:2];
+        NSString *nameKey = [names objectAtIndex:3];
+        NSString *attributes = [inCommand isEqualToString:@"search"] ? @" operations=\"edit,assign,resolve,email,remind\"" : @"";
+        NSString *closing = [NSString stringWithFormat:@"</%@></response>", container];
+        
+        [xml appendFormat:@"<%@>", container];
+        
+        // always at least one item, then as many as fit
+        NSUInteger index = 1;
+        do {
+            [xml appendFormat:@"<%@%@><%@>%lu</%@><%@><![CDATA[Synthetic %@ %lu]]></%@></%@>", item, attributes, indexKey, (unsigned long)index, indexKey, nameKey, item, (unsigned long)index, nameKey, item];
+            index++;
+        } while ([xml length] + [closing length] < inLength);
+        
+        [xml appendString:closing];
+        return [xml dataUsingEncoding:NSUTF8StringEncoding];
+    }
+    
+    [xml appendString:@"</response>"];
+    return [xml dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+static NSData *StubGzippedData(NSData *inData)
+{
+    z_stream stream;
+    bzero(&stream, sizeof(stream));
+    
+    // 15 + 16: a gzip header and trailer instead of zlib's
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return nil;
+    }
+    
+    NSMutableData *output = [NSMutableData dataWithLength:deflateBound(&stream, (uLong)[inData length])];
+    stream.next_in = (Bytef *)[inData bytes];
+    stream.avail_in = (uInt)[inData length];
+    stream.next_out = [output mutableBytes];
+    stream.avail_out = (uInt)[output length];
+    
+    int result = deflate(&stream, Z_FINISH);
+    [output setLength:stream.total_out];
+    deflateEnd(&stream);
+    
+    return (result == Z_STREAM_END) ? output : nil;
+}
+
+static NSString *StubDecodedComponent(NSString *inComponent)
+{
+    NSString *decoded = [[inComponent stringByReplacingOccurrencesOfString:@"+" withString:@" "] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+    return decoded ? decoded : @"";
+}
+
+static void StubAddFormParameters(NSMutableDictionary *ioParameters, NSString *inForm)
+{
+    for (NSString *pair in [inForm componentsSeparatedByString:@"&"]) {
+        NSRange equalSign = [pair rangeOfString:@"="];
+        if (equalSign.location != NSNotFound) {
+            [ioParameters setObject:StubDecodedComponent([pair substringFromIndex:NSMaxRange(equalSign)]) forKey:StubDecodedComponent([pair substringToIndex:equalSign.location])];
+        }
+    }
+}
+
+// only the fields the stub cares about are picked out of a multipart body
+static void StubAddMultipartParameters(NSMutableDictionary *ioParameters, NSData *inBody)
+{
+    NSString *body = [[[NSString alloc] initWithData:inBody encoding:NSISOLatin1StringEncoding] autorelease];
+    
+    for (NSString *key in [NSArray arrayWithObjects:@"cmd", @"stubResponseLength", nil]) {
+        NSString *marker = [NSString stringWithFormat:@"name=\"%@\"\r\n\r\n", key];
+        NSRange start = [body rangeOfString:marker];
+        if (start.location == NSNotFound) {
+            continue;
+        }
+        
+        NSRange end = [body rangeOfString:@"\r\n" options:0 range:NSMakeRange(NSMaxRange(start), [body length] - NSMaxRange(start))];
+        if (end.location != NSNotFound) {
+            [ioParameters setObject:[body substringWithRange:NSMakeRange(NSMaxRange(start), end.location - NSMaxRange(start))] forKey:key];
+        }
+    }
+}
+
+
+@interface StubServer (PrivateMethods)
+- (void)acceptConnections;
+- (id)settingForKey:(NSString *)inKey command:(NSString *)inCommand;
+- (NSData *)bodyForCommand:(NSString *)inCommand length:(NSUInteger)inLength compressed:(BOOL)inCompressed;
+@end
+
+@interface StubServer (ConnectionMethods)
+- (NSData *)responseForMethod:(NSString *)inMethod target:(NSString *)inTarget headers:(NSDictionary *)inHeaders body:(NSData *)inBody delay:(NSTimeInterval *)outDelay;
+@end
+
+
+// One client connection. Requests are parsed as they come in; each response is written after its latency has
+// passed, but never before the response to an earlier request on the same connection.
+@interface StubConnection : NSObject
+{
+    StubServer *server;
+    int socketDescriptor;
+    dispatch_queue_t queue;
+    dispatch_source_t readSource;
+    NSMutableData *inputBuffer;
+    CFAbsoluteTime lastResponseTime;
+    BOOL closing;
+}
+- (id)initWithServer:(StubServer *)inServer socket:(int)inSocket;
+- (void)start;
+- (void)readAvailableData;
+- (void)processRequests;
+- (void)sendResponse:(NSData *)inResponse afterDelay:(NSTimeInterval)inDelay closingConnection:(BOOL)inClose;
+- (void)closeConnection;
+@end
+
+@implementation StubConnection
+- (void)dealloc
+{
+    if (readSource) {
+        dispatch_release(readSource);
+    }
+    
+    dispatch_release(queue);
+    [server release];
+    [inputBuffer release];
+    [super dealloc];
+}
+
+- (id)initWithServer:(StubServer *)inServer socket:(int)inSocket
+{
+    self = [super init];
+    if (self) {
+        server = [inServer retain];
+        socketDescriptor = inSocket;
+        queue = dispatch_queue_create("org.lukhnos.TrafficReplay.StubConnection", NULL);
+        inputBuffer = [[NSMutableData alloc] init];
+    }
+    
+    return self;
+}
+
+- (void)start
+{
+    readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)socketDescriptor, 0, queue);
+    
+    // the handler blocks keep the connection alive until the source is cancelled
+    dispatch_source_set_event_handler(readSource, ^{
+        [self readAvailableData];
+    });
+    
+    dispatch_source_set_cancel_handler(readSource, ^{
+        close(socketDescriptor);
+        socketDescriptor = -1;
+    });
+    
+    dispatch_resume(readSource);
+}
+
+- (void)readAvailableData
+{
+    uint8_t chunk[kReadChunkSize];
+    ssize_t length = read(socketDescriptor, chunk, sizeof(chunk));
+    
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    
+    if (length <= 0) {
+        [self closeConnection];
+        return;
+    }
+    
+    [inputBuffer appendBytes:chunk length:(NSUInteger)length];
+    [self processRequests];
+}
+
+- (void)processRequests
+{
+    static const char headerTerminator[] = "\r\n\r\n";
+    
+    while (!closing) {
+        NSData *terminator = [NSData dataWithBytesNoCopy:(void *)headerTerminator length:4 freeWhenDone:NO];
+        NSRange headerEnd = [inputBuffer rangeOfData:terminator options:0 range:NSMakeRange(0, [inputBuffer length])];
+        
+        if (headerEnd.location == NSNotFound) {
+            if ([inputBuffer length] > kMaximumHeaderLength) {
+                [self closeConnection];
+            }
+            
+            return;
+        }
+        
+        NSString *header = [[[NSString alloc] initWithBytes:[inputBuffer bytes] length:headerEnd.location encoding:NSISOLatin1StringEncoding] autorelease];
+        NSArray *lines = [header componentsSeparatedByString:@"\r\n"];
+        NSArray *requestLine = [[lines objectAtIndex:0] componentsSeparatedByString:@" "];
+        
+        if ([requestLine count] != 3) {
+            [self closeConnection];
+            return;
+        }
+        
+        NSMutableDictionary *headers = [NSMutableDictionary dictionary];
+        for (NSString *line in [lines subarrayWithRange:NSMakeRange(1, [lines count] - 1)]) {
+            NSRange colon = [line rangeOfString:@":"];
+            if (colon.location != NSNotFound) {
+                NSString *value = [[line substringFromIndex:NSMaxRange(colon)] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+                [headers setObject:value forKey:[[line substringToIndex:colon.location] lowercaseString]];
+            }
+        }
+        
+        NSUInteger bodyLength = (NSUInteger)[[headers objectForKey:@"content-length"] integerValue];
+        NSUInteger requestLength = NSMaxRange(headerEnd) + bodyLength;
+        if ([inputBuffer length] < requestLength) {
+            return;
+        }
+        
+        NSData *body = [inputBuffer subdataWithRange:NSMakeRange(NSMaxRange(headerEnd), bodyLength)];
+        [inputBuffer replaceBytesInRange:NSMakeRange(0, requestLength) withBytes:NULL length:0];
+        
+        NSString *version = [requestLine objectAtIndex:2];
+        NSString *connectionHeader = [[headers objectForKey:@"connection"] lowercaseString];
+        BOOL closes = [connectionHeader isEqualToString:@"close"] || ([version isEqualToString:@"HTTP/1.0"] && ![connectionHeader isEqualToString:@"keep-alive"]);
+        
+        NSTimeInterval delay = 0.0;
+        NSData *response = [server responseForMethod:[requestLine objectAtIndex:0] target:[requestLine objectAtIndex:1] headers:headers body:body delay:&delay];
+        [self sendResponse:response afterDelay:delay closingConnection:closes];
+        
+        if (closes) {
+            // stop reading; the source is cancelled once the response is out
+            closing = YES;
+        }
+    }
+}
+
+- (void)sendResponse:(NSData *)inResponse afterDelay:(NSTimeInterval)inDelay closingConnection:(BOOL)inClose
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime due = MAX(now + inDelay, lastResponseTime);
+    lastResponseTime = due;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)((due - now) * NSEC_PER_SEC)), queue, ^{
+        const uint8_t *bytes = [inResponse bytes];
+        NSUInteger remaining = [inResponse length];
+        
+        while (remaining && socketDescriptor != -1) {
+            ssize_t written = write(socketDescriptor, bytes, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                
+                [self closeConnection];
+                return;
+            }
+            
+            bytes += written;
+            remaining -= (NSUInteger)written;
+        }
+        
+        if (inClose) {
+            [self closeConnection];
+        }
+    });
+}
+
+- (void)closeConnection
+{
+    closing = YES;
+    
+    if (readSource && !dispatch_source_testcancel(readSource)) {
+        dispatch_source_cancel(readSource);
+    }
+}
+@end
+
+
+@implementation StubServer
+- (void)dealloc
+{
+    [self stop];
+    [script release];
+    [bodyCache release];
+    [super dealloc];
+}
+
+- (id)initWithScript:(NSDictionary *)inScript
+{
+    self = [super init];
+    if (self) {
+        script = [inScript copy];
+        bodyCache = [[NSMutableDictionary alloc] init];
+        listeningSocket = -1;
+    }
+    
+    return self;
+}
+
+- (BOOL)startOnPort:(uint16_t)inPort error:(NSError **)outError
+{
+    listeningSocket = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_len = sizeof(address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(inPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    int yes = 1;
+    
+    if (listeningSocket == -1 ||
+        setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+        bind(listeningSocket, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(listeningSocket, SOMAXCONN) == -1 ||
+        getsockname(listeningSocket, (struct sockaddr *)&address, &addressLength) == -1 ||
+        fcntl(listeningSocket, F_SETFL, O_NONBLOCK) == -1) {
+        
+        NSError *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        if (outError) {
+            *outError = error;
+        }
+        
+        [self stop];
+        return NO;
+    }
+    
+    port = ntohs(address.sin_port);
+    acceptQueue = dispatch_queue_create("org.lukhnos.TrafficReplay.StubServer", NULL);
+    acceptSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)listeningSocket, 0, acceptQueue);
+    
+    // the server outlives its sources; -stop cancels them
+    dispatch_source_set_event_handler(acceptSource, ^{
+        [self acceptConnections];
+    });
+    
+    dispatch_resume(acceptSource);
+    return YES;
+}
+
+- (void)stop
+{
+    if (acceptSource) {
+        dispatch_source_cancel(acceptSource);
+        dispatch_release(acceptSource);
+        acceptSource = NULL;
+    }
+    
+    if (acceptQueue) {
+        // make sure the cancelled source's handler isn't running any more
+        dispatch_sync(acceptQueue, ^{});
+        dispatch_release(acceptQueue);
+        acceptQueue = NULL;
+    }
+    
+    if (listeningSocket != -1) {
+        close(listeningSocket);
+        listeningSocket = -1;
+    }
+}
+
++ (NSData *)generatedResponseForCommand:(NSString *)inCommand length:(NSUInteger)inLength
+{
+    return StubGeneratedBody(inCommand, inLength);
+}
+
++ (NSData *)gzippedData:(NSData *)inData
+{
+    return StubGzippedData(inData);
+}
+
+- (NSURL *)serviceRoot
+{
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/", (unsigned int)port]];
+}
+
+- (NSUInteger)requestCount
+{
+    return (NSUInteger)requestCount;
+}
+
+@synthesize port;
+@end
+
+
+@implementation StubServer (PrivateMethods)
+- (void)acceptConnections
+{
+    while (YES) {
+        int connectionSocket = accept(listeningSocket, NULL, NULL);
+        if (connectionSocket == -1) {
+            // EAGAIN: no more pending connections for now
+            return;
+        }
+        
+        int yes = 1;
+        setsockopt(connectionSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+        setsockopt(connectionSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        
+        // the accepted socket inherits O_NONBLOCK on some systems; reads and writes expect a blocking one
+        fcntl(connectionSocket, F_SETFL, 0);
+        
+        StubConnection *connection = [[StubConnection alloc] initWithServer:self socket:connectionSocket];
+        [connection start];
+        [connection release];
+    }
+}
+
+- (id)settingForKey:(NSString *)inKey command:(NSString *)inCommand
+{
+    id value = inCommand ? [[[script objectForKey:@"commands"] objectForKey:inCommand] objectForKey:inKey] : nil;
+    return value ? value : [script objectForKey:inKey];
+}
+
+- (NSData *)bodyForCommand:(NSString *)inCommand length:(NSUInteger)inLength compressed:(BOOL)inCompressed
+{
+    NSString *literal = [self settingForKey:@"body" command:inCommand];
+    NSString *key = [NSString stringWithFormat:@"%@\t%lu\t%d", inCommand, (unsigned long)(literal ? 0 : inLength), (int)inCompressed];
+    
+    @synchronized(bodyCache) {
+        NSData *body = [bodyCache objectForKey:key];
+        if (body) {
+            return [[body retain] autorelease];
+        }
+    }
+    
+    // generated outside the lock; a duplicate effort on a race is harmless
+    NSData *body = literal ? [literal dataUsingEncoding:NSUTF8StringEncoding] : StubGeneratedBody(inCommand, inLength);
+    if (inCompressed) {
+        body = StubGzippedData(body);
+    }
+    
+    @synchronized(bodyCache) {
+        [bodyCache setObject:body forKey:key];
+    }
+    
+    return body;
+}
+@end
+
+
+@implementation StubServer (ConnectionMethods)
+- (NSData *)responseForMethod:(NSString *)inMethod target:(NSString *)inTarget headers:(NSDictionary *)inHeaders body:(NSData *)inBody delay:(NSTimeInterval *)outDelay
+{
+    OSAtomicIncrement32Barrier(&requestCount);
+    
+    NSMutableDictionary *parameters = [NSMutableDictionary dictionary];
+    NSRange questionMark = [inTarget rangeOfString:@"?"];
+    NSString *path = inTarget;
+    
+    if (questionMark.location != NSNotFound) {
+        path = [inTarget substringToIndex:questionMark.location];
+        StubAddFormParameters(parameters, [inTarget substringFromIndex:NSMaxRange(questionMark)]);
+    }
+    
+    NSString *contentType = [inHeaders objectForKey:@"content-type"];
+    if ([inMethod isEqualToString:@"POST"]) {
+        if ([contentType hasPrefix:@"multipart/form-data"]) {
+            StubAddMultipartParameters(parameters, inBody);
+        }
+        else {
+            NSString *form = [[[NSString alloc] initWithData:inBody encoding:NSASCIIStringEncoding] autorelease];
+            StubAddFormParameters(parameters, form);
+        }
+    }
+    
+    NSString *command = [path hasSuffix:@"/api.xml"] ? @"api.xml" : [parameters objectForKey:@"cmd"];
+    
+    id latencySetting = [self settingForKey:@"latency" command:command];
+    NSTimeInterval latency = latencySetting ? [latencySetting doubleValue] : kDefaultLatency;
+    NSTimeInterval jitter = [[self settingForKey:@"jitter" command:command] doubleValue];
+    *outDelay = MAX(0.0, latency + jitter * (2.0 * ((double)arc4random() / (double)UINT32_MAX) - 1.0));
+    
+    NSUInteger length = (NSUInteger)[[parameters objectForKey:@"stubResponseLength"] integerValue];
+    if (!length) {
+        length = (NSUInteger)[[self settingForKey:@"responseLength" command:command] integerValue];
+    }
+    
+    if (!length) {
+        length = kDefaultResponseLength;
+    }
+    
+    id gzipSetting = [self settingForKey:@"gzip" command:command];
+    BOOL compressed = (!gzipSetting || [gzipSetting boolValue]) && [[inHeaders objectForKey:@"accept-encoding"] rangeOfString:@"gzip"].location != NSNotFound;
+    NSData *body = [self bodyForCommand:command length:length compressed:compressed];
+    
+    NSInteger status = [[self settingForKey:@"status" command:command] integerValue];
+    if (!status) {
+        status = 200;
+    }
+    
+    // clients go by the code; the reason phrase is just for people reading packet dumps
+    NSMutableString *header = [NSMutableString stringWithFormat:@"HTTP/1.1 %ld %@\r\n", (long)status, (status == 200) ? @"OK" : @"Stub Status"];
+    [header appendFormat:@"Content-Type: text/xml; charset=utf-8\r\nContent-Length: %lu\r\n", (unsigned long)[body length]];
+    
+    if (compressed) {
+        [header appendString:@"Content-Encoding: gzip\r\n"];
+    }
+    
+    [header appendString:@"\r\n"];
+    
+    NSMutableData *response = [NSMutableData dataWithData:[header dataUsingEncoding:NSISOLatin1StringEncoding]];
+    [response appendData:body];
+    return response;
+}
+@end
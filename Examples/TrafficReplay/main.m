@@ -0,0 +1,716 @@
+//
+// main.m
+//
+// Copyright (c) 2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BugzKit.h"
+#import "ReplayDriver.h"
+#import "ReplayOperation.h"
+#import "ReplayStatistics.h"
+#import "StubServer.h"
+#import <malloc/malloc.h>
+#import <sys/resource.h>
+
+// Options are read through NSUserDefaults, so they're given as e.g. "-concurrency 16"
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "usage: TrafficReplay serve [-port N] [-script stub.plist] [-latency s] [-jitter s] [-gzip YES|NO]\n"
+        "       TrafficReplay replay -trace file [-concurrency N | -rate R] [-repeat N] [-record file]\n"
+        "                            [-endpoint URL -email address -password password]\n"
+        "                            [-script stub.plist] [-latency s] [-jitter s] [-gzip YES|NO]\n"
+        "       TrafficReplay cancel [-responseLength bytes] [-after s] [-runs N]\n"
+        "       TrafficReplay decode [-responseLength bytes] [-chunkLength bytes] [-runs N]\n"
+        "       TrafficReplay flatten [-responseLength bytes] [-workers N] [-runs N]\n"
+        "       TrafficReplay tree [-responseLength bytes] [-runs N]\n"
+        "\n"
+        "serve runs the stub server until killed. replay starts one in a child process (so that it doesn't\n"
+        "count towards the client's CPU and memory use) unless an endpoint is given. cancel maps a generated\n"
+        "search response (20 MB by default), cancels the mapping after a while (0.1 s) and reports how long\n"
+        "the mapper took to stop and let go of its memory, then does the same with a BKQueryCaseRequest\n"
+        "fetched from a stub server by a BKRequestOperation, end to end. decode feeds a gzipped search response (4 MB by\n"
+        "default) to the incremental decoder and mapper in network-sized chunks (16 KB), and reports the bytes\n"
+        "on the wire against the decoded bytes, and how much of the time is left after the last chunk. flatten\n"
+        "maps a generated search response (20 MB by default) with the rows flattened serially, then in parallel\n"
+        "with 1 to N workers (N is the number of active processors by default), and reports the times. tree\n"
+        "compares BKXMLDocument with BKXMLMapper on a generated search response (20 MB by default), each in its\n"
+        "own process: the time to parse, to map one row and all of them, the peak resident size and the malloc\n"
+        "blocks each holds.\n");
+}
+
+static NSDictionary *StubScript()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSMutableDictionary *script = [NSMutableDictionary dictionary];
+    NSString *scriptPath = [defaults stringForKey:@"script"];
+    
+    if (scriptPath) {
+        NSDictionary *contents = [NSDictionary dictionaryWithContentsOfFile:scriptPath];
+        if (!contents) {
+            fprintf(stderr, "cannot read stub script %s\n", [scriptPath fileSystemRepresentation]);
+            return nil;
+        }
+        
+        [script addEntriesFromDictionary:contents];
+    }
+    
+    // the options override the script's defaults
+    for (NSString *key in [NSArray arrayWithObjects:@"latency", @"jitter", @"responseLength", nil]) {
+        if ([defaults objectForKey:key]) {
+            [script setObject:[NSNumber numberWithDouble:[defaults doubleForKey:key]] forKey:key];
+        }
+    }
+    
+    if ([defaults objectForKey:@"gzip"]) {
+        [script setObject:[NSNumber numberWithBool:[defaults boolForKey:@"gzip"]] forKey:@"gzip"];
+    }
+    
+    return script;
+}
+
+static int Serve()
+{
+    StubServer *server = [[StubServer alloc] initWithScript:StubScript()];
+    NSError *error = nil;
+    
+    if (![server startOnPort:(uint16_t)[[NSUserDefaults standardUserDefaults] integerForKey:@"port"] error:&error]) {
+        fprintf(stderr, "cannot start the stub server: %s\n", [[error description] UTF8String]);
+        [server release];
+        return 1;
+    }
+    
+    // the replay command looks for this line
+    printf("Stub server listening on %s\n", [[server.serviceRoot absoluteString] UTF8String]);
+    fflush(stdout);
+    
+    dispatch_main();
+    return 0;
+}
+
+// inSettings override the options given to us
+static NSTask *LaunchStubServer(NSDictionary *inSettings, NSURL **outServiceRoot)
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSMutableArray *arguments = [NSMutableArray arrayWithObjects:@"serve", @"-port", @"0", nil];
+    
+    for (NSString *key in [NSArray arrayWithObjects:@"script", @"latency", @"jitter", @"responseLength", @"gzip", nil]) {
+        NSString *value = [inSettings objectForKey:key] ? [inSettings objectForKey:key] : [defaults stringForKey:key];
+        if (value) {
+            [arguments addObject:[@"-" stringByAppendingString:key]];
+            [arguments addObject:value];
+        }
+    }
+    
+    NSPipe *pipe = [NSPipe pipe];
+    NSTask *task = [[[NSTask alloc] init] autorelease];
+    [task setLaunchPath:[[NSBundle mainBundle] executablePath]];
+    [task setArguments:arguments];
+    [task setStandardOutput:pipe];
+    [task launch];
+    
+    NSMutableData *output = [NSMutableData data];
+    NSFileHandle *handle = [pipe fileHandleForReading];
+    NSString *line = nil;
+    
+    while (!line) {
+        NSData *data = [handle availableData];
+        if (![data length]) {
+            break;
+        }
+        
+        [output appendData:data];
+        
+        NSString *text = [[[NSString alloc] initWithData:output encoding:NSUTF8StringEncoding] autorelease];
+        NSRange newline = [text rangeOfString:@"\n"];
+        if (newline.location != NSNotFound) {
+            line = [text substringToIndex:newline.location];
+        }
+    }
+    
+    NSRange URLStart = [line rangeOfString:@"http://"];
+    if (URLStart.location == NSNotFound) {
+        [task terminate];
+        return nil;
+    }
+    
+    *outServiceRoot = [NSURL URLWithString:[line substringFromIndex:URLStart.location]];
+    return task;
+}
+
+static BOOL RunRequest(BKRequest *inRequest, NSOperationQueue *inQueue)
+{
+    ReplayOperation *operation = [[[ReplayOperation alloc] initWithRequest:inRequest] autorelease];
+    [inQueue addOperation:operation];
+    [operation waitUntilFinished];
+    
+    if (!operation.succeeded) {
+        fprintf(stderr, "%s failed: %s\n", [NSStringFromClass([inRequest class]) UTF8String], [[inRequest.error description] UTF8String]);
+    }
+    
+    return operation.succeeded;
+}
+
+static int Replay()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSString *tracePath = [defaults stringForKey:@"trace"];
+    
+    if (!tracePath) {
+        PrintUsage();
+        return 1;
+    }
+    
+    NSError *error = nil;
+    NSArray *entries = [BKRequestTraceEntry entriesWithContentsOfFile:tracePath error:&error];
+    if (!entries) {
+        fprintf(stderr, "cannot read trace: %s\n", [[error description] UTF8String]);
+        return 1;
+    }
+    
+    NSString *endpoint = [defaults stringForKey:@"endpoint"];
+    NSURL *serviceRoot = endpoint ? [NSURL URLWithString:endpoint] : nil;
+    NSTask *stubTask = nil;
+    
+    if (!serviceRoot && !(stubTask = LaunchStubServer(nil, &serviceRoot))) {
+        fprintf(stderr, "cannot start the stub server\n");
+        return 1;
+    }
+    
+    NSString *email = [defaults stringForKey:@"email"];
+    NSString *password = [defaults stringForKey:@"password"];
+    
+    BKAPIContext *context = [[[BKAPIContext alloc] init] autorelease];
+    context.serviceRoot = serviceRoot;
+    
+    NSOperationQueue *setUpQueue = [[[NSOperationQueue alloc] init] autorelease];
+    
+    // a long replay against a real server may outlive its token
+    context.reauthenticationHandler = ^(BKAPIContext *inContext, void (^inCompletion)(BOOL inSucceeded)) {
+        BKLogOnRequest *logOnRequest = [BKLogOnRequest requestWithAPIContext:inContext accountName:email password:password];
+        ReplayOperation *logOnOperation = [[[ReplayOperation alloc] initWithRequest:logOnRequest] autorelease];
+        logOnOperation.onEnded = ^(ReplayOperation *inOperation) {
+            inCompletion(inOperation.succeeded);
+        };
+        
+        [setUpQueue addOperation:logOnOperation];
+    };
+    
+    int status = 1;
+    
+    if (RunRequest([[[BKCheckVersionRequest alloc] initWithAPIContext:context] autorelease], setUpQueue) &&
+        RunRequest([BKLogOnRequest requestWithAPIContext:context accountName:email password:password], setUpQueue)) {
+        
+        NSString *recordPath = [defaults stringForKey:@"record"];
+        if (recordPath) {
+            BKRequestTraceRecorder *recorder = [[[BKRequestTraceRecorder alloc] initWithPath:recordPath error:&error] autorelease];
+            if (!recorder) {
+                fprintf(stderr, "cannot record to %s: %s\n", [recordPath fileSystemRepresentation], [[error description] UTF8String]);
+            }
+            
+            [BKRequestOperation setTraceRecorder:recorder];
+        }
+        
+        ReplayDriver *driver = [[[ReplayDriver alloc] initWithAPIContext:context entries:entries] autorelease];
+        if ([defaults objectForKey:@"concurrency"]) {
+            driver.concurrency = (NSUInteger)MAX([defaults integerForKey:@"concurrency"], 1);
+        }
+        
+        if ([defaults objectForKey:@"repeat"]) {
+            driver.repeatCount = (NSUInteger)MAX([defaults integerForKey:@"repeat"], 1);
+        }
+        
+        driver.rate = [defaults doubleForKey:@"rate"];
+        driver.sendsResponseLengthHints = (stubTask != nil);
+        
+        if (driver.rate > 0.0) {
+            printf("replaying %lu requests x %lu at %.1f requests/s against %s\n", (unsigned long)[entries count], (unsigned long)driver.repeatCount, driver.rate, [[serviceRoot absoluteString] UTF8String]);
+        }
+        else {
+            printf("replaying %lu requests x %lu, %lu at a time, against %s\n", (unsigned long)[entries count], (unsigned long)driver.repeatCount, (unsigned long)driver.concurrency, [[serviceRoot absoluteString] UTF8String]);
+        }
+        
+        ReplayStatistics *statistics = [driver run];
+        printf("%s", [[statistics report] UTF8String]);
+        
+        [[BKRequestOperation traceRecorder] close];
+        [BKRequestOperation setTraceRecorder:nil];
+        status = 0;
+    }
+    
+    [stubTask terminate];
+    return status;
+}
+
+static void PrintStopTimes(NSMutableArray *ioStopTimes, NSUInteger inFinishedCount, const char *inWhat)
+{
+    if (inFinishedCount) {
+        printf("%lu %s finished before they were cancelled; try a larger -responseLength or a smaller -after\n", (unsigned long)inFinishedCount, inWhat);
+    }
+    
+    if ([ioStopTimes count]) {
+        [ioStopTimes sortUsingSelector:@selector(compare:)];
+        printf("time from cancel to stop (ms): min %.3f, median %.3f, max %.3f\n", [[ioStopTimes objectAtIndex:0] doubleValue], [[ioStopTimes objectAtIndex:[ioStopTimes count] / 2] doubleValue], [[ioStopTimes lastObject] doubleValue]);
+    }
+}
+
+// The mapper on its own, under an operation that's only there to be cancelled
+static void MeasureMapperCancellation(NSData *inResponse, NSTimeInterval inAfter, NSUInteger inRuns)
+{
+    BKResponseSchema *schema = [BKResponseSchema schemaForCommand:@"search"];
+    NSMutableArray *stopTimes = [NSMutableArray array];
+    NSUInteger finishedCount = 0;
+    
+    printf("mapping %lu bytes, cancelled after %.3f s, %lu times\n", (unsigned long)[inResponse length], inAfter, (unsigned long)inRuns);
+    
+    for (NSUInteger run = 0; run < inRuns; run++) {
+        // the mapper only asks its operation whether it's cancelled; it never runs
+        NSOperation *owner = [[[NSBlockOperation alloc] init] autorelease];
+        dispatch_semaphore_t done = dispatch_semaphore_create(0);
+        __block BOOL completed = NO;
+        __block CFAbsoluteTime stopTime = 0.0;
+        
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            completed = ([BKXMLMapper dictionaryMappedFromXMLData:inResponse responseSchema:schema operation:owner] != nil);
+            
+            // the time to stop includes freeing what was mapped
+            [pool drain];
+            stopTime = CFAbsoluteTimeGetCurrent();
+            dispatch_semaphore_signal(done);
+        });
+        
+        BOOL finishedEarly = !dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(inAfter * NSEC_PER_SEC)));
+        CFAbsoluteTime cancelTime = CFAbsoluteTimeGetCurrent();
+        
+        if (!finishedEarly) {
+            [owner cancel];
+            dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+        }
+        
+        dispatch_release(done);
+        
+        if (finishedEarly || completed) {
+            finishedCount++;
+        }
+        else {
+            [stopTimes addObject:[NSNumber numberWithDouble:(stopTime - cancelTime) * 1000.0]];
+        }
+    }
+    
+    PrintStopTimes(stopTimes, finishedCount, "mappings");
+}
+
+// A search sent through a BKRequestOperation to a stub server, with a case cache so that the postprocessing has
+// work to do, and cancelled wherever it happens to be: receiving, mapping or postprocessing
+static BOOL MeasureOperationCancellation(NSUInteger inLength, NSTimeInterval inAfter, NSUInteger inRuns)
+{
+    NSURL *serviceRoot = nil;
+    NSDictionary *settings = [NSDictionary dictionaryWithObject:[NSString stringWithFormat:@"%lu", (unsigned long)inLength] forKey:@"responseLength"];
+    NSTask *stubTask = LaunchStubServer(settings, &serviceRoot);
+    
+    if (!stubTask) {
+        fprintf(stderr, "cannot start the stub server\n");
+        return NO;
+    }
+    
+    BKAPIContext *context = [[[BKAPIContext alloc] init] autorelease];
+    context.serviceRoot = serviceRoot;
+    context.caseCache = [[[BKCaseCache alloc] initWithByteBudget:256 * 1024 * 1024] autorelease];
+    
+    NSOperationQueue *queue = [[[NSOperationQueue alloc] init] autorelease];
+    if (!RunRequest([[[BKCheckVersionRequest alloc] initWithAPIContext:context] autorelease], queue) ||
+        !RunRequest([BKLogOnRequest requestWithAPIContext:context accountName:@"stub" password:@"stub"], queue)) {
+        [stubTask terminate];
+        return NO;
+    }
+    
+    NSArray *columns = [NSArray arrayWithObjects:@"sTitle", @"events", nil];
+    NSMutableArray *stopTimes = [NSMutableArray array];
+    NSMutableArray *receivedFractions = [NSMutableArray array];
+    NSUInteger finishedCount = 0;
+    
+    printf("searching for %lu bytes from %s, cancelled after %.3f s, %lu times\n", (unsigned long)inLength, [[serviceRoot absoluteString] UTF8String], inAfter, (unsigned long)inRuns);
+    
+    for (NSUInteger run = 0; run < inRuns; run++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        BKQueryCaseRequest *search = [[[BKQueryCaseRequest alloc] initWithAPIContext:context query:@"stub" columns:columns] autorelease];
+        ReplayOperation *operation = [[ReplayOperation alloc] initWithRequest:search];
+        
+        [context.caseCache removeAllObjects];
+        [queue addOperation:operation];
+        
+        CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + inAfter;
+        while (![operation isFinished] && CFAbsoluteTimeGetCurrent() < deadline) {
+            usleep(1000);
+        }
+        
+        CFAbsoluteTime cancelTime = CFAbsoluteTimeGetCurrent();
+        BOOL finishedEarly = [operation isFinished];
+        unsigned long long receivedAtCancel = operation.decodedLength;
+        
+        [operation cancel];
+        [operation waitUntilFinished];
+        
+        // the time to stop includes freeing what was received and mapped
+        [operation release];
+        [pool drain];
+        CFAbsoluteTime stopTime = CFAbsoluteTimeGetCurrent();
+        
+        if (finishedEarly) {
+            finishedCount++;
+        }
+        else {
+            [stopTimes addObject:[NSNumber numberWithDouble:(stopTime - cancelTime) * 1000.0]];
+            [receivedFractions addObject:[NSNumber numberWithDouble:inLength ? 100.0 * (double)receivedAtCancel / (double)inLength : 0.0]];
+        }
+    }
+    
+    [stubTask terminate];
+    
+    PrintStopTimes(stopTimes, finishedCount, "searches");
+    if ([receivedFractions count]) {
+        [receivedFractions sortUsingSelector:@selector(compare:)];
+        printf("received when cancelled: median %.1f%%; %lu cases left in the cache\n", [[receivedFractions objectAtIndex:[receivedFractions count] / 2] doubleValue], (unsigned long)context.caseCache.entryCount);
+    }
+    
+    return YES;
+}
+
+static int MeasureCancellation()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSUInteger length = [defaults objectForKey:@"responseLength"] ? (NSUInteger)MAX([defaults integerForKey:@"responseLength"], 0) : 20 * 1024 * 1024;
+    NSTimeInterval after = [defaults objectForKey:@"after"] ? [defaults doubleForKey:@"after"] : 0.1;
+    NSUInteger runs = [defaults objectForKey:@"runs"] ? (NSUInteger)MAX([defaults integerForKey:@"runs"], 1) : 10;
+    
+    MeasureMapperCancellation([StubServer generatedResponseForCommand:@"search" length:length], after, runs);
+    return MeasureOperationCancellation(length, after, runs) ? 0 : 1;
+}
+
+// With the NSXMLParser backend, BKXMLMapper buffers what it's fed and parses it all in -finishMapping, so only the
+// inflating is done while the bytes come in; this shows how much that leaves for after the last byte.
+static int MeasureDecoding()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSUInteger length = [defaults objectForKey:@"responseLength"] ? (NSUInteger)MAX([defaults integerForKey:@"responseLength"], 0) : 4 * 1024 * 1024;
+    NSUInteger chunkLength = [defaults objectForKey:@"chunkLength"] ? (NSUInteger)MAX([defaults integerForKey:@"chunkLength"], 1) : 16 * 1024;
+    NSUInteger runs = [defaults objectForKey:@"runs"] ? (NSUInteger)MAX([defaults integerForKey:@"runs"], 1) : 10;
+    
+    NSData *response = [StubServer generatedResponseForCommand:@"search" length:length];
+    NSData *wireData = [StubServer gzippedData:response];
+    BKResponseSchema *schema = [BKResponseSchema schemaForCommand:@"search"];
+    NSMutableArray *feedTimes = [NSMutableArray array];
+    NSMutableArray *finishTimes = [NSMutableArray array];
+    unsigned long long decodedLength = 0;
+    
+    printf("feeding %lu gzipped bytes (%lu decoded) in %lu-byte chunks, %lu times\n", (unsigned long)[wireData length], (unsigned long)[response length], (unsigned long)chunkLength, (unsigned long)runs);
+    
+    for (NSUInteger run = 0; run < runs; run++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        BKXMLMapper *mapper = [[[BKXMLMapper alloc] initWithResponseSchema:schema] autorelease];
+        BKContentDecoder *decoder = [[[BKContentDecoder alloc] initWithContentEncoding:@"gzip" sink:mapper] autorelease];
+        
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        BOOL fed = YES;
+        
+        for (NSUInteger offset = 0; fed && offset < [wireData length]; offset += chunkLength) {
+            fed = [decoder appendBytes:(const uint8_t *)[wireData bytes] + offset length:MIN(chunkLength, [wireData length] - offset)];
+        }
+        
+        CFAbsoluteTime lastByteTime = CFAbsoluteTimeGetCurrent();
+        NSDictionary *result = (fed && [decoder finish]) ? [mapper finishMapping] : nil;
+        CFAbsoluteTime endTime = CFAbsoluteTimeGetCurrent();
+        
+        if (!result) {
+            fprintf(stderr, "the response didn't map\n");
+            [pool drain];
+            return 1;
+        }
+        
+        decodedLength = decoder.decodedLength;
+        [feedTimes addObject:[NSNumber numberWithDouble:(lastByteTime - startTime) * 1000.0]];
+        [finishTimes addObject:[NSNumber numberWithDouble:(endTime - lastByteTime) * 1000.0]];
+        [pool drain];
+    }
+    
+    [feedTimes sortUsingSelector:@selector(compare:)];
+    [finishTimes sortUsingSelector:@selector(compare:)];
+    
+    printf("wire bytes %lu, decoded bytes %llu (%.1f%%)\n", (unsigned long)[wireData length], decodedLength, decodedLength ? 100.0 * (double)[wireData length] / (double)decodedLength : 0.0);
+    printf("while receiving (ms): min %.3f, median %.3f, max %.3f\n", [[feedTimes objectAtIndex:0] doubleValue], [[feedTimes objectAtIndex:[feedTimes count] / 2] doubleValue], [[feedTimes lastObject] doubleValue]);
+    printf("after the last byte (ms): min %.3f, median %.3f, max %.3f\n", [[finishTimes objectAtIndex:0] doubleValue], [[finishTimes objectAtIndex:[finishTimes count] / 2] doubleValue], [[finishTimes lastObject] doubleValue]);
+    return 0;
+}
+
+// parsing takes the global lock and costs the same in every round; only the flattening of the rows changes
+static double MedianMappingTime(NSData *inResponse, BKResponseSchema *inSchema, NSUInteger inRuns)
+{
+    NSMutableArray *times = [NSMutableArray array];
+    
+    for (NSUInteger run = 0; run < inRuns; run++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        NSDictionary *result = [BKXMLMapper dictionaryMappedFromXMLData:inResponse responseSchema:inSchema];
+        CFAbsoluteTime endTime = CFAbsoluteTimeGetCurrent();
+        
+        if (!result) {
+            [pool drain];
+            return -1.0;
+        }
+        
+        [times addObject:[NSNumber numberWithDouble:(endTime - startTime) * 1000.0]];
+        [pool drain];
+    }
+    
+    [times sortUsingSelector:@selector(compare:)];
+    return [[times objectAtIndex:[times count] / 2] doubleValue];
+}
+
+static int MeasureFlattening()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSUInteger length = [defaults objectForKey:@"responseLength"] ? (NSUInteger)MAX([defaults integerForKey:@"responseLength"], 0) : 20 * 1024 * 1024;
+    NSUInteger maxWorkers = [defaults objectForKey:@"workers"] ? (NSUInteger)MAX([defaults integerForKey:@"workers"], 1) : [[NSProcessInfo processInfo] activeProcessorCount];
+    NSUInteger runs = [defaults objectForKey:@"runs"] ? (NSUInteger)MAX([defaults integerForKey:@"runs"], 1) : 5;
+    
+    NSData *response = [StubServer generatedResponseForCommand:@"search" length:length];
+    BKResponseSchema *schema = [BKResponseSchema schemaForCommand:@"search"];
+    
+    printf("mapping %lu bytes, median of %lu runs each\n", (unsigned long)[response length], (unsigned long)runs);
+    
+    [BKXMLMapper setParallelFlatteningThreshold:NSUIntegerMax];
+    double serialTime = MedianMappingTime(response, schema, runs);
+    if (serialTime < 0.0) {
+        fprintf(stderr, "the response didn't map\n");
+        return 1;
+    }
+    
+    printf("serial: %.3f ms\n", serialTime);
+    
+    // back to the default, so only the rows are flattened in parallel
+    [BKXMLMapper setParallelFlatteningThreshold:1024];
+    
+    for (NSUInteger workers = 1; workers <= maxWorkers; workers++) {
+        [BKXMLMapper setParallelFlatteningConcurrency:workers];
+        double time = MedianMappingTime(response, schema, runs);
+        printf("%lu worker%s: %.3f ms (%.2fx)\n", (unsigned long)workers, workers == 1 ? "" : "s", time, time > 0.0 ? serialTime / time : 0.0);
+    }
+    
+    [BKXMLMapper setParallelFlatteningConcurrency:0];
+    return 0;
+}
+
+static double MedianOf(NSArray *inValues)
+{
+    NSArray *sorted = [inValues sortedArrayUsingSelector:@selector(compare:)];
+    return [[sorted objectAtIndex:[sorted count] / 2] doubleValue];
+}
+
+// Runs in a child process started by MeasureTree, so that neither side reuses pages the other one freed. Both
+// sides map without a schema, the way -XMLMappedObject does. The result goes to stdout as a property list.
+static int MeasureTreeSide()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSUInteger length = (NSUInteger)MAX([defaults integerForKey:@"responseLength"], 0);
+    BOOL measuresDocument = [[defaults stringForKey:@"side"] isEqualToString:@"document"];
+    
+    NSData *response = [StubServer generatedResponseForCommand:@"search" length:length];
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    malloc_statistics_t heapBefore;
+    malloc_statistics_t heapHeld;
+    struct rusage usageBefore;
+    struct rusage usageAfter;
+    
+    malloc_zone_statistics(NULL, &heapBefore);
+    getrusage(RUSAGE_SELF, &usageBefore);
+    
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    
+    if (!measuresDocument) {
+        NSDictionary *mapped = [BKXMLMapper dictionaryMappedFromXMLData:response responseSchema:nil];
+        CFAbsoluteTime endTime = CFAbsoluteTimeGetCurrent();
+        
+        if (!mapped) {
+            fprintf(stderr, "the response didn't map\n");
+            [pool drain];
+            return 1;
+        }
+        
+        // what's held while the result is in use
+        malloc_zone_statistics(NULL, &heapHeld);
+        [result setObject:[NSNumber numberWithDouble:(endTime - startTime) * 1000.0] forKey:@"parseTime"];
+    }
+    else {
+        BKXMLDocument *document = [BKXMLDocument documentWithXMLData:response];
+        CFAbsoluteTime parsedTime = CFAbsoluteTimeGetCurrent();
+        
+        if (!document) {
+            fprintf(stderr, "the response didn't parse\n");
+            [pool drain];
+            return 1;
+        }
+        
+        malloc_zone_statistics(NULL, &heapHeld);
+        
+        NSArray *rows = [document.rootElement elementsAtKeyPath:@"cases.case"];
+        if (![rows count]) {
+            fprintf(stderr, "the response has no rows; try a larger -responseLength\n");
+            [pool drain];
+            return 1;
+        }
+        
+        CFAbsoluteTime firstRowStartTime = CFAbsoluteTimeGetCurrent();
+        [[rows objectAtIndex:0] XMLMappedObject];
+        CFAbsoluteTime firstRowTime = CFAbsoluteTimeGetCurrent();
+        
+        for (BKXMLElement *row in rows) {
+            NSAutoreleasePool *rowPool = [[NSAutoreleasePool alloc] init];
+            [row XMLMappedObject];
+            [rowPool drain];
+        }
+        
+        CFAbsoluteTime allRowsTime = CFAbsoluteTimeGetCurrent();
+        
+        [result setObject:[NSNumber numberWithDouble:(parsedTime - startTime) * 1000.0] forKey:@"parseTime"];
+        [result setObject:[NSNumber numberWithDouble:(firstRowTime - firstRowStartTime) * 1000.0] forKey:@"firstRowTime"];
+        [result setObject:[NSNumber numberWithDouble:(allRowsTime - firstRowTime) * 1000.0] forKey:@"allRowsTime"];
+        [result setObject:[NSNumber numberWithUnsignedInteger:[rows count]] forKey:@"rowCount"];
+        [result setObject:[NSNumber numberWithUnsignedInteger:document.allocatedBytes] forKey:@"arenaSize"];
+    }
+    
+    [pool drain];
+    getrusage(RUSAGE_SELF, &usageAfter);
+    
+    // ru_maxrss is in bytes on Mac OS X; the baseline includes the generated response
+    long peakGrowth = (usageAfter.ru_maxrss > usageBefore.ru_maxrss) ? usageAfter.ru_maxrss - usageBefore.ru_maxrss : 0;
+    [result setObject:[NSNumber numberWithDouble:(double)peakGrowth] forKey:@"peakGrowth"];
+    [result setObject:[NSNumber numberWithDouble:(double)heapHeld.blocks_in_use - (double)heapBefore.blocks_in_use] forKey:@"blocksHeld"];
+    [result setObject:[NSNumber numberWithDouble:(double)heapHeld.size_in_use - (double)heapBefore.size_in_use] forKey:@"bytesHeld"];
+    
+    NSData *output = [NSPropertyListSerialization dataFromPropertyList:result format:NSPropertyListXMLFormat_v1_0 errorDescription:NULL];
+    fwrite([output bytes], 1, [output length], stdout);
+    return 0;
+}
+
+static NSDictionary *RunTreeSide(NSString *inSide, NSUInteger inLength)
+{
+    NSArray *arguments = [NSArray arrayWithObjects:@"tree-side", @"-side", inSide, @"-responseLength", [NSString stringWithFormat:@"%lu", (unsigned long)inLength], nil];
+    
+    NSPipe *pipe = [NSPipe pipe];
+    NSTask *task = [[[NSTask alloc] init] autorelease];
+    [task setLaunchPath:[[NSBundle mainBundle] executablePath]];
+    [task setArguments:arguments];
+    [task setStandardOutput:pipe];
+    [task launch];
+    
+    NSData *output = [[pipe fileHandleForReading] readDataToEndOfFile];
+    [task waitUntilExit];
+    
+    if ([task terminationStatus]) {
+        return nil;
+    }
+    
+    id result = [NSPropertyListSerialization propertyListFromData:output mutabilityOption:NSPropertyListImmutable format:NULL errorDescription:NULL];
+    return [result isKindOfClass:[NSDictionary class]] ? result : nil;
+}
+
+// Each side runs in a fresh process, in alternating order, and reports its peak resident size (ru_maxrss) and the
+// malloc blocks and bytes still held once the parse is done.
+static int MeasureTree()
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    NSUInteger length = [defaults objectForKey:@"responseLength"] ? (NSUInteger)MAX([defaults integerForKey:@"responseLength"], 0) : 20 * 1024 * 1024;
+    NSUInteger runs = [defaults objectForKey:@"runs"] ? (NSUInteger)MAX([defaults integerForKey:@"runs"], 1) : 5;
+    
+    NSArray *sides = [NSArray arrayWithObjects:@"mapper", @"document", nil];
+    NSMutableDictionary *samples = [NSMutableDictionary dictionary];
+    
+    printf("parsing %lu bytes without a schema, one process per run, median of %lu runs each\n", (unsigned long)length, (unsigned long)runs);
+    
+    for (NSUInteger run = 0; run < runs; run++) {
+        for (NSUInteger index = 0; index < [sides count]; index++) {
+            NSString *side = [sides objectAtIndex:(index + run) % [sides count]];
+            NSDictionary *result = RunTreeSide(side, length);
+            
+            if (!result) {
+                fprintf(stderr, "the %s run failed\n", [side UTF8String]);
+                return 1;
+            }
+            
+            for (NSString *key in result) {
+                NSString *sampleKey = [NSString stringWithFormat:@"%@.%@", side, key];
+                NSMutableArray *values = [samples objectForKey:sampleKey];
+                if (!values) {
+                    values = [NSMutableArray array];
+                    [samples setObject:values forKey:sampleKey];
+                }
+                
+                [values addObject:[result objectForKey:key]];
+            }
+        }
+    }
+    
+    double megabyte = 1024.0 * 1024.0;
+    printf("BKXMLMapper:   %.3f ms to map everything; peak +%.1f MB, %.0f blocks (%.1f MB) held\n", MedianOf([samples objectForKey:@"mapper.parseTime"]), MedianOf([samples objectForKey:@"mapper.peakGrowth"]) / megabyte, MedianOf([samples objectForKey:@"mapper.blocksHeld"]), MedianOf([samples objectForKey:@"mapper.bytesHeld"]) / megabyte);
+    printf("BKXMLDocument: %.3f ms to parse; peak +%.1f MB, %.0f blocks (%.1f MB) held, %.1f MB of it arena\n", MedianOf([samples objectForKey:@"document.parseTime"]), MedianOf([samples objectForKey:@"document.peakGrowth"]) / megabyte, MedianOf([samples objectForKey:@"document.blocksHeld"]), MedianOf([samples objectForKey:@"document.bytesHeld"]) / megabyte, MedianOf([samples objectForKey:@"document.arenaSize"]) / megabyte);
+    printf("               %.3f ms to map the first row, %.3f ms to map all %.0f rows one at a time\n", MedianOf([samples objectForKey:@"document.firstRowTime"]), MedianOf([samples objectForKey:@"document.allRowsTime"]), MedianOf([samples objectForKey:@"document.rowCount"]));
+    return 0;
+}
+
+int main (int argc, const char * argv[])
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    int status = 1;
+    
+    NSString *command = (argc > 1) ? [NSString stringWithUTF8String:argv[1]] : nil;
+    if ([command isEqualToString:@"serve"]) {
+        status = Serve();
+    }
+    else if ([command isEqualToString:@"replay"]) {
+        status = Replay();
+    }
+    else if ([command isEqualToString:@"cancel"]) {
+        status = MeasureCancellation();
+    }
+    else if ([command isEqualToString:@"decode"]) {
+        status = MeasureDecoding();
+    }
+    else if ([command isEqualToString:@"flatten"]) {
+        status = MeasureFlattening();
+    }
+    else if ([command isEqualToString:@"tree"]) {
+        status = MeasureTree();
+    }
+    else if ([command isEqualToString:@"tree-side"]) {
+        status = MeasureTreeSide();
+    }
+    else {
+        PrintUsage();
+    }
+    
+    [pool drain];
+    return status;
+}
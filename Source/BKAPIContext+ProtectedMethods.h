@@ -32,4 +32,10 @@
 - (void)setMinorVersion:(NSUInteger)inVersion;
 - (void)setEndpoint:(NSURL *)inEndpoint;
 - (void)setAuthToken:(NSString *)inAuthToken;
+- (void)setEndpoint:(NSURL *)inEndpoint majorVersion:(NSUInteger)inMajorVersion minorVersion:(NSUInteger)inMinorVersion;
+
+// requests report back what they learn about the session
+- (void)sessionStateDidChange;      // writes the session file, if there is one
+- (void)confirmSession;
+- (void)invalidateSessionOfToken:(NSString *)inToken requiringDiscovery:(BOOL)inRequiresDiscovery error:(NSError *)inError;
 @end
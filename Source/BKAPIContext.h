@@ -26,20 +26,85 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <pthread.h>
+
+@class BKAPIContext;
+@class BKCaseCache;
+@class BKEntityRegistry;
+
+// An immutable copy of a context's session (the discovered endpoint and version, and the auth token) at one point
+// in time. Requests take one snapshot when they are sent, so they never see e.g. a new endpoint with an old token.
+@interface BKAPISessionSnapshot : NSObject
+{
+    NSURL *endpoint;
+    NSUInteger majorVersion;
+    NSUInteger minorVersion;
+    NSString *authToken;
+}
+- (id)initWithEndpoint:(NSURL *)inEndpoint majorVersion:(NSUInteger)inMajorVersion minorVersion:(NSUInteger)inMinorVersion authToken:(NSString *)inAuthToken;
+
+@property (readonly) NSURL *endpoint;
+@property (readonly) NSUInteger majorVersion;
+@property (readonly) NSUInteger minorVersion;
+@property (readonly) NSString *authToken;
+@end
+
+// Called once for any number of requests that failed with BKNotLoggedOnError at about the same time. Log on again
+// (e.g. run a BKLogOnRequest on a queue other than the one the failed operations are waiting on), then call
+// inCompletion with whether it worked. The requests are retried once with the new token.
+typedef void (^BKAPIContextReauthenticationHandler)(BKAPIContext *inContext, void (^inCompletion)(BOOL inSucceeded));
 
 @interface BKAPIContext : NSObject
 {
     NSURL *serviceRoot; 
 	
-	NSUInteger majorVersion;
-	NSUInteger minorVersion;
-    NSURL *endpoint;
-	NSString *authToken;
+    BKAPISessionSnapshot *session;
+    pthread_mutex_t sessionLock;    // guards the session pointer
+
+    NSString *sessionStatePath;
+    BOOL sessionRestored;
+
+    BKAPIContextReauthenticationHandler reauthenticationHandler;
+    NSMutableArray *pendingReauthenticationCompletions;
+
+    BKCaseCache *caseCache;
+    BKEntityRegistry *entityRegistry;
 }
+
+// Session state: the discovered endpoint and API version, and the auth token, as a property list. Restoring it lets
+// a new process skip BKCheckVersionRequest and BKLogOnRequest. The restored state is used as-is until a request
+// proves it wrong; the context then drops what's stale and posts BKAPIContextSessionInvalidatedNotification.
+- (NSDictionary *)sessionState;                                 // nil if there's nothing to save
+- (BOOL)restoreSessionState:(NSDictionary *)inState;            // NO if the state is unusable, e.g. for another serviceRoot
+
+// The file is only readable by the owner (0600) and replaced atomically; a file others can read is refused.
+// Once the path is set, the file is kept up to date as the context changes (e.g. after logging on or off).
+- (BOOL)restoreSessionStateFromFile:(NSString *)inPath;
+- (BOOL)writeSessionStateToFile:(NSString *)inPath;
+
+// Used by BKRequestOperation when a request sent with inToken is rejected. If the context already has a newer token,
+// inCompletion is called right away; otherwise it waits for the one reauthentication in progress (starting it if
+// needed). inCompletion may be called on any thread. Without a reauthenticationHandler, the answer is always NO.
+- (void)reauthenticateAfterRejectionOfToken:(NSString *)inToken completion:(void (^)(BOOL inSucceeded))inCompletion;
+
 @property (retain) NSURL *serviceRoot;
+@property (copy) NSString *sessionStatePath;
+@property (readonly) BOOL sessionRestored;      // YES from a restore until the first successful response
+@property (copy) BKAPIContextReauthenticationHandler reauthenticationHandler;
+@property (retain) BKCaseCache *caseCache;     // nil (no caching) by default
+@property (retain) BKEntityRegistry *entityRegistry;     // updated by every BKListRequest; nil by default
 
+// all of these are read from the same snapshot; use sessionSnapshot if you need more than one of them
+@property (readonly) BKAPISessionSnapshot *sessionSnapshot;
 @property (readonly) NSUInteger majorVersion;
 @property (readonly) NSUInteger minorVersion;
 @property (readonly) NSURL *endpoint;
 @property (readonly) NSString *authToken;
 @end
+
+// Posted (on the thread the failed request completes on) when the context drops a stale session. If
+// BKAPIContextRequiresDiscoveryKey is YES the endpoint is gone as well and BKCheckVersionRequest has to be run again;
+// otherwise only a BKLogOnRequest is needed. BKAPIContextInvalidationErrorKey holds the error that gave it away.
+extern NSString *const BKAPIContextSessionInvalidatedNotification;
+extern NSString *const BKAPIContextRequiresDiscoveryKey;
+extern NSString *const BKAPIContextInvalidationErrorKey;
@@ -28,60 +28,431 @@
 #import "BKAPIContext.h"
 #import "BKAPIContext+ProtectedMethods.h"
 #import "BKPrivateUtilities.h"
+#import <errno.h>
+#import <fcntl.h>
+#import <stdlib.h>
+#import <sys/stat.h>
+#import <unistd.h>
 
-@implementation BKAPIContext
+NSString *const BKAPIContextSessionInvalidatedNotification = @"BKAPIContextSessionInvalidatedNotification";
+NSString *const BKAPIContextRequiresDiscoveryKey = @"BKAPIContextRequiresDiscoveryKey";
+NSString *const BKAPIContextInvalidationErrorKey = @"BKAPIContextInvalidationErrorKey";
+
+// bump the format when the state changes in a way an older restore can't handle
+static NSString *const kSessionStateFormatKey = @"format";
+static const NSInteger kSessionStateFormat = 1;
+static NSString *const kServiceRootKey = @"serviceRoot";
+static NSString *const kEndpointKey = @"endpoint";
+static NSString *const kMajorVersionKey = @"majorVersion";
+static NSString *const kMinorVersionKey = @"minorVersion";
+static NSString *const kAuthTokenKey = @"authToken";
+
+@interface BKAPIContext (PrivateMethods)
+- (void)replaceSessionWithEndpoint:(NSURL *)inEndpoint majorVersion:(NSUInteger)inMajorVersion minorVersion:(NSUInteger)inMinorVersion authToken:(NSString *)inAuthToken;
+- (void)finishReauthentication:(BOOL)inSucceeded;
+@end
+
+@implementation BKAPISessionSnapshot
 - (void)dealloc
 {
-    [serviceRoot release];
     [endpoint release];
     [authToken release];
     [super dealloc];
 }
 
+- (id)initWithEndpoint:(NSURL *)inEndpoint majorVersion:(NSUInteger)inMajorVersion minorVersion:(NSUInteger)inMinorVersion authToken:(NSString *)inAuthToken
+{
+    self = [super init];
+    if (self) {
+        endpoint = [inEndpoint retain];
+        majorVersion = inMajorVersion;
+        minorVersion = inMinorVersion;
+        authToken = [inAuthToken copy];
+    }
+    
+    return self;
+}
+
+@synthesize endpoint;
+@synthesize majorVersion;
+@synthesize minorVersion;
+@synthesize authToken;
+@end
+
+@implementation BKAPIContext
+- (void)dealloc
+{
+    [serviceRoot release];
+    [session release];
+    [sessionStatePath release];
+    [reauthenticationHandler release];
+    [pendingReauthenticationCompletions release];
+    [caseCache release];
+    [entityRegistry release];
+    pthread_mutex_destroy(&sessionLock);
+    [super dealloc];
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        session = [[BKAPISessionSnapshot alloc] initWithEndpoint:nil majorVersion:0 minorVersion:0 authToken:nil];
+        pthread_mutex_init(&sessionLock, NULL);
+    }
+    
+    return self;
+}
+
 - (NSString *)description
 {
-	return [NSString stringWithFormat:@"<%@: %p> {serviceRoot: %@, API version: %@, endpoint: %@, authToken: %@}", [self class], self, BKQuotedString([serviceRoot absoluteString]), [NSString stringWithFormat:@"%jd.%jd", (uintmax_t)majorVersion, (uintmax_t)minorVersion], BKQuotedString([endpoint absoluteString]), BKQuotedString(authToken)];
+	BKAPISessionSnapshot *snapshot = [self sessionSnapshot];
+	return [NSString stringWithFormat:@"<%@: %p> {serviceRoot: %@, API version: %@, endpoint: %@, authToken: %@}", [self class], self, BKQuotedString([[self serviceRoot] absoluteString]), [NSString stringWithFormat:@"%jd.%jd", (uintmax_t)snapshot.majorVersion, (uintmax_t)snapshot.minorVersion], BKQuotedString([snapshot.endpoint absoluteString]), BKQuotedString(snapshot.authToken)];
 }
 
 - (NSURL *)serviceRoot
 {
-	return [[serviceRoot copy] autorelease];
+	@synchronized(self) {
+		return [[serviceRoot copy] autorelease];
+	}
 }
 
 - (void)setServiceRoot:(NSURL *)inRoot
 {
-	BKRetainAssign(serviceRoot, inRoot);
-	majorVersion = 0;
-	minorVersion = 0;
-	BKReleaseClean(endpoint);
-	BKReleaseClean(authToken);
+	@synchronized(self) {
+		BKRetainAssign(serviceRoot, inRoot);
+		[self replaceSessionWithEndpoint:nil majorVersion:0 minorVersion:0 authToken:nil];
+		sessionRestored = NO;
+	}
 }
 
-@synthesize serviceRoot;
-@synthesize majorVersion;
-@synthesize minorVersion;
-@synthesize endpoint;
-@synthesize authToken;
+- (BKAPISessionSnapshot *)sessionSnapshot
+{
+	// only the pointer swap is guarded, so reading never waits for a writer building the next snapshot
+	pthread_mutex_lock(&sessionLock);
+	BKAPISessionSnapshot *snapshot = [session retain];
+	pthread_mutex_unlock(&sessionLock);
+	return [snapshot autorelease];
+}
+
+- (NSUInteger)majorVersion
+{
+	return [self sessionSnapshot].majorVersion;
+}
+
+- (NSUInteger)minorVersion
+{
+	return [self sessionSnapshot].minorVersion;
+}
+
+- (NSURL *)endpoint
+{
+	return [self sessionSnapshot].endpoint;
+}
+
+- (NSString *)authToken
+{
+	return [self sessionSnapshot].authToken;
+}
+
+- (BKAPIContextReauthenticationHandler)reauthenticationHandler
+{
+	@synchronized(self) {
+		return [[reauthenticationHandler copy] autorelease];
+	}
+}
+
+- (void)setReauthenticationHandler:(BKAPIContextReauthenticationHandler)inHandler
+{
+	@synchronized(self) {
+		BKAPIContextReauthenticationHandler tmp = reauthenticationHandler;
+		reauthenticationHandler = [inHandler copy];
+		[tmp release];
+	}
+}
+
+#pragma mark Reauthentication
+
+- (void)reauthenticateAfterRejectionOfToken:(NSString *)inToken completion:(void (^)(BOOL inSucceeded))inCompletion
+{
+	BKAPIContextReauthenticationHandler handler = nil;
+	BOOL renewed = NO;
+	BOOL waits = NO;
+	
+	@synchronized(self) {
+		NSString *currentToken = session.authToken;
+		
+		if (currentToken && ![currentToken isEqualToString:inToken]) {
+			// someone else has logged on since the request was sent
+			renewed = YES;
+		}
+		else if (reauthenticationHandler) {
+			waits = YES;
+			
+			// the first one in starts the reauthentication; everyone else just waits for it
+			if (!pendingReauthenticationCompletions) {
+				pendingReauthenticationCompletions = [[NSMutableArray alloc] init];
+				handler = [[reauthenticationHandler copy] autorelease];
+			}
+			
+			[pendingReauthenticationCompletions addObject:[[inCompletion copy] autorelease]];
+		}
+	}
+	
+	if (!waits) {
+		inCompletion(renewed);
+		return;
+	}
+	
+	if (handler) {
+		handler(self, [[^(BOOL inSucceeded) { [self finishReauthentication:inSucceeded]; } copy] autorelease]);
+	}
+}
+
+#pragma mark Session state
+
+- (NSDictionary *)sessionState
+{
+	NSURL *root = [self serviceRoot];
+	BKAPISessionSnapshot *snapshot = [self sessionSnapshot];
+	
+	if (!root || !snapshot.endpoint) {
+		return nil;
+	}
+	
+	NSMutableDictionary *state = [NSMutableDictionary dictionary];
+	[state setObject:[NSNumber numberWithInteger:kSessionStateFormat] forKey:kSessionStateFormatKey];
+	[state setObject:[root absoluteString] forKey:kServiceRootKey];
+	[state setObject:[snapshot.endpoint absoluteString] forKey:kEndpointKey];
+	[state setObject:[NSNumber numberWithUnsignedInteger:snapshot.majorVersion] forKey:kMajorVersionKey];
+	[state setObject:[NSNumber numberWithUnsignedInteger:snapshot.minorVersion] forKey:kMinorVersionKey];
+	
+	if (snapshot.authToken) {
+		[state setObject:snapshot.authToken forKey:kAuthTokenKey];
+	}
+	
+	return state;
+}
+
+- (BOOL)restoreSessionState:(NSDictionary *)inState
+{
+	if (![inState isKindOfClass:[NSDictionary class]] || [[inState objectForKey:kSessionStateFormatKey] integerValue] != kSessionStateFormat) {
+		return NO;
+	}
+	
+	NSString *rootString = [inState objectForKey:kServiceRootKey];
+	NSString *endpointString = [inState objectForKey:kEndpointKey];
+	NSString *token = [inState objectForKey:kAuthTokenKey];
+	
+	if (![rootString isKindOfClass:[NSString class]] || ![endpointString isKindOfClass:[NSString class]] || (token && ![token isKindOfClass:[NSString class]])) {
+		return NO;
+	}
+	
+	NSURL *restoredRoot = [NSURL URLWithString:rootString];
+	NSURL *restoredEndpoint = [NSURL URLWithString:endpointString];
+	
+	if (!restoredRoot || !restoredEndpoint) {
+		return NO;
+	}
+	
+	@synchronized(self) {
+		// a session for another site is of no use
+		if (serviceRoot && ![[serviceRoot absoluteString] isEqualToString:rootString]) {
+			return NO;
+		}
+		
+		BKRetainAssign(serviceRoot, restoredRoot);
+		[self replaceSessionWithEndpoint:restoredEndpoint majorVersion:[[inState objectForKey:kMajorVersionKey] unsignedIntegerValue] minorVersion:[[inState objectForKey:kMinorVersionKey] unsignedIntegerValue] authToken:token];
+		sessionRestored = YES;
+	}
+	
+	return YES;
+}
+
+- (BOOL)restoreSessionStateFromFile:(NSString *)inPath
+{
+	int fd = open([inPath fileSystemRepresentation], O_RDONLY);
+	if (fd < 0) {
+		return NO;
+	}
+	
+	// the file holds a live token, so it has to be ours and nobody else's
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_uid != getuid() || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+		close(fd);
+		return NO;
+	}
+	
+	NSFileHandle *handle = [[NSFileHandle alloc] initWithFileDescriptor:fd closeOnDealloc:YES];
+	NSData *data = [handle readDataToEndOfFile];
+	[handle release];
+	
+	id state = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:NULL error:NULL];
+	return [self restoreSessionState:state];
+}
+
+- (BOOL)writeSessionStateToFile:(NSString *)inPath
+{
+	NSDictionary *state = [self sessionState];
+	if (!state) {
+		return (unlink([inPath fileSystemRepresentation]) == 0 || errno == ENOENT);
+	}
+	
+	NSData *data = [NSPropertyListSerialization dataWithPropertyList:state format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL];
+	if (!data) {
+		return NO;
+	}
+	
+	// write to a private temp file next to the real one, then rename it, so a reader never sees half a file
+	char *tempPath = strdup([[inPath stringByAppendingString:@".XXXXXX"] fileSystemRepresentation]);
+	int fd = mkstemp(tempPath);
+	BOOL success = (fd >= 0);
+	
+	if (success) {
+		success = (fchmod(fd, S_IRUSR | S_IWUSR) == 0);
+		
+		const uint8_t *bytes = (const uint8_t *)[data bytes];
+		size_t remaining = [data length];
+		
+		while (success && remaining) {
+			ssize_t written = write(fd, bytes, remaining);
+			if (written < 0) {
+				success = (errno == EINTR);
+				continue;
+			}
+			
+			bytes += written;
+			remaining -= (size_t)written;
+		}
+		
+		success = (close(fd) == 0) && success;
+		success = success && (rename(tempPath, [inPath fileSystemRepresentation]) == 0);
+		
+		if (!success) {
+			unlink(tempPath);
+		}
+	}
+	
+	free(tempPath);
+	return success;
+}
+
+@synthesize sessionStatePath;
+@synthesize sessionRestored;
+@synthesize caseCache;
+@synthesize entityRegistry;
 @end
 
 @implementation BKAPIContext (ProtectedMethods)
 - (void)setMajorVersion:(NSUInteger)inVersion
 {
-	majorVersion = inVersion;
+	@synchronized(self) {
+		[self replaceSessionWithEndpoint:session.endpoint majorVersion:inVersion minorVersion:session.minorVersion authToken:session.authToken];
+	}
 }
 
 - (void)setMinorVersion:(NSUInteger)inVersion
 {
-	minorVersion = inVersion;
+	@synchronized(self) {
+		[self replaceSessionWithEndpoint:session.endpoint majorVersion:session.majorVersion minorVersion:inVersion authToken:session.authToken];
+	}
 }
 
 - (void)setAuthToken:(NSString *)inAuthToken
 {
-    BKRetainAssign(authToken, inAuthToken);
+	@synchronized(self) {
+		[self replaceSessionWithEndpoint:session.endpoint majorVersion:session.majorVersion minorVersion:session.minorVersion authToken:inAuthToken];
+	}
 }
 
 - (void)setEndpoint:(NSURL *)inEndpoint
 {
-    BKRetainAssign(endpoint, inEndpoint);
+	@synchronized(self) {
+		[self replaceSessionWithEndpoint:inEndpoint majorVersion:session.majorVersion minorVersion:session.minorVersion authToken:session.authToken];
+	}
+}
+
+- (void)setEndpoint:(NSURL *)inEndpoint majorVersion:(NSUInteger)inMajorVersion minorVersion:(NSUInteger)inMinorVersion
+{
+	@synchronized(self) {
+		[self replaceSessionWithEndpoint:inEndpoint majorVersion:inMajorVersion minorVersion:inMinorVersion authToken:session.authToken];
+	}
+}
+
+- (void)sessionStateDidChange
+{
+	// one writer at a time, so that the file always ends up with the latest state
+	@synchronized(self) {
+		if (sessionStatePath) {
+			[self writeSessionStateToFile:sessionStatePath];
+		}
+	}
+}
+
+- (void)confirmSession
+{
+	sessionRestored = NO;
+}
+
+- (void)invalidateSessionOfToken:(NSString *)inToken requiringDiscovery:(BOOL)inRequiresDiscovery error:(NSError *)inError
+{
+	@synchronized(self) {
+		NSString *currentToken = session.authToken;
+		
+		// several requests in flight may fail for the same reason; only the first one counts, and a token
+		// that has already been replaced by a new logon is left alone
+		if ((inToken != currentToken && ![inToken isEqualToString:currentToken]) || (!currentToken && (!inRequiresDiscovery || !session.endpoint))) {
+			return;
+		}
+		
+		if (inRequiresDiscovery) {
+			[self replaceSessionWithEndpoint:nil majorVersion:0 minorVersion:0 authToken:nil];
+		}
+		else {
+			[self replaceSessionWithEndpoint:session.endpoint majorVersion:session.majorVersion minorVersion:session.minorVersion authToken:nil];
+		}
+		
+		sessionRestored = NO;
+	}
+	
+	[self sessionStateDidChange];
+	
+	NSMutableDictionary *userInfo = [NSMutableDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithBool:inRequiresDiscovery], BKAPIContextRequiresDiscoveryKey, nil];
+	if (inError) {
+		[userInfo setObject:inError forKey:BKAPIContextInvalidationErrorKey];
+	}
+	
+	[[NSNotificationCenter defaultCenter] postNotificationName:BKAPIContextSessionInvalidatedNotification object:self userInfo:userInfo];
+}
+@end
+
+@implementation BKAPIContext (PrivateMethods)
+// the caller holds @synchronized(self), which keeps writers in line; readers only need the session lock
+- (void)replaceSessionWithEndpoint:(NSURL *)inEndpoint majorVersion:(NSUInteger)inMajorVersion minorVersion:(NSUInteger)inMinorVersion authToken:(NSString *)inAuthToken
+{
+	BKAPISessionSnapshot *newSession = [[BKAPISessionSnapshot alloc] initWithEndpoint:inEndpoint majorVersion:inMajorVersion minorVersion:inMinorVersion authToken:inAuthToken];
+	
+	pthread_mutex_lock(&sessionLock);
+	BKAPISessionSnapshot *oldSession = session;
+	session = newSession;
+	pthread_mutex_unlock(&sessionLock);
+	
+	[oldSession release];
+}
+
+- (void)finishReauthentication:(BOOL)inSucceeded
+{
+	NSArray *completions = nil;
+	BOOL renewed = NO;
+	
+	@synchronized(self) {
+		completions = [pendingReauthenticationCompletions autorelease];
+		pendingReauthenticationCompletions = nil;
+		renewed = inSucceeded && (session.authToken != nil);
+	}
+	
+	for (void (^completion)(BOOL) in completions) {
+		completion(renewed);
+	}
 }
 @end
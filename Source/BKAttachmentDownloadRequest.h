@@ -0,0 +1,68 @@
+//
+// BKAttachmentDownloadRequest.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKRequest.h"
+
+@class BKBandwidthThrottle;
+
+// Downloads an attachment (the sURL of an attachment in an event's rgAttachments) straight to disk, through a
+// buffer of BKAttachmentDownloadChunkSize bytes, so memory use is the same whatever the file size. The body first
+// goes to partialDownloadPath; if that file already exists (e.g. an earlier download was cancelled), the request
+// asks for the rest only, with a Range header. When the length checks out, the file is moved to destinationPath,
+// which becomes the processedResponse. Drive it with BKRequestOperation's -beginReceivingHTTPResponse:,
+// -appendReceivedData: and -finishReceivingResponse; the operation paces its reading to the bandwidth throttle.
+@interface BKAttachmentDownloadRequest : BKRequest <BKByteSink>
+{
+    NSString *attachmentURLString;
+    NSString *destinationPath;
+    BKBandwidthThrottle *throttle;
+
+    int fileDescriptor;
+    uint8_t *writeBuffer;
+    NSUInteger bufferedLength;
+    unsigned long long resumeOffset;
+    unsigned long long expectedLength;
+    unsigned long long downloadedLength;
+    NSError *writeError;
+}
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext attachmentURLString:(NSString *)inURLString destinationPath:(NSString *)inPath;
+
+// inAttachment is e.g. one of [event valueForKeyPath:@"rgAttachments.attachment"]; the file is named after its sFileName
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext attachment:(NSDictionary *)inAttachment destinationDirectory:(NSString *)inDirectory;
+
+@property (readonly) NSString *attachmentURLString;
+@property (readonly) NSString *destinationPath;
+@property (readonly) NSString *partialDownloadPath;
+@property (retain) BKBandwidthThrottle *throttle;           // defaults to the shared download throttle; nil for no cap
+@property (readonly) unsigned long long resumeOffset;      // the size of the partial file when the request was sent
+@property (readonly) unsigned long long expectedLength;    // BKUnknownDownloadLength if the server didn't tell
+@property (readonly) unsigned long long downloadedLength;  // including the resumed part
+@property (readonly) NSString *downloadedFilePath;
+@end
+
+extern const NSUInteger BKAttachmentDownloadChunkSize;
+extern const unsigned long long BKUnknownDownloadLength;
@@ -0,0 +1,339 @@
+//
+// BKAttachmentDownloadRequest.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKAttachmentDownloadRequest.h"
+#import "BKRequest+ProtectedMethods.h"
+#import "BKBandwidthThrottle.h"
+#import "BKError.h"
+#import "BKPrivateUtilities.h"
+#import <errno.h>
+#import <fcntl.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+const NSUInteger BKAttachmentDownloadChunkSize = 64 * 1024;
+const unsigned long long BKUnknownDownloadLength = ULLONG_MAX;
+
+static NSString *const kPartialDownloadSuffix = @".part";
+
+@interface BKAttachmentDownloadRequest (PrivateMethods)
+- (BOOL)flushWriteBuffer;
+- (void)closeFile;
+- (NSError *)POSIXError;
+@end
+
+@implementation BKAttachmentDownloadRequest
+- (void)dealloc
+{
+    // whatever has been received stays in the partial file, so the download can be resumed later
+    [self closeFile];
+    free(writeBuffer);
+    
+    [attachmentURLString release];
+    [destinationPath release];
+    [throttle release];
+    [writeError release];
+    [super dealloc];
+}
+
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext attachmentURLString:(NSString *)inURLString destinationPath:(NSString *)inPath
+{
+    self = [super initWithAPIContext:inAPIContext];
+    if (self) {
+        attachmentURLString = [inURLString copy];
+        destinationPath = [inPath copy];
+        throttle = [[BKBandwidthThrottle sharedDownloadThrottle] retain];
+        fileDescriptor = -1;
+        expectedLength = BKUnknownDownloadLength;
+    }
+    
+    return self;
+}
+
+- (id)initWithAPIContext:(BKAPIContext *)inAPIContext attachment:(NSDictionary *)inAttachment destinationDirectory:(NSString *)inDirectory
+{
+    // only take the last component, so that a file name like "../foo" can't escape the directory
+    NSString *filename = [[inAttachment objectForKey:@"sFileName"] lastPathComponent];
+    if (![filename length] || [filename isEqualToString:@".."] || [filename isEqualToString:@"."]) {
+        filename = @"attachment";
+    }
+    
+    return [self initWithAPIContext:inAPIContext attachmentURLString:[inAttachment objectForKey:@"sURL"] destinationPath:[inDirectory stringByAppendingPathComponent:filename]];
+}
+
+#pragma mark NSObject methods
+
+- (NSString *)description
+{
+	return [NSString stringWithFormat:@"<%@: %p> {APIContext: %p, URL: %@, destination: %@}", [self class], self, APIContext, BKQuotedString(attachmentURLString), BKQuotedString(destinationPath)];
+}
+
+// the offset is taken once per send, so the Range header and the check of the response agree
+- (void)requestWillBeSent
+{
+    struct stat st;
+    resumeOffset = (stat([[self partialDownloadPath] fileSystemRepresentation], &st) == 0) ? (unsigned long long)st.st_size : 0;
+}
+
+#pragma mark Dynamic properties
+
+- (NSDictionary *)HTTPRequestHeaders
+{
+    // the bytes have to be the file's own, otherwise ranges and lengths don't add up
+    NSMutableDictionary *headers = [NSMutableDictionary dictionaryWithObjectsAndKeys:@"identity", @"Accept-Encoding", nil];
+    
+    if (resumeOffset) {
+        [headers setObject:[NSString stringWithFormat:@"bytes=%llu-", resumeOffset] forKey:@"Range"];
+    }
+    
+    return headers;
+}
+
+- (NSURL *)requestURL
+{
+    NSString *token = [self authTokenForSending];
+    NSString *URLString = attachmentURLString;
+    
+    if (token) {
+        NSString *separator = ([URLString rangeOfString:@"?"].location == NSNotFound) ? @"?" : @"&";
+        URLString = [URLString stringByAppendingFormat:@"%@token=%@", separator, BKEscapedURLStringFromNSString(token)];
+    }
+    
+    return [NSURL URLWithString:URLString relativeToURL:APIContext.serviceRoot];
+}
+
+- (NSString *)partialDownloadPath
+{
+    return [destinationPath stringByAppendingString:kPartialDownloadSuffix];
+}
+
+- (NSString *)downloadedFilePath
+{
+    return [processedResponse isKindOfClass:[NSString class]] ? processedResponse : nil;
+}
+
+#pragma mark Receiving the body
+
+- (id <BKByteSink>)responseBodySinkForHTTPResponse:(NSHTTPURLResponse *)inResponse error:(NSError **)outError
+{
+    NSInteger status = inResponse ? [inResponse statusCode] : 200;
+    NSDictionary *headers = [inResponse allHeaderFields];
+    NSString *encoding = [headers objectForKey:@"Content-Encoding"];
+    BOOL identity = (!encoding || [encoding caseInsensitiveCompare:@"identity"] == NSOrderedSame);
+    unsigned long long startOffset = 0;
+    NSError *responseError = nil;
+    BOOL discardsPartialFile = NO;
+    
+    [self closeFile];
+    BKReleaseClean(writeError);
+    expectedLength = BKUnknownDownloadLength;
+    
+    if (status == 206) {
+        // Content-Range: bytes 1000-1999/2000 (or bytes 1000-1999/* if the total is unknown)
+        NSString *range = [headers objectForKey:@"Content-Range"];
+        unsigned long long first = 0, last = 0, total = 0;
+        int fields = range ? sscanf([range UTF8String], "bytes %llu-%llu/%llu", &first, &last, &total) : 0;
+        
+        if (fields < 2 || first != resumeOffset) {
+            responseError = [NSError errorWithDomain:BKAPIErrorDomain code:BKDownloadRangeMismatchError userInfo:nil];
+            discardsPartialFile = YES;
+        }
+        else {
+            startOffset = first;
+            expectedLength = (fields == 3) ? total : BKUnknownDownloadLength;
+        }
+    }
+    else if (status == 200) {
+        if (!inResponse && resumeOffset) {
+            // without the status we can't tell if the server honored the Range header
+            responseError = [NSError errorWithDomain:BKAPIErrorDomain code:BKDownloadRangeMismatchError userInfo:nil];
+        }
+        else if (inResponse && identity && [inResponse expectedContentLength] != NSURLResponseUnknownLength) {
+            expectedLength = (unsigned long long)[inResponse expectedContentLength];
+        }
+    }
+    else {
+        responseError = [NSError errorWithDomain:BKConnectionErrorDomain code:BKConnectionServerHTTPError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithInteger:status], @"statusCode", nil]];
+        
+        // 416 means the partial file doesn't fit the attachment any more; other errors may go away on a retry
+        discardsPartialFile = (status == 416);
+    }
+    
+    if (responseError) {
+        if (discardsPartialFile) {
+            unlink([[self partialDownloadPath] fileSystemRepresentation]);
+        }
+        
+        if (outError) {
+            *outError = responseError;
+        }
+        
+        return nil;
+    }
+    
+    fileDescriptor = open([[self partialDownloadPath] fileSystemRepresentation], O_WRONLY | O_CREAT, 0644);
+    if (fileDescriptor < 0 || ftruncate(fileDescriptor, (off_t)startOffset) != 0 || lseek(fileDescriptor, (off_t)startOffset, SEEK_SET) < 0) {
+        if (outError) {
+            *outError = [self POSIXError];
+        }
+        
+        bufferedLength = 0;
+        [self closeFile];
+        return nil;
+    }
+    
+    if (!writeBuffer) {
+        writeBuffer = (uint8_t *)malloc(BKAttachmentDownloadChunkSize);
+    }
+    
+    bufferedLength = 0;
+    downloadedLength = startOffset;
+    return self;
+}
+
+- (BOOL)appendBytes:(const void *)inBytes length:(NSUInteger)inLength
+{
+    if (fileDescriptor < 0) {
+        return NO;
+    }
+    
+    const uint8_t *bytes = (const uint8_t *)inBytes;
+    NSUInteger remaining = inLength;
+    
+    while (remaining) {
+        NSUInteger copyLength = MIN(remaining, BKAttachmentDownloadChunkSize - bufferedLength);
+        memcpy(writeBuffer + bufferedLength, bytes, copyLength);
+        bufferedLength += copyLength;
+        bytes += copyLength;
+        remaining -= copyLength;
+        
+        if (bufferedLength == BKAttachmentDownloadChunkSize && ![self flushWriteBuffer]) {
+            self.error = writeError;
+            return NO;
+        }
+    }
+    
+    downloadedLength += inLength;
+    return YES;
+}
+
+- (BKBandwidthThrottle *)bandwidthThrottle
+{
+    return throttle;
+}
+
+- (NSError *)finishResponseBody
+{
+    if (writeError) {
+        return [[writeError retain] autorelease];
+    }
+    
+    if (fileDescriptor < 0) {
+        return [NSError errorWithDomain:BKAPIErrorDomain code:BKResponseDecodingError userInfo:nil];
+    }
+    
+    if (![self flushWriteBuffer]) {
+        return [[writeError retain] autorelease];
+    }
+    
+    struct stat st;
+    NSError *statError = (fstat(fileDescriptor, &st) == 0) ? nil : [self POSIXError];
+    [self closeFile];
+    
+    if (statError) {
+        return statError;
+    }
+    
+    unsigned long long fileLength = (unsigned long long)st.st_size;
+    
+    if (fileLength != downloadedLength || (expectedLength != BKUnknownDownloadLength && fileLength != expectedLength)) {
+        // a short file can still be completed with another request; a long one can't
+        if (expectedLength != BKUnknownDownloadLength && fileLength > expectedLength) {
+            unlink([[self partialDownloadPath] fileSystemRepresentation]);
+        }
+        
+        return [NSError errorWithDomain:BKAPIErrorDomain code:BKDownloadSizeMismatchError userInfo:nil];
+    }
+    
+    if (rename([[self partialDownloadPath] fileSystemRepresentation], [destinationPath fileSystemRepresentation]) != 0) {
+        return [self POSIXError];
+    }
+    
+    self.processedResponse = destinationPath;
+    return nil;
+}
+
+@synthesize attachmentURLString;
+@synthesize destinationPath;
+@synthesize throttle;
+@synthesize resumeOffset;
+@synthesize expectedLength;
+@synthesize downloadedLength;
+@end
+
+@implementation BKAttachmentDownloadRequest (PrivateMethods)
+- (BOOL)flushWriteBuffer
+{
+    const uint8_t *bytes = writeBuffer;
+    NSUInteger remaining = bufferedLength;
+    
+    while (remaining) {
+        ssize_t written = write(fileDescriptor, bytes, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            BKRetainAssign(writeError, [self POSIXError]);
+            close(fileDescriptor);
+            fileDescriptor = -1;
+            bufferedLength = 0;
+            return NO;
+        }
+        
+        bytes += written;
+        remaining -= (NSUInteger)written;
+    }
+    
+    bufferedLength = 0;
+    return YES;
+}
+
+- (void)closeFile
+{
+    // a failed flush closes the file itself
+    if (fileDescriptor >= 0 && [self flushWriteBuffer]) {
+        close(fileDescriptor);
+        fileDescriptor = -1;
+    }
+}
+
+- (NSError *)POSIXError
+{
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+}
+@end
@@ -0,0 +1,46 @@
+//
+// BKBandwidthThrottle.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+// A token bucket shared by any number of transfers, e.g. all the attachment downloads of a process. Each transfer
+// reports the bytes it has moved and stops reading for as long as the throttle says, so that together they stay under
+// the rate. BKRequestOperation does this for requests that return a -bandwidthThrottle.
+@interface BKBandwidthThrottle : NSObject
+{
+    NSUInteger bytesPerSecond;
+    double availableBytes;
+    CFAbsoluteTime lastRefillTime;
+}
++ (BKBandwidthThrottle *)sharedDownloadThrottle;    // unlimited until you set its bytesPerSecond
+- (id)initWithBytesPerSecond:(NSUInteger)inRate;
+
+// takes inLength bytes out of the bucket and returns how long the caller should wait before moving more
+- (NSTimeInterval)delayForTransferOfLength:(NSUInteger)inLength;
+
+@property (assign) NSUInteger bytesPerSecond;      // 0 means unlimited
+@end
@@ -0,0 +1,99 @@
+//
+// BKBandwidthThrottle.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKBandwidthThrottle.h"
+
+@implementation BKBandwidthThrottle
++ (BKBandwidthThrottle *)sharedDownloadThrottle
+{
+    static BKBandwidthThrottle *sharedDownloadThrottle = nil;
+    
+    @synchronized(self) {
+        if (!sharedDownloadThrottle) {
+            sharedDownloadThrottle = [[BKBandwidthThrottle alloc] initWithBytesPerSecond:0];
+        }
+    }
+    
+    return sharedDownloadThrottle;
+}
+
+- (id)init
+{
+    return [self initWithBytesPerSecond:0];
+}
+
+- (id)initWithBytesPerSecond:(NSUInteger)inRate
+{
+    self = [super init];
+    if (self) {
+        bytesPerSecond = inRate;
+        availableBytes = (double)inRate;
+        lastRefillTime = CFAbsoluteTimeGetCurrent();
+    }
+    
+    return self;
+}
+
+- (NSTimeInterval)delayForTransferOfLength:(NSUInteger)inLength
+{
+    @synchronized(self) {
+        if (!bytesPerSecond) {
+            return 0.0;
+        }
+        
+        // the bucket holds at most one second's worth, so an idle period doesn't allow an unbounded burst
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        availableBytes = MIN((double)bytesPerSecond, availableBytes + (now - lastRefillTime) * (double)bytesPerSecond);
+        lastRefillTime = now;
+        
+        // the bucket may go negative; whoever comes next then waits for the debt to be paid off as well
+        availableBytes -= (double)inLength;
+        
+        if (availableBytes >= 0.0) {
+            return 0.0;
+        }
+        
+        return -availableBytes / (double)bytesPerSecond;
+    }
+}
+
+- (NSUInteger)bytesPerSecond
+{
+    @synchronized(self) {
+        return bytesPerSecond;
+    }
+}
+
+- (void)setBytesPerSecond:(NSUInteger)inRate
+{
+    @synchronized(self) {
+        bytesPerSecond = inRate;
+        availableBytes = (double)inRate;
+        lastRefillTime = CFAbsoluteTimeGetCurrent();
+    }
+}
+@end
@@ -0,0 +1,118 @@
+//
+// BKCaseCache.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+
+// The cache is split into this many stripes by key, each with its own lock, LRU list and share of the budget
+#define BKCaseCacheStripeCount 16
+
+struct BKCaseCacheEntry;
+
+typedef struct BKCaseCacheStripe {
+    pthread_mutex_t lock;
+    CFMutableDictionaryRef entries;         // key -> struct BKCaseCacheEntry *
+    struct BKCaseCacheEntry *mostRecent;
+    struct BKCaseCacheEntry *leastRecent;
+    size_t residentBytes;
+    CFMutableDictionaryRef generations;     // key -> times it's been invalidated, for the keys that ever were
+    NSUInteger clearCount;
+    NSUInteger hitCount;
+    NSUInteger missCount;
+    NSUInteger evictionCount;
+} BKCaseCacheStripe;
+
+// A memory-bounded cache for the case and event dictionaries FogBugz returns, keyed by ixBug and ixBugEvent. Each
+// entry is charged an estimate of its size (see +estimatedSizeOfObject:), and once the stripe an entry falls in is
+// over its share of the byte budget, the least recently used entries of that stripe are evicted. All methods are
+// thread-safe; requests for different keys mostly take different locks.
+//
+// Objects are kept as they are, not copied, so don't mutate them once they're in the cache.
+//
+// Each stripe gets a sixteenth of the byte budget, and an entry larger than that (say, a case with a very long event
+// history) isn't kept at all, so make the budget at least 16 times the largest entry you want cached.
+//
+// Set one as a BKAPIContext's caseCache and BKQueryCaseRequest stores the cases it fetches (with the columns that
+// were asked for), BKQueryEventRequest stores event lists and answers from them without going to the server, and
+// BKEditCaseRequest drops the cases it changes. Use a separate cache (or -removeAllObjects) for each account, as
+// what a case shows depends on who's asking.
+@interface BKCaseCache : NSObject
+{
+    size_t byteBudget;
+    volatile int64_t cacheGeneration;
+    BKCaseCacheStripe stripes[BKCaseCacheStripeCount];
+}
+- (id)initWithByteBudget:(size_t)inBudget;
+
+- (NSDictionary *)caseForIndex:(NSUInteger)inCaseIndex;
+- (void)setCase:(NSDictionary *)inCase forIndex:(NSUInteger)inCaseIndex;
+- (void)addCases:(NSArray *)inCases;            // keyed by each case's ixBug
+
+- (NSDictionary *)eventForIndex:(NSUInteger)inEventIndex;
+- (void)setEvent:(NSDictionary *)inEvent forIndex:(NSUInteger)inEventIndex;
+
+// the complete event list of a case, as returned by BKQueryEventRequest
+- (NSArray *)eventsOfCase:(NSUInteger)inCaseIndex;
+- (void)setEvents:(NSArray *)inEvents ofCase:(NSUInteger)inCaseIndex;
+
+- (void)removeCase:(NSUInteger)inCaseIndex;     // and its event list
+- (void)removeAllObjects;
+
+// The generation of a case changes every time the case is removed (or the cache emptied). Take it before asking the
+// server, and store the answer with -setEvents:ofCase:generation:; if the case was removed in between (e.g. because
+// it was edited), what the server said may already be out of date, so it's not stored and NO is returned.
+- (NSUInteger)generationOfCase:(NSUInteger)inCaseIndex;
+- (BOOL)setEvents:(NSArray *)inEvents ofCase:(NSUInteger)inCaseIndex generation:(NSUInteger)inGeneration;
+
+// The same for a search, where the cases aren't known in advance: the cache generation changes whenever any case is
+// removed, and -addCases:cacheGeneration: stores nothing once it has.
+- (NSUInteger)cacheGeneration;
+- (void)addCases:(NSArray *)inCases cacheGeneration:(NSUInteger)inGeneration;
+
+// a rough count of the bytes an object graph of strings, numbers, dates, data, arrays and dictionaries takes
++ (size_t)estimatedSizeOfObject:(id)inObject;
+
+// An NSDictionary of the numbers below, for logging or exporting to a monitoring system. The keys are
+// BKCaseCacheHitCountKey, BKCaseCacheMissCountKey, BKCaseCacheHitRatioKey, BKCaseCacheEvictionCountKey,
+// BKCaseCacheResidentBytesKey and BKCaseCacheEntryCountKey.
+- (NSDictionary *)statistics;
+
+@property (readonly) size_t byteBudget;
+@property (readonly) NSUInteger hitCount;
+@property (readonly) NSUInteger missCount;
+@property (readonly) double hitRatio;           // 0 before the first lookup
+@property (readonly) NSUInteger evictionCount;
+@property (readonly) size_t residentBytes;
+@property (readonly) NSUInteger entryCount;
+@end
+
+extern NSString *const BKCaseCacheHitCountKey;
+extern NSString *const BKCaseCacheMissCountKey;
+extern NSString *const BKCaseCacheHitRatioKey;
+extern NSString *const BKCaseCacheEvictionCountKey;
+extern NSString *const BKCaseCacheResidentBytesKey;
+extern NSString *const BKCaseCacheEntryCountKey;
@@ -0,0 +1,508 @@
+//
+// BKCaseCache.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKCaseCache.h"
+#import "BKPrivateUtilities.h"
+#import <objc/runtime.h>
+#import <libkern/OSAtomic.h>
+
+NSString *const BKCaseCacheHitCountKey = @"BKCaseCacheHitCount";
+NSString *const BKCaseCacheMissCountKey = @"BKCaseCacheMissCount";
+NSString *const BKCaseCacheHitRatioKey = @"BKCaseCacheHitRatio";
+NSString *const BKCaseCacheEvictionCountKey = @"BKCaseCacheEvictionCount";
+NSString *const BKCaseCacheResidentBytesKey = @"BKCaseCacheResidentBytes";
+NSString *const BKCaseCacheEntryCountKey = @"BKCaseCacheEntryCount";
+
+// what an entry costs besides its object: the entry itself and its slot in the stripe's dictionary
+static const size_t kEntryOverhead = 64;
+
+// the kind of an entry goes in the low bits of its key; none is 0, so neither is any key
+enum {
+    kCaseEntryKind = 1,
+    kEventEntryKind = 2,
+    kCaseEventsEntryKind = 3
+};
+
+typedef struct BKCaseCacheEntry {
+    uintptr_t key;
+    id object;
+    size_t size;
+    struct BKCaseCacheEntry *newer;
+    struct BKCaseCacheEntry *older;
+} BKCaseCacheEntry;
+
+NS_INLINE uintptr_t BKCaseCacheKey(NSUInteger inIndex, uintptr_t inKind)
+{
+    return ((uintptr_t)inIndex << 2) | inKind;
+}
+
+NS_INLINE void BKCaseCacheUnlink(BKCaseCacheStripe *ioStripe, BKCaseCacheEntry *inEntry)
+{
+    if (inEntry->newer) {
+        inEntry->newer->older = inEntry->older;
+    }
+    else {
+        ioStripe->mostRecent = inEntry->older;
+    }
+    
+    if (inEntry->older) {
+        inEntry->older->newer = inEntry->newer;
+    }
+    else {
+        ioStripe->leastRecent = inEntry->newer;
+    }
+    
+    inEntry->newer = NULL;
+    inEntry->older = NULL;
+}
+
+NS_INLINE void BKCaseCacheLinkAsMostRecent(BKCaseCacheStripe *ioStripe, BKCaseCacheEntry *inEntry)
+{
+    inEntry->older = ioStripe->mostRecent;
+    inEntry->newer = NULL;
+    
+    if (ioStripe->mostRecent) {
+        ioStripe->mostRecent->newer = inEntry;
+    }
+    
+    ioStripe->mostRecent = inEntry;
+    
+    if (!ioStripe->leastRecent) {
+        ioStripe->leastRecent = inEntry;
+    }
+}
+
+// unlinks and frees the entry, handing its object over to ioReleasePool (created if needed) so that a large
+// graph isn't torn down while the stripe is locked
+static void BKCaseCacheDiscard(BKCaseCacheStripe *ioStripe, BKCaseCacheEntry *inEntry, NSMutableArray **ioReleasePool)
+{
+    BKCaseCacheUnlink(ioStripe, inEntry);
+    CFDictionaryRemoveValue(ioStripe->entries, (const void *)inEntry->key);
+    ioStripe->residentBytes -= inEntry->size;
+    
+    if (!*ioReleasePool) {
+        *ioReleasePool = [[NSMutableArray alloc] init];
+    }
+    
+    [*ioReleasePool addObject:inEntry->object];
+    [inEntry->object release];
+    free(inEntry);
+}
+
+static NSUInteger BKIndexValue(id inValue)
+{
+    // mapped values are strings, or numbers if the response schema says so
+    return [inValue respondsToSelector:@selector(longLongValue)] ? (NSUInteger)[inValue longLongValue] : 0;
+}
+
+// the stripe is locked; both counts only go up, so their sum changes whenever either does
+NS_INLINE NSUInteger BKCaseCacheGeneration(BKCaseCacheStripe *inStripe, uintptr_t inKey)
+{
+    return inStripe->clearCount + (NSUInteger)(uintptr_t)CFDictionaryGetValue(inStripe->generations, (const void *)inKey);
+}
+
+@interface BKCaseCache (PrivateMethods)
+- (BKCaseCacheStripe *)stripeForKey:(uintptr_t)inKey;
+- (id)objectForKey:(uintptr_t)inKey;
+- (void)setObject:(id)inObject forKey:(uintptr_t)inKey;
+- (BOOL)setObject:(id)inObject forKey:(uintptr_t)inKey generation:(NSUInteger)inGeneration cacheGeneration:(NSUInteger)inCacheGeneration;
+- (void)removeObjectForKey:(uintptr_t)inKey;
+- (void)invalidateObjectForKey:(uintptr_t)inKey;
+- (NSUInteger)generationOfKey:(uintptr_t)inKey;
+@end
+
+
+@implementation BKCaseCache
+- (void)dealloc
+{
+    [self removeAllObjects];
+    
+    for (NSUInteger i = 0; i < BKCaseCacheStripeCount; i++) {
+        CFRelease(stripes[i].entries);
+        CFRelease(stripes[i].generations);
+        pthread_mutex_destroy(&stripes[i].lock);
+    }
+    
+    [super dealloc];
+}
+
+- (id)initWithByteBudget:(size_t)inBudget
+{
+    self = [super init];
+    if (self) {
+        byteBudget = inBudget;
+        
+        for (NSUInteger i = 0; i < BKCaseCacheStripeCount; i++) {
+            pthread_mutex_init(&stripes[i].lock, NULL);
+            
+            // the keys are plain integers and the values are owned by the stripe
+            stripes[i].entries = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+            stripes[i].generations = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+        }
+    }
+    
+    return self;
+}
+
+- (NSDictionary *)caseForIndex:(NSUInteger)inCaseIndex
+{
+    return [self objectForKey:BKCaseCacheKey(inCaseIndex, kCaseEntryKind)];
+}
+
+- (void)setCase:(NSDictionary *)inCase forIndex:(NSUInteger)inCaseIndex
+{
+    [self setObject:inCase forKey:BKCaseCacheKey(inCaseIndex, kCaseEntryKind)];
+}
+
+- (void)addCases:(NSArray *)inCases
+{
+    [self addCases:inCases cacheGeneration:NSNotFound];
+}
+
+- (NSDictionary *)eventForIndex:(NSUInteger)inEventIndex
+{
+    return [self objectForKey:BKCaseCacheKey(inEventIndex, kEventEntryKind)];
+}
+
+- (void)setEvent:(NSDictionary *)inEvent forIndex:(NSUInteger)inEventIndex
+{
+    [self setObject:inEvent forKey:BKCaseCacheKey(inEventIndex, kEventEntryKind)];
+}
+
+- (NSArray *)eventsOfCase:(NSUInteger)inCaseIndex
+{
+    return [self objectForKey:BKCaseCacheKey(inCaseIndex, kCaseEventsEntryKind)];
+}
+
+- (void)setEvents:(NSArray *)inEvents ofCase:(NSUInteger)inCaseIndex
+{
+    [self setObject:inEvents forKey:BKCaseCacheKey(inCaseIndex, kCaseEventsEntryKind)];
+}
+
+- (void)removeCase:(NSUInteger)inCaseIndex
+{
+    [self invalidateObjectForKey:BKCaseCacheKey(inCaseIndex, kCaseEntryKind)];
+    [self invalidateObjectForKey:BKCaseCacheKey(inCaseIndex, kCaseEventsEntryKind)];
+}
+
+- (NSUInteger)generationOfCase:(NSUInteger)inCaseIndex
+{
+    return [self generationOfKey:BKCaseCacheKey(inCaseIndex, kCaseEventsEntryKind)];
+}
+
+- (BOOL)setEvents:(NSArray *)inEvents ofCase:(NSUInteger)inCaseIndex generation:(NSUInteger)inGeneration
+{
+    return [self setObject:inEvents forKey:BKCaseCacheKey(inCaseIndex, kCaseEventsEntryKind) generation:inGeneration cacheGeneration:NSNotFound];
+}
+
+- (NSUInteger)cacheGeneration
+{
+    return (NSUInteger)OSAtomicAdd64Barrier(0, &cacheGeneration);
+}
+
+- (void)addCases:(NSArray *)inCases cacheGeneration:(NSUInteger)inGeneration
+{
+    for (NSDictionary *caseDictionary in inCases) {
+        if (![caseDictionary isKindOfClass:[NSDictionary class]]) {
+            continue;
+        }
+        
+        NSUInteger caseIndex = BKIndexValue([caseDictionary objectForKey:@"ixBug"]);
+        if (caseIndex && ![self setObject:caseDictionary forKey:BKCaseCacheKey(caseIndex, kCaseEntryKind) generation:NSNotFound cacheGeneration:inGeneration]) {
+            break;
+        }
+    }
+}
+
+- (void)removeAllObjects
+{
+    NSMutableArray *releasePool = nil;
+    
+    for (NSUInteger i = 0; i < BKCaseCacheStripeCount; i++) {
+        BKCaseCacheStripe *stripe = &stripes[i];
+        
+        pthread_mutex_lock(&stripe->lock);
+        while (stripe->leastRecent) {
+            BKCaseCacheDiscard(stripe, stripe->leastRecent, &releasePool);
+        }
+        
+        stripe->clearCount++;
+        OSAtomicIncrement64Barrier(&cacheGeneration);
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    
+    [releasePool release];
+}
+
++ (size_t)estimatedSizeOfObject:(id)inObject
+{
+    if (!inObject) {
+        return 0;
+    }
+    
+    // CFString keeps ASCII text (most of what FogBugz sends) at one byte per character
+    if ([inObject isKindOfClass:[NSString class]]) {
+        return 32 + [(NSString *)inObject length];
+    }
+    
+    if ([inObject isKindOfClass:[NSData class]]) {
+        return 32 + [(NSData *)inObject length];
+    }
+    
+    if ([inObject isKindOfClass:[NSArray class]]) {
+        size_t size = 32 + [(NSArray *)inObject count] * sizeof(id);
+        for (id element in (NSArray *)inObject) {
+            size += [self estimatedSizeOfObject:element];
+        }
+        
+        return size;
+    }
+    
+    if ([inObject isKindOfClass:[NSDictionary class]]) {
+        // keys are counted too, even though the mapper's keys are often shared between dictionaries
+        size_t size = 48 + [(NSDictionary *)inObject count] * 2 * sizeof(id);
+        for (id key in (NSDictionary *)inObject) {
+            size += [self estimatedSizeOfObject:key] + [self estimatedSizeOfObject:[(NSDictionary *)inObject objectForKey:key]];
+        }
+        
+        return size;
+    }
+    
+    return class_getInstanceSize([inObject class]);
+}
+
+- (NSDictionary *)statistics
+{
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+        [NSNumber numberWithUnsignedInteger:self.hitCount], BKCaseCacheHitCountKey,
+        [NSNumber numberWithUnsignedInteger:self.missCount], BKCaseCacheMissCountKey,
+        [NSNumber numberWithDouble:self.hitRatio], BKCaseCacheHitRatioKey,
+        [NSNumber numberWithUnsignedInteger:self.evictionCount], BKCaseCacheEvictionCountKey,
+        [NSNumber numberWithUnsignedLongLong:(unsigned long long)self.residentBytes], BKCaseCacheResidentBytesKey,
+        [NSNumber numberWithUnsignedInteger:self.entryCount], BKCaseCacheEntryCountKey,
+        nil];
+}
+
+#define BKCaseCacheSum(type, expression) do { \
+        type sum = 0; \
+        for (NSUInteger i = 0; i < BKCaseCacheStripeCount; i++) { \
+            BKCaseCacheStripe *stripe = &stripes[i]; \
+            pthread_mutex_lock(&stripe->lock); \
+            sum += (expression); \
+            pthread_mutex_unlock(&stripe->lock); \
+        } \
+        return sum; \
+    } while (0)
+
+- (NSUInteger)hitCount
+{
+    BKCaseCacheSum(NSUInteger, stripe->hitCount);
+}
+
+- (NSUInteger)missCount
+{
+    BKCaseCacheSum(NSUInteger, stripe->missCount);
+}
+
+- (double)hitRatio
+{
+    NSUInteger hits = self.hitCount;
+    NSUInteger lookups = hits + self.missCount;
+    return lookups ? (double)hits / (double)lookups : 0.0;
+}
+
+- (NSUInteger)evictionCount
+{
+    BKCaseCacheSum(NSUInteger, stripe->evictionCount);
+}
+
+- (size_t)residentBytes
+{
+    BKCaseCacheSum(size_t, stripe->residentBytes);
+}
+
+- (NSUInteger)entryCount
+{
+    BKCaseCacheSum(NSUInteger, (NSUInteger)CFDictionaryGetCount(stripe->entries));
+}
+
+#undef BKCaseCacheSum
+
+@synthesize byteBudget;
+@end
+
+
+@implementation BKCaseCache (PrivateMethods)
+- (BKCaseCacheStripe *)stripeForKey:(uintptr_t)inKey
+{
+    // neighboring case numbers should land in different stripes
+    uint32_t hash = (uint32_t)(inKey ^ (inKey >> 16)) * 2654435761u;
+    return &stripes[(hash >> 16) & (BKCaseCacheStripeCount - 1)];
+}
+
+- (id)objectForKey:(uintptr_t)inKey
+{
+    BKCaseCacheStripe *stripe = [self stripeForKey:inKey];
+    id object = nil;
+    
+    pthread_mutex_lock(&stripe->lock);
+    
+    BKCaseCacheEntry *entry = (BKCaseCacheEntry *)CFDictionaryGetValue(stripe->entries, (const void *)inKey);
+    if (entry) {
+        stripe->hitCount++;
+        BKCaseCacheUnlink(stripe, entry);
+        BKCaseCacheLinkAsMostRecent(stripe, entry);
+        
+        // retained before unlocking, as another thread may evict it right after
+        object = [entry->object retain];
+    }
+    else {
+        stripe->missCount++;
+    }
+    
+    pthread_mutex_unlock(&stripe->lock);
+    return [object autorelease];
+}
+
+- (void)setObject:(id)inObject forKey:(uintptr_t)inKey
+{
+    [self setObject:inObject forKey:inKey generation:NSNotFound cacheGeneration:NSNotFound];
+}
+
+// NSNotFound for any generation of the key, or of the whole cache
+- (BOOL)setObject:(id)inObject forKey:(uintptr_t)inKey generation:(NSUInteger)inGeneration cacheGeneration:(NSUInteger)inCacheGeneration
+{
+    BKCaseCacheStripe *stripe = [self stripeForKey:inKey];
+    
+    // sized outside the lock; walking a case with hundreds of events takes a while
+    size_t size = inObject ? [BKCaseCache estimatedSizeOfObject:inObject] + kEntryOverhead : 0;
+    size_t stripeBudget = byteBudget / BKCaseCacheStripeCount;
+    NSMutableArray *releasePool = nil;
+    
+    pthread_mutex_lock(&stripe->lock);
+    
+    // checked under the same lock -invalidateObjectForKey: takes, so an object is never stored after its invalidation
+    // (the cache generation is bumped under the lock of the stripe the invalidated key is in)
+    if ((inGeneration != NSNotFound && inGeneration != BKCaseCacheGeneration(stripe, inKey)) ||
+        (inCacheGeneration != NSNotFound && inCacheGeneration != (NSUInteger)OSAtomicAdd64Barrier(0, &cacheGeneration))) {
+        pthread_mutex_unlock(&stripe->lock);
+        return NO;
+    }
+    
+    BKCaseCacheEntry *entry = (BKCaseCacheEntry *)CFDictionaryGetValue(stripe->entries, (const void *)inKey);
+    
+    // an object that would push out everything else and still not fit isn't kept, and neither is a stale copy
+    if (!inObject || size > stripeBudget) {
+        if (entry) {
+            BKCaseCacheDiscard(stripe, entry, &releasePool);
+        }
+        
+        pthread_mutex_unlock(&stripe->lock);
+        [releasePool release];
+        return YES;
+    }
+    
+    if (entry) {
+        BKCaseCacheUnlink(stripe, entry);
+        stripe->residentBytes -= entry->size;
+        
+        if (!releasePool) {
+            releasePool = [[NSMutableArray alloc] init];
+        }
+        
+        [releasePool addObject:entry->object];
+        [entry->object release];
+    }
+    else {
+        entry = (BKCaseCacheEntry *)calloc(1, sizeof(BKCaseCacheEntry));
+        entry->key = inKey;
+        CFDictionarySetValue(stripe->entries, (const void *)inKey, entry);
+    }
+    
+    entry->object = [inObject retain];
+    entry->size = size;
+    stripe->residentBytes += size;
+    BKCaseCacheLinkAsMostRecent(stripe, entry);
+    
+    while (stripe->residentBytes > stripeBudget && stripe->leastRecent != entry) {
+        BKCaseCacheDiscard(stripe, stripe->leastRecent, &releasePool);
+        stripe->evictionCount++;
+    }
+    
+    pthread_mutex_unlock(&stripe->lock);
+    [releasePool release];
+    return YES;
+}
+
+- (void)removeObjectForKey:(uintptr_t)inKey
+{
+    BKCaseCacheStripe *stripe = [self stripeForKey:inKey];
+    NSMutableArray *releasePool = nil;
+    
+    pthread_mutex_lock(&stripe->lock);
+    
+    BKCaseCacheEntry *entry = (BKCaseCacheEntry *)CFDictionaryGetValue(stripe->entries, (const void *)inKey);
+    if (entry) {
+        BKCaseCacheDiscard(stripe, entry, &releasePool);
+    }
+    
+    pthread_mutex_unlock(&stripe->lock);
+    [releasePool release];
+}
+
+- (void)invalidateObjectForKey:(uintptr_t)inKey
+{
+    BKCaseCacheStripe *stripe = [self stripeForKey:inKey];
+    NSMutableArray *releasePool = nil;
+    
+    pthread_mutex_lock(&stripe->lock);
+    
+    BKCaseCacheEntry *entry = (BKCaseCacheEntry *)CFDictionaryGetValue(stripe->entries, (const void *)inKey);
+    if (entry) {
+        BKCaseCacheDiscard(stripe, entry, &releasePool);
+    }
+    
+    // a word per key that was ever invalidated, i.e. per case that was edited
+    NSUInteger count = (NSUInteger)(uintptr_t)CFDictionaryGetValue(stripe->generations, (const void *)inKey);
+    CFDictionarySetValue(stripe->generations, (const void *)inKey, (const void *)(uintptr_t)(count + 1));
+    OSAtomicIncrement64Barrier(&cacheGeneration);
+    
+    pthread_mutex_unlock(&stripe->lock);
+    [releasePool release];
+}
+
+- (NSUInteger)generationOfKey:(uintptr_t)inKey
+{
+    BKCaseCacheStripe *stripe = [self stripeForKey:inKey];
+    
+    pthread_mutex_lock(&stripe->lock);
+    NSUInteger generation = BKCaseCacheGeneration(stripe, inKey);
+    pthread_mutex_unlock(&stripe->lock);
+    
+    return generation;
+}
+@end
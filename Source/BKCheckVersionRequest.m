@@ -36,9 +36,24 @@
 
 - (id)postprocessResponse:(NSDictionary *)inXMLMappedResponse
 {
-    [APIContext setEndpoint:[NSURL URLWithString:[inXMLMappedResponse objectForKey:@"url"] relativeToURL:APIContext.serviceRoot]];
-	[APIContext setMajorVersion:[[inXMLMappedResponse objectForKey:@"version"] integerValue]];
-	[APIContext setMinorVersion:[[inXMLMappedResponse objectForKey:@"minversion"] integerValue]];
+    NSURL *newEndpoint = [NSURL URLWithString:[inXMLMappedResponse objectForKey:@"url"] relativeToURL:APIContext.serviceRoot];
+    NSUInteger newMajorVersion = [[inXMLMappedResponse objectForKey:@"version"] integerValue];
+    NSUInteger newMinorVersion = [[inXMLMappedResponse objectForKey:@"minversion"] integerValue];
+    BKAPISessionSnapshot *session = APIContext.sessionSnapshot;
+    
+    // a token obtained from another endpoint or API version (e.g. a restored one) can't be trusted
+    BOOL mismatched = session.endpoint && (![[session.endpoint absoluteURL] isEqual:[newEndpoint absoluteURL]] || session.majorVersion != newMajorVersion || session.minorVersion != newMinorVersion);
+    if (mismatched) {
+        [APIContext invalidateSessionOfToken:session.authToken requiringDiscovery:NO error:nil];
+    }
+    
+    [APIContext setEndpoint:newEndpoint majorVersion:newMajorVersion minorVersion:newMinorVersion];
+    [APIContext sessionStateDidChange];
 	return [super postprocessResponse:inXMLMappedResponse];
 }
+
+- (BOOL)requiresAuthToken
+{
+    return NO;
+}
 @end
@@ -0,0 +1,51 @@
+//
+// BKContentDecoder.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKByteSink.h"
+
+// Decodes an HTTP response body (Content-Encoding: gzip, deflate or identity) as it comes in and passes
+// the decoded bytes to the sink in small chunks, so that the decoded body is never held in memory in full.
+@interface BKContentDecoder : NSObject <BKByteSink>
+{
+    id <BKByteSink> sink;
+    void *stream;
+    BOOL passthrough;
+    BOOL rawDeflateAttempted;
+    BOOL finished;
+    unsigned long long decodedLength;
+}
++ (BOOL)canDecodeContentEncoding:(NSString *)inContentEncoding;
+- (id)initWithContentEncoding:(NSString *)inContentEncoding sink:(id <BKByteSink>)inSink;
+
+// returns NO if the compressed stream is truncated
+- (BOOL)finish;
+
+@property (readonly) unsigned long long decodedLength;
+@end
+
+// the value BugzKit sends in the Accept-Encoding header
+extern NSString *const BKAcceptedContentEncodings;
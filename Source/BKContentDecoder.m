@@ -0,0 +1,164 @@
+//
+// BKContentDecoder.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKContentDecoder.h"
+#import <zlib.h>
+
+NSString *const BKAcceptedContentEncodings = @"gzip, deflate";
+
+static const size_t kDecodeBufferSize = 16 * 1024;
+
+// windowBits: 15 + 32 lets zlib detect either a zlib or a gzip header; -15 means raw deflate
+static const int kAutoDetectWindowBits = 15 + 32;
+static const int kRawDeflateWindowBits = -15;
+
+@implementation BKContentDecoder
+- (void)dealloc
+{
+    if (stream) {
+        inflateEnd((z_stream *)stream);
+        free(stream);
+        stream = NULL;
+    }
+    
+    [sink release];
+    [super dealloc];
+}
+
++ (BOOL)canDecodeContentEncoding:(NSString *)inContentEncoding
+{
+    NSString *encoding = [[inContentEncoding stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+    return ![encoding length] || [encoding isEqualToString:@"identity"] || [encoding isEqualToString:@"gzip"] || [encoding isEqualToString:@"x-gzip"] || [encoding isEqualToString:@"deflate"];
+}
+
+- (id)initWithContentEncoding:(NSString *)inContentEncoding sink:(id <BKByteSink>)inSink
+{
+    if (![[self class] canDecodeContentEncoding:inContentEncoding]) {
+        [self release];
+        return nil;
+    }
+    
+    self = [super init];
+    if (self) {
+        sink = [inSink retain];
+        
+        NSString *encoding = [[inContentEncoding stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+        if (![encoding length] || [encoding isEqualToString:@"identity"]) {
+            passthrough = YES;
+        }
+        else {
+            stream = calloc(1, sizeof(z_stream));
+            if (!stream || inflateInit2((z_stream *)stream, kAutoDetectWindowBits) != Z_OK) {
+                free(stream);
+                stream = NULL;
+                [self release];
+                return nil;
+            }
+            
+            // only "deflate" is ambiguous: some servers send a zlib stream, others a raw deflate stream
+            rawDeflateAttempted = ![encoding isEqualToString:@"deflate"];
+        }
+    }
+    
+    return self;
+}
+
+- (BOOL)appendBytes:(const void *)inBytes length:(NSUInteger)inLength
+{
+    if (passthrough) {
+        decodedLength += inLength;
+        return [sink appendBytes:inBytes length:inLength];
+    }
+    
+    if (finished || !inLength) {
+        // ignore anything after the end of the compressed stream
+        return YES;
+    }
+    
+    z_stream *z = (z_stream *)stream;
+    Bytef buffer[kDecodeBufferSize];
+    
+    uLong consumedBefore = z->total_in;
+    
+    z->next_in = (Bytef *)inBytes;
+    z->avail_in = (uInt)inLength;
+    
+    while (YES) {
+        z->next_out = buffer;
+        z->avail_out = (uInt)kDecodeBufferSize;
+        
+        int result = inflate(z, Z_NO_FLUSH);
+        
+        if (result == Z_DATA_ERROR && !rawDeflateAttempted && !consumedBefore && !z->total_out) {
+            // not a zlib stream; start over as raw deflate (inflateReset2 is not available in older zlibs)
+            rawDeflateAttempted = YES;
+            inflateEnd(z);
+            memset(z, 0, sizeof(z_stream));
+            if (inflateInit2(z, kRawDeflateWindowBits) != Z_OK) {
+                free(stream);
+                stream = NULL;
+                return NO;
+            }
+            
+            z->next_in = (Bytef *)inBytes;
+            z->avail_in = (uInt)inLength;
+            continue;
+        }
+        
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            return NO;
+        }
+        
+        size_t produced = kDecodeBufferSize - z->avail_out;
+        if (produced) {
+            decodedLength += produced;
+            if (![sink appendBytes:buffer length:produced]) {
+                return NO;
+            }
+        }
+        
+        if (result == Z_STREAM_END) {
+            finished = YES;
+            break;
+        }
+        
+        // no more input and the output buffer wasn't filled up: wait for more data
+        if (result == Z_BUF_ERROR || (!z->avail_in && z->avail_out)) {
+            break;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)finish
+{
+    return passthrough || finished;
+}
+
+@synthesize decodedLength;
+@end
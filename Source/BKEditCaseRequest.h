@@ -33,15 +33,24 @@
 
 	NSString *multipartSeparator;
 	NSString *tempFilename;
+	NSString *compressedTempFilename;
+	NSString *tempFileAuthToken;
 	NSArray *attachmentURLs;	
+	BOOL compressesRequestBody;
 }
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext editAction:(NSString *)inAction parameters:(NSDictionary *)inParameters;
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext editAction:(NSString *)inAction caseNumber:(NSUInteger)inCaseNumber parameters:(NSDictionary *)inParameters;
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext editAction:(NSString *)inAction caseNumber:(NSUInteger)inCaseNumber parameters:(NSDictionary *)inParameters attachmentURLs:(NSArray *)inURLs attachmentsFromBugEventID:(NSUInteger)inEventID;
 @property (readonly) NSDictionary *editedCase;
 @property (readonly) NSString *editAction;
+
+// If set, a multipart body (i.e. one with attachments) of at least BKEditCaseCompressedBodyThreshold bytes is sent
+// gzip-compressed, with a Content-Encoding header. Only turn this on if your server accepts compressed request bodies.
+@property (assign) BOOL compressesRequestBody;
 @end
 
+extern const NSUInteger BKEditCaseCompressedBodyThreshold;
+
 extern NSString *const BKAssignCaseAction;
 extern NSString *const BKCloseCaseAction;
 extern NSString *const BKEditCaseAction;
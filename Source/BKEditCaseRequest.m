@@ -26,7 +26,12 @@
 //
 
 #import "BKEditCaseRequest.h"
+#import "BKCaseCache.h"
+#import "BKRequest+ProtectedMethods.h"
 #import "BKPrivateUtilities.h"
+#import <zlib.h>
+
+const NSUInteger BKEditCaseCompressedBodyThreshold = 64 * 1024;
 
 NSString *const BKAssignCaseAction = @"assign";
 NSString *const BKCloseCaseAction = @"close";
@@ -42,27 +47,84 @@ NSString *const BKResolveCaseAction = @"resolve";
 @implementation BKEditCaseRequest
 - (void)cleanUpTempFile
 {
-	if (![tempFilename length]) {
-		return;
-	}
-	
-	BOOL isDir = NO;
 	NSFileManager *fileManager = [[NSFileManager alloc] init];
-	if ([fileManager fileExistsAtPath:tempFilename isDirectory:&isDir]) {
+	
+	NSString *filenames[2] = { tempFilename, compressedTempFilename };
+	for (size_t i = 0; i < 2; i++) {
+		NSString *filename = filenames[i];
+		if (![filename length]) {
+			continue;
+		}
 		
-		NSError *ourError = NULL;
-		BOOL __unused removeResult = [[NSFileManager defaultManager] removeItemAtPath:tempFilename error:&ourError];
-		NSAssert2(removeResult, @"Must remove the temp file at: %@, error: %@", tempFilename, ourError);
+		BOOL isDir = NO;
+		if ([fileManager fileExistsAtPath:filename isDirectory:&isDir]) {
+			
+			NSError *ourError = NULL;
+			BOOL __unused removeResult = [[NSFileManager defaultManager] removeItemAtPath:filename error:&ourError];
+			NSAssert2(removeResult, @"Must remove the temp file at: %@, error: %@", filename, ourError);
+		}
 	}
+	
 	[fileManager release];
 }
 
+- (void)prepareCompressedTempFile
+{
+	NSString *filename = [tempFilename stringByAppendingPathExtension:@"gz"];
+	
+	FILE *source = fopen([tempFilename fileSystemRepresentation], "rb");
+	if (!source) {
+		return;
+	}
+	
+	gzFile destination = gzopen([filename fileSystemRepresentation], "wb");
+	if (!destination) {
+		fclose(source);
+		return;
+	}
+	
+	// stream in fixed-size chunks so that large attachments are never held in memory
+	char buffer[64 * 1024];
+	size_t readLength;
+	BOOL success = YES;
+	
+	while ((readLength = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+		if (gzwrite(destination, buffer, (unsigned)readLength) != (int)readLength) {
+			success = NO;
+			break;
+		}
+	}
+	
+	success = success && !ferror(source);
+	fclose(source);
+	success = (gzclose(destination) == Z_OK) && success;
+	
+	if (success) {
+		compressedTempFilename = [filename retain];
+	}
+	else {
+		unlink([filename fileSystemRepresentation]);
+	}
+}
+
 - (void)prepareTempFile
 {
+	// the token is part of the body, so a body built with an older token has to be rebuilt
+	NSString *token = [self requiresAuthToken] ? APIContext.authToken : nil;
+	
 	if ([tempFilename length]) {
-		return;
+		if (token == tempFileAuthToken || [token isEqualToString:tempFileAuthToken]) {
+			return;
+		}
+		
+		[self cleanUpTempFile];
+		BKReleaseClean(tempFilename);
+		BKReleaseClean(compressedTempFilename);
 	}
 	
+	token = [self authTokenForSending];
+	BKRetainAssign(tempFileAuthToken, token);
+	
 	NSString *bundleID = [[[NSBundle bundleForClass:[self class]] infoDictionary] objectForKey:(id)kCFBundleIdentifierKey];
 	NSString *filenameRoot = [NSTemporaryDirectory() stringByAppendingFormat:@"%@.%@.data-XXXXXX", NSStringFromClass([self class]), bundleID];
 	
@@ -82,6 +144,10 @@ NSString *const BKResolveCaseAction = @"resolve";
 		[multipartBegin appendFormat:@"--%@\r\nContent-Disposition: form-data; name=\"%@\"\r\n\r\n%@\r\n", multipartSeparator, key, value];
 	}
 	
+	if (token) {
+		[multipartBegin appendFormat:@"--%@\r\nContent-Disposition: form-data; name=\"%@\"\r\n\r\n%@\r\n", multipartSeparator, @"token", token];
+	}
+	
 	
     // add filename, if nil, generate a UUID
 	
@@ -139,6 +205,20 @@ NSString *const BKResolveCaseAction = @"resolve";
 	actualWrittenLength = [outputStream write:(uint8_t *)UTF8String maxLength:writeLength];
     NSAssert(actualWrittenLength == writeLength, @"Must write multipartEnd");
     [outputStream close];
+	
+	if (compressesRequestBody) {
+		NSDictionary *info = [[NSFileManager defaultManager] attributesOfItemAtPath:tempFilename error:NULL];
+		if ([[info objectForKey:NSFileSize] unsignedIntegerValue] >= BKEditCaseCompressedBodyThreshold) {
+			[self prepareCompressedTempFile];
+		}
+	}
+}
+
+// the file actually sent as the request body
+- (NSString *)requestBodyFilename
+{
+	[self prepareTempFile];
+	return compressedTempFilename ? compressedTempFilename : tempFilename;
 }
 
 - (void)dealloc
@@ -146,6 +226,8 @@ NSString *const BKResolveCaseAction = @"resolve";
 	[self cleanUpTempFile];
 	[multipartSeparator release];
 	[tempFilename release];
+	[compressedTempFilename release];
+	[tempFileAuthToken release];
 	[attachmentURLs release];
 	[super dealloc];
 }
@@ -162,7 +244,6 @@ NSString *const BKResolveCaseAction = @"resolve";
 	if (self) {
 		NSMutableDictionary *d = [NSMutableDictionary dictionary];
 		
-		[d setObject:inAPIContext.authToken forKey:@"token"];
 		[d setObject:inAction forKey:@"cmd"];
 		
 		if (inCaseNumber) {
@@ -213,6 +294,21 @@ NSString *const BKResolveCaseAction = @"resolve";
 	return result;
 }
 
+// Whatever we had cached of the case is out of date as soon as the edit is sent. It's dropped again at the end,
+// whatever became of the edit, in case a query that was already under way cached it in the meantime.
+- (void)requestWillBeSent
+{
+	NSUInteger caseNumber = (NSUInteger)[[requestParameterDict objectForKey:@"ixBug"] integerValue];
+	if (caseNumber) {
+		[APIContext.caseCache removeCase:caseNumber];
+	}
+}
+
+- (void)requestDidEnd
+{
+	[self requestWillBeSent];
+}
+
 - (NSString *)editAction
 {
 	return [requestParameterDict objectForKey:@"cmd"];
@@ -234,15 +330,27 @@ NSString *const BKResolveCaseAction = @"resolve";
 	return [attachmentURLs count] ? [NSString stringWithFormat:@"multipart/form-data; boundary=%@", multipartSeparator] : [super HTTPRequestContentType];
 }
 
+- (NSDictionary *)HTTPRequestHeaders
+{
+	NSDictionary *headers = [super HTTPRequestHeaders];
+	
+	if ([attachmentURLs count] && compressesRequestBody && [[self requestBodyFilename] isEqualToString:compressedTempFilename]) {
+		NSMutableDictionary *compressedHeaders = [NSMutableDictionary dictionaryWithDictionary:headers];
+		[compressedHeaders setObject:@"gzip" forKey:@"Content-Encoding"];
+		return compressedHeaders;
+	}
+	
+	return headers;
+}
+
 - (NSUInteger)requestInputStreamSize
 {
 	if (![attachmentURLs count]) {
 		return 0;
 	}
 	
-	[self prepareTempFile];	
 	NSError *fileError = NULL;
-	NSDictionary *info = [[NSFileManager defaultManager] attributesOfItemAtPath:tempFilename error:&fileError];	
+	NSDictionary *info = [[NSFileManager defaultManager] attributesOfItemAtPath:[self requestBodyFilename] error:&fileError];	
 	return [[info objectForKey:NSFileSize] unsignedIntegerValue];
 }
 
@@ -252,12 +360,13 @@ NSString *const BKResolveCaseAction = @"resolve";
 		return 0;
 	}
 	
-	[self prepareTempFile];
-	return [NSInputStream inputStreamWithFileAtPath:tempFilename];
+	return [NSInputStream inputStreamWithFileAtPath:[self requestBodyFilename]];
 }
 
 - (NSData *)requestData
 {
 	return [attachmentURLs count] ? nil : [super requestData];
 }
+
+@synthesize compressesRequestBody;
 @end
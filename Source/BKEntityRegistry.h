@@ -0,0 +1,78 @@
+//
+// BKEntityRegistry.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+
+// one index for each of the list types of BKListRequest
+#define BKEntityRegistryListCount 10
+
+typedef struct BKEntityIndex {
+    NSString *listType;
+    NSString *keyName;                  // ixProject, ixPerson, ..., or sFilter
+    BOOL stringKeys;                    // only filters are keyed by a string
+    CFMutableDictionaryRef entities;    // key -> NSDictionary *
+} BKEntityIndex;
+
+// The projects, areas, milestones, people and so on that cases refer to by ix*, indexed for lookups in constant
+// time. Fill it with the lists BKListRequest fetches; set it as a BKAPIContext's entityRegistry and every list
+// request made with that context updates it. Updating adds or replaces entities by key and never removes any, so
+// cases can still be resolved against a project that was since deleted or left out of a writable-items-only list.
+//
+// Reports then resolve many cases at once with -rowsByResolvingColumns:ofCases:. Each row is the case with the
+// entities its columns refer to added under the column name without the "ix": the project of ixProject goes
+// under "project", the person of ixPersonAssignedTo under "personAssignedTo". A reference that can't be resolved
+// (0, or an entity not in the registry) gets NSNull. There's one row for each case, in the same order; anything in
+// inCases that isn't a dictionary gets NSNull in place of a row (and -rowByResolvingColumns:ofCase: returns nil).
+//
+// All methods are thread-safe. A batch is resolved under one read lock, so it sees each list either before or
+// after an update, never halfway through one.
+@interface BKEntityRegistry : NSObject
+{
+    pthread_rwlock_t lock;
+    BKEntityIndex indexes[BKEntityRegistryListCount];
+    CFMutableDictionaryRef columnIndexes;   // column name -> BKEntityIndex *
+}
+- (void)updateEntities:(NSArray *)inEntities ofList:(NSString *)inListType;
+- (void)removeEntitiesOfList:(NSString *)inListType;
+- (void)removeAllEntities;
+
+// inKey is an NSNumber (or a numeric string) for all lists but BKFilterList, which is keyed by sFilter
+- (NSDictionary *)entityOfList:(NSString *)inListType forKey:(id)inKey;
+- (NSUInteger)countOfList:(NSString *)inListType;
+
+// Which list the ix* value of a case column refers to. Columns such as ixProject, ixFixFor, ixPersonAssignedTo or
+// ixStatus are known; add any other (e.g. a plugin's ixPersonReviewer) with -setList:forColumn:.
+- (NSString *)listForColumn:(NSString *)inColumn;
+- (void)setList:(NSString *)inListType forColumn:(NSString *)inColumn;
+
+- (NSArray *)rowsByResolvingColumns:(NSArray *)inColumns ofCases:(NSArray *)inCases;
+- (NSDictionary *)rowByResolvingColumns:(NSArray *)inColumns ofCase:(NSDictionary *)inCase;
+
++ (NSString *)keyNameOfList:(NSString *)inListType;     // e.g. ixFixFor for BKMilestoneList
++ (NSString *)rowKeyForColumn:(NSString *)inColumn;      // e.g. personAssignedTo for ixPersonAssignedTo, fooEntity for foo
+@end
@@ -0,0 +1,331 @@
+//
+// BKEntityRegistry.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKEntityRegistry.h"
+#import "BKListRequest.h"
+
+// Integer keys are stored in the dictionaries as they are, shifted so that no key is NULL.
+NS_INLINE const void *BKEntityIntegerKey(NSUInteger inIndex)
+{
+    return (const void *)(((uintptr_t)inIndex << 1) | 1);
+}
+
+// the key an ix* (or sFilter) value is stored under in an index; NO if the value refers to nothing
+static BOOL BKEntityKeyForValue(const BKEntityIndex *inIndex, id inValue, const void **outKey)
+{
+    if (inIndex->stringKeys) {
+        if ([inValue isKindOfClass:[NSString class]] && [inValue length]) {
+            *outKey = inValue;
+            return YES;
+        }
+        return NO;
+    }
+    
+    if (![inValue isKindOfClass:[NSNumber class]] && ![inValue isKindOfClass:[NSString class]]) {
+        return NO;
+    }
+    
+    NSInteger value = [inValue integerValue];
+    if (value <= 0) {
+        return NO;
+    }
+    
+    *outKey = BKEntityIntegerKey((NSUInteger)value);
+    return YES;
+}
+
+@interface BKEntityRegistry (PrivateMethods)
+- (BKEntityIndex *)indexOfList:(NSString *)inListType;
+- (void)resolveColumns:(NSArray *)inColumns ofCases:(NSArray *)inCases intoRows:(NSMutableArray *)outRows;
+@end
+
+@implementation BKEntityRegistry
+- (void)dealloc
+{
+    for (NSUInteger i = 0; i < BKEntityRegistryListCount; i++) {
+        CFRelease(indexes[i].entities);
+    }
+    CFRelease(columnIndexes);
+    pthread_rwlock_destroy(&lock);
+    [super dealloc];
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        pthread_rwlock_init(&lock, NULL);
+        
+        NSString *lists[BKEntityRegistryListCount] = { BKProjectList, BKAreaList, BKMilestoneList, BKPeopleList, BKPriorityList, BKStatusList, BKCategoryList, BKMailboxList, BKSnippetList, BKFilterList };
+        
+        for (NSUInteger i = 0; i < BKEntityRegistryListCount; i++) {
+            indexes[i].listType = lists[i];
+            indexes[i].keyName = [[self class] keyNameOfList:lists[i]];
+            indexes[i].stringKeys = (lists[i] == BKFilterList);
+            indexes[i].entities = CFDictionaryCreateMutable(NULL, 0, (indexes[i].stringKeys ? &kCFTypeDictionaryKeyCallBacks : NULL), &kCFTypeDictionaryValueCallBacks);
+        }
+        
+        columnIndexes = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        
+        NSArray *columns = [NSArray arrayWithObjects:
+                            @"ixProject", BKProjectList,
+                            @"ixArea", BKAreaList,
+                            @"ixFixFor", BKMilestoneList,
+                            @"ixPriority", BKPriorityList,
+                            @"ixStatus", BKStatusList,
+                            @"ixCategory", BKCategoryList,
+                            @"ixMailbox", BKMailboxList,
+                            @"ixSnippet", BKSnippetList,
+                            @"ixPerson", BKPeopleList,
+                            @"ixPersonAssignedTo", BKPeopleList,
+                            @"ixPersonOpenedBy", BKPeopleList,
+                            @"ixPersonResolvedBy", BKPeopleList,
+                            @"ixPersonClosedBy", BKPeopleList,
+                            @"ixPersonLastEditedBy", BKPeopleList,
+                            nil];
+        
+        for (NSUInteger i = 0; i + 1 < [columns count]; i += 2) {
+            CFDictionarySetValue(columnIndexes, [columns objectAtIndex:i], [self indexOfList:[columns objectAtIndex:i + 1]]);
+        }
+    }
+    
+    return self;
+}
+
+- (void)updateEntities:(NSArray *)inEntities ofList:(NSString *)inListType
+{
+    BKEntityIndex *index = [self indexOfList:inListType];
+    NSUInteger count = [inEntities count];
+    if (!index || !count) {
+        return;
+    }
+    
+    // work out the keys before taking the lock, so readers wait only for the dictionary to change
+    const void **keys = (const void **)calloc(count, sizeof(const void *));
+    const void **values = (const void **)calloc(count, sizeof(const void *));
+    NSUInteger n = 0;
+    
+    for (NSDictionary *entity in inEntities) {
+        if ([entity isKindOfClass:[NSDictionary class]] && BKEntityKeyForValue(index, [entity objectForKey:index->keyName], &keys[n])) {
+            values[n] = entity;
+            n++;
+        }
+    }
+    
+    pthread_rwlock_wrlock(&lock);
+    for (NSUInteger i = 0; i < n; i++) {
+        CFDictionarySetValue(index->entities, keys[i], values[i]);
+    }
+    pthread_rwlock_unlock(&lock);
+    
+    free(keys);
+    free(values);
+}
+
+- (void)removeEntitiesOfList:(NSString *)inListType
+{
+    BKEntityIndex *index = [self indexOfList:inListType];
+    if (!index) {
+        return;
+    }
+    
+    pthread_rwlock_wrlock(&lock);
+    CFDictionaryRemoveAllValues(index->entities);
+    pthread_rwlock_unlock(&lock);
+}
+
+- (void)removeAllEntities
+{
+    pthread_rwlock_wrlock(&lock);
+    for (NSUInteger i = 0; i < BKEntityRegistryListCount; i++) {
+        CFDictionaryRemoveAllValues(indexes[i].entities);
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+- (NSDictionary *)entityOfList:(NSString *)inListType forKey:(id)inKey
+{
+    BKEntityIndex *index = [self indexOfList:inListType];
+    const void *key = NULL;
+    if (!index || !BKEntityKeyForValue(index, inKey, &key)) {
+        return nil;
+    }
+    
+    pthread_rwlock_rdlock(&lock);
+    NSDictionary *entity = [[(id)CFDictionaryGetValue(index->entities, key) retain] autorelease];
+    pthread_rwlock_unlock(&lock);
+    return entity;
+}
+
+- (NSUInteger)countOfList:(NSString *)inListType
+{
+    BKEntityIndex *index = [self indexOfList:inListType];
+    if (!index) {
+        return 0;
+    }
+    
+    pthread_rwlock_rdlock(&lock);
+    NSUInteger count = (NSUInteger)CFDictionaryGetCount(index->entities);
+    pthread_rwlock_unlock(&lock);
+    return count;
+}
+
+- (NSString *)listForColumn:(NSString *)inColumn
+{
+    pthread_rwlock_rdlock(&lock);
+    const BKEntityIndex *index = inColumn ? CFDictionaryGetValue(columnIndexes, inColumn) : NULL;
+    pthread_rwlock_unlock(&lock);
+    return index ? index->listType : nil;
+}
+
+- (void)setList:(NSString *)inListType forColumn:(NSString *)inColumn
+{
+    NSParameterAssert(inColumn);
+    BKEntityIndex *index = [self indexOfList:inListType];
+    
+    pthread_rwlock_wrlock(&lock);
+    if (index) {
+        CFDictionarySetValue(columnIndexes, inColumn, index);
+    }
+    else {
+        CFDictionaryRemoveValue(columnIndexes, inColumn);
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+- (NSArray *)rowsByResolvingColumns:(NSArray *)inColumns ofCases:(NSArray *)inCases
+{
+    NSMutableArray *rows = [NSMutableArray arrayWithCapacity:[inCases count]];
+    [self resolveColumns:inColumns ofCases:inCases intoRows:rows];
+    return rows;
+}
+
+- (NSDictionary *)rowByResolvingColumns:(NSArray *)inColumns ofCase:(NSDictionary *)inCase
+{
+    id row = [[self rowsByResolvingColumns:inColumns ofCases:[NSArray arrayWithObject:inCase]] lastObject];
+    return [row isKindOfClass:[NSDictionary class]] ? row : nil;
+}
+
++ (NSString *)keyNameOfList:(NSString *)inListType
+{
+    static NSDictionary *keyNames = nil;
+    
+    @synchronized(self) {
+        if (!keyNames) {
+            keyNames = [[NSDictionary alloc] initWithObjectsAndKeys:
+                        @"ixProject", BKProjectList,
+                        @"ixArea", BKAreaList,
+                        @"ixFixFor", BKMilestoneList,
+                        @"ixPerson", BKPeopleList,
+                        @"ixPriority", BKPriorityList,
+                        @"ixStatus", BKStatusList,
+                        @"ixCategory", BKCategoryList,
+                        @"ixMailbox", BKMailboxList,
+                        @"ixSnippet", BKSnippetList,
+                        @"sFilter", BKFilterList,
+                        nil];
+        }
+    }
+    
+    return [keyNames objectForKey:inListType];
+}
+
++ (NSString *)rowKeyForColumn:(NSString *)inColumn
+{
+    if ([inColumn length] > 2 && [inColumn hasPrefix:@"ix"]) {
+        return [[[inColumn substringWithRange:NSMakeRange(2, 1)] lowercaseString] stringByAppendingString:[inColumn substringFromIndex:3]];
+    }
+    
+    return [inColumn stringByAppendingString:@"Entity"];
+}
+@end
+
+@implementation BKEntityRegistry (PrivateMethods)
+- (BKEntityIndex *)indexOfList:(NSString *)inListType
+{
+    if (!inListType) {
+        return NULL;
+    }
+    
+    for (NSUInteger i = 0; i < BKEntityRegistryListCount; i++) {
+        if (indexes[i].listType == inListType || [indexes[i].listType isEqualToString:inListType]) {
+            return &indexes[i];
+        }
+    }
+    
+    return NULL;
+}
+
+- (void)resolveColumns:(NSArray *)inColumns ofCases:(NSArray *)inCases intoRows:(NSMutableArray *)outRows
+{
+    NSUInteger columnCount = [inColumns count];
+    NSString **rowKeys = (NSString **)calloc(columnCount + 1, sizeof(NSString *));
+    const BKEntityIndex **columnIndexList = (const BKEntityIndex **)calloc(columnCount + 1, sizeof(BKEntityIndex *));
+    id null = [NSNull null];
+    
+    for (NSUInteger c = 0; c < columnCount; c++) {
+        rowKeys[c] = [[self class] rowKeyForColumn:[inColumns objectAtIndex:c]];
+    }
+    
+    // one read lock for the whole batch; the row dictionaries retain what they need before it's released
+    pthread_rwlock_rdlock(&lock);
+    
+    for (NSUInteger c = 0; c < columnCount; c++) {
+        columnIndexList[c] = CFDictionaryGetValue(columnIndexes, [inColumns objectAtIndex:c]);
+    }
+    
+    for (NSDictionary *caseDictionary in inCases) {
+        // a placeholder keeps the rows in step with the cases
+        if (![caseDictionary isKindOfClass:[NSDictionary class]]) {
+            [outRows addObject:null];
+            continue;
+        }
+        
+        NSMutableDictionary *row = [[NSMutableDictionary alloc] initWithCapacity:[caseDictionary count] + columnCount];
+        [row addEntriesFromDictionary:caseDictionary];
+        
+        for (NSUInteger c = 0; c < columnCount; c++) {
+            const void *key = NULL;
+            id entity = nil;
+            
+            if (columnIndexList[c] && BKEntityKeyForValue(columnIndexList[c], [caseDictionary objectForKey:[inColumns objectAtIndex:c]], &key)) {
+                entity = (id)CFDictionaryGetValue(columnIndexList[c]->entities, key);
+            }
+            
+            [row setObject:(entity ? entity : null) forKey:rowKeys[c]];
+        }
+        
+        [outRows addObject:row];
+        [row release];
+    }
+    
+    pthread_rwlock_unlock(&lock);
+    
+    free(rowKeys);
+    free(columnIndexList);
+}
+@end
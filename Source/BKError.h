@@ -39,6 +39,9 @@ typedef enum {
     BKConnectionCannotPerformHTTPRequestError = -4, // performMethod: returns NO
 	
 	BKAPIMalformedResponseError = -100,
+	BKResponseDecodingError = -101,	// the response body could not be decoded (e.g. corrupt gzip stream) or parsed
+	BKDownloadRangeMismatchError = -102,	// the server sent a range other than the one asked for
+	BKDownloadSizeMismatchError = -103,	// the downloaded file is not as long as the server said
 	BKUnknownError = -9999,
 	
 	BKNotInitializedError = 0,
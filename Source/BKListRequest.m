@@ -27,6 +27,8 @@
 
 #import "BKListRequest.h"
 #import "BKError.h"
+#import "BKEntityRegistry.h"
+#import "BKRequest+ProtectedMethods.h"
 
 NSString *const BKAreaList = @"BKAreaList";
 NSString *const BKCategoryList = @"BKCategoryList";
@@ -121,7 +123,6 @@ static NSString *kFirstLevelValueKey = @"kFirstLevelValueKey";
 		requestParameterDict = [[NSMutableDictionary alloc] init];
 		
 		[(NSMutableDictionary *)requestParameterDict setObject:[[self class] commandForListType:listType] forKey:@"cmd"];
-		[(NSMutableDictionary *)requestParameterDict setObject:inAPIContext.authToken forKey:@"token"];
 		
 		if ([inParameters count]) {
 			[(NSMutableDictionary *)requestParameterDict addEntriesFromDictionary:inParameters];
@@ -161,6 +162,10 @@ static NSString *kFirstLevelValueKey = @"kFirstLevelValueKey";
 		result = [NSArray array];
 	}
 	
+	if ([result isKindOfClass:[NSArray class]] && ![self isCancelled]) {
+		[APIContext.entityRegistry updateEntities:result ofList:listType];
+	}
+	
 	return result;
 }
 
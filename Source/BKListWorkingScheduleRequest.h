@@ -27,9 +27,12 @@
 
 #import "BKRequest.h"
 
+@class BKWorkingSchedule;
+
 @interface BKListWorkingScheduleRequest : BKRequest
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext personID:(NSUInteger)inPersonID;
 @property (readonly) NSDictionary *fetchedWorkingSchedule;
+@property (readonly) BKWorkingSchedule *compiledWorkingSchedule;      // in the default time zone
 @end
 
 extern const NSUInteger BKSiteWorkingSchedulePersonID;
@@ -26,6 +26,7 @@
 //
 
 #import "BKListWorkingScheduleRequest.h"
+#import "BKWorkingSchedule.h"
 
 const NSUInteger BKSiteWorkingSchedulePersonID = 1;
 
@@ -36,7 +37,6 @@ const NSUInteger BKSiteWorkingSchedulePersonID = 1;
 	if (self) {
 		NSMutableDictionary *d = [NSMutableDictionary dictionary];
 		
-		[d setObject:inAPIContext.authToken forKey:@"token"];
 		[d setObject:@"listWorkingSchedule" forKey:@"cmd"];
 		
 		if (inPersonID) {
@@ -63,4 +63,10 @@ const NSUInteger BKSiteWorkingSchedulePersonID = 1;
 {
 	return [processedResponse isKindOfClass:[NSDictionary class]] ? processedResponse : nil;	
 }
+
+- (BKWorkingSchedule *)compiledWorkingSchedule
+{
+	NSDictionary *schedule = [self fetchedWorkingSchedule];
+	return schedule ? [BKWorkingSchedule scheduleWithWorkingSchedule:schedule] : nil;
+}
 @end
@@ -33,7 +33,7 @@
 {
     self = [super initWithAPIContext:inAPIContext];
 	if (self) {
-		requestParameterDict = [[NSDictionary dictionaryWithObjectsAndKeys:@"logoff", @"cmd", inAPIContext.authToken, @"token", nil] retain];
+		requestParameterDict = [[NSDictionary dictionaryWithObjectsAndKeys:@"logoff", @"cmd", nil] retain];
 	}
 	
 	return self;	
@@ -42,6 +42,7 @@
 - (id)postprocessResponse:(NSDictionary *)inXMLMappedResponse
 {
 	[APIContext setAuthToken:nil];
+	[APIContext sessionStateDidChange];
 	return nil;
 }
 @end
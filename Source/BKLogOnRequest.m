@@ -45,6 +45,11 @@
 	return self;
 }
 
+- (BOOL)requiresAuthToken
+{
+	return NO;
+}
+
 - (void)postprocessError:(NSError *)inError
 {
 	[APIContext setAuthToken:nil];
@@ -54,6 +59,7 @@
 {
 	NSString *token = [inXMLMappedResponse objectForKey:@"token"];
     [APIContext setAuthToken:token];
+    [APIContext sessionStateDidChange];
 	
 	return token;
 }
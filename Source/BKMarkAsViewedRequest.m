@@ -39,7 +39,6 @@
 	if (self) {
 		NSMutableDictionary *d = [NSMutableDictionary dictionary];
 		
-		[d setObject:inAPIContext.authToken forKey:@"token"];
 		[d setObject:@"view" forKey:@"cmd"];
 		[d setObject:[NSString stringWithFormat:@"%jd", (uintmax_t)inCaseNumber] forKey:@"ixBug"];
 		
@@ -27,12 +27,19 @@
 
 #import "BKRequest.h"
 
+// If the API context has a caseCache, the fetched cases are stored there by ixBug.
 @interface BKQueryCaseRequest : BKRequest
+{
+	NSUInteger sentCacheGeneration;
+}
 + (id)requestWithAPIContext:(BKAPIContext *)inAPIContext query:(NSString *)inQuery columns:(NSArray *)inColumnNames DEPRECATED_ATTRIBUTE;
 + (id)requestWithAPIContext:(BKAPIContext *)inAPIContext query:(NSString *)inQuery columns:(NSArray *)inColumnNames maximum:(NSUInteger)inMaximum DEPRECATED_ATTRIBUTE;
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext query:(NSString *)inQuery columns:(NSArray *)inColumnNames;
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext query:(NSString *)inQuery columns:(NSArray *)inColumnNames maximum:(NSUInteger)inMaximum;
 
+// for subclasses: called by -postprocessResponse: to store the cases in the API context's caseCache
+- (void)cacheFetchedCases:(NSArray *)inCases;
+
 @property (readonly) NSArray *fetchedCases;
 @property (readonly) NSString *query;
 @end
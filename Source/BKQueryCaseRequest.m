@@ -26,6 +26,11 @@
 //
 
 #import "BKQueryCaseRequest.h"
+#import "BKCaseCache.h"
+#import "BKRequest+ProtectedMethods.h"
+
+// how many cases are cached between checks for cancellation
+static const NSUInteger kCasesPerCacheBatch = 256;
 
 @implementation BKQueryCaseRequest : BKRequest
 + (id)requestWithAPIContext:(BKAPIContext *)inAPIContext query:(NSString *)inQuery columns:(NSArray *)inColumnNames
@@ -44,7 +49,6 @@
 	if (self) {
 		NSMutableDictionary *d = [NSMutableDictionary dictionary];
 		
-		[d setObject:inAPIContext.authToken forKey:@"token"];
 		[d setObject:@"search" forKey:@"cmd"];
 		
 		if (inQuery) {
@@ -70,6 +74,12 @@
 	return [self initWithAPIContext:inAPIContext query:inQuery columns:inColumnNames maximum:NSUIntegerMax];
 }
 
+// an edit sent after this may not show in our response, and shouldn't be hidden by it being cached
+- (void)requestWillBeSent
+{
+	sentCacheGeneration = [APIContext.caseCache cacheGeneration];
+}
+
 - (id)postprocessResponse:(NSDictionary *)inXMLMappedResponse
 {
 	id result = [inXMLMappedResponse valueForKeyPath:@"cases.case"];
@@ -77,9 +87,25 @@
 		result = [NSArray array];
 	}
 	
+	if ([result isKindOfClass:[NSArray class]] && ![self isCancelled]) {
+		[self cacheFetchedCases:result];
+	}
+	
 	return result;
 }
 
+- (void)cacheFetchedCases:(NSArray *)inCases
+{
+	BKCaseCache *cache = APIContext.caseCache;
+	NSUInteger count = [inCases count];
+	
+	// sizing thousands of cases takes a while, so a cancel is noticed between batches
+	for (NSUInteger location = 0; cache && location < count && ![self isCancelled]; location += kCasesPerCacheBatch) {
+		NSRange batch = NSMakeRange(location, MIN(kCasesPerCacheBatch, count - location));
+		[cache addCases:[inCases subarrayWithRange:batch] cacheGeneration:sentCacheGeneration];
+	}
+}
+
 - (NSArray *)fetchedCases
 {
 	return processedResponse;
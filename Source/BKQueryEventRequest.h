@@ -28,7 +28,13 @@
 #import "BKQueryCaseRequest.h"
 
 // TODO: Deprecate this class
+// If the API context has a caseCache, the events are kept there instead of the case, and asking for the same case again doesn't go to
+// the server until the case is edited (with BKEditCaseRequest) or evicted.
 @interface BKQueryEventRequest : BKQueryCaseRequest
+{
+	NSUInteger caseNumber;
+	NSUInteger sentCaseGeneration;
+}
 + (id)requestWithAPIContext:(BKAPIContext *)inAPIContext caseNumber:(NSUInteger)inCaseNumber DEPRECATED_ATTRIBUTE;
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext caseNumber:(NSUInteger)inCaseNumber;
 
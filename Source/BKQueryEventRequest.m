@@ -26,6 +26,7 @@
 //
 
 #import "BKQueryEventRequest.h"
+#import "BKCaseCache.h"
 
 @implementation BKQueryEventRequest : BKQueryCaseRequest
 + (id)requestWithAPIContext:(BKAPIContext *)inAPIContext caseNumber:(NSUInteger)inCaseNumber
@@ -37,11 +38,47 @@
 {
     self = [super initWithAPIContext:inAPIContext query:[NSString stringWithFormat:@"%ju", (uintmax_t)inCaseNumber] columns:[NSArray arrayWithObject:@"events"]];
 	if (self) {
+		caseNumber = inCaseNumber;
 	}
 	
 	return self;
 }
 
+- (NSArray *)fixedParameterKeys
+{
+	return [NSArray arrayWithObject:@"cols"];
+}
+
+- (id)cachedResponse
+{
+	NSArray *events = caseNumber ? [APIContext.caseCache eventsOfCase:caseNumber] : nil;
+	if (!events) {
+		return nil;
+	}
+	
+	// the same shape as a search response's cases.case, so that -fetchedEvents works either way
+	NSDictionary *caseDictionary = [NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithUnsignedInteger:caseNumber], @"ixBug", [NSDictionary dictionaryWithObject:events forKey:@"event"], @"events", nil];
+	return [NSArray arrayWithObject:caseDictionary];
+}
+
+- (void)requestWillBeSent
+{
+	[super requestWillBeSent];
+	
+	if (caseNumber) {
+		sentCaseGeneration = [APIContext.caseCache generationOfCase:caseNumber];
+	}
+}
+
+// the case dictionary only has the events, which -cachedResponse looks up on their own
+- (void)cacheFetchedCases:(NSArray *)inCases
+{
+	if (caseNumber && [inCases count]) {
+		id events = [[inCases objectAtIndex:0] valueForKeyPath:@"events.event"];
+		[APIContext.caseCache setEvents:([events isKindOfClass:[NSArray class]] ? events : [NSArray array]) ofCase:caseNumber generation:sentCaseGeneration];
+	}
+}
+
 - (NSArray *)fetchedEvents
 {
 	NSArray *cases = [self fetchedCases];
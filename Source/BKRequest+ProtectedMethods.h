@@ -0,0 +1,46 @@
+//
+// BKRequest+ProtectedMethods.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKRequest.h"
+
+@interface BKRequest (ProtectedMethods)
+// the parameters the request was created with (without the token)
+- (NSDictionary *)requestParameterDict;
+
+// the token to put in the request being built, which also becomes sentAuthToken; nil if the request doesn't need one
+- (NSString *)authTokenForSending;
+
+// drops the response and everything prepared with the old token, so that the request can be sent again
+- (void)resetForRetry;
+
+// The operation running the request (not retained), set by BKRequestOperation. Once it's cancelled, -isCancelled
+// returns YES, and postprocessing should stop between its expensive steps (-setRawXMLMappedResponse: doesn't even
+// start it); the operation discards whatever was processed.
+- (NSOperation *)runningOperation;
+- (void)setRunningOperation:(NSOperation *)inOperation;
+- (BOOL)isCancelled;
+@end
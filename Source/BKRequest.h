@@ -26,8 +26,11 @@
 //
 
 #import "BKAPIContext.h"
+#import "BKByteSink.h"
 
+@class BKBandwidthThrottle;
 @class BKRequest;
+@class BKResponseSchema;
 
 @interface BKRequest : NSObject
 {
@@ -37,6 +40,11 @@
 	NSDictionary *rawXMLMappedResponse;
     id processedResponse;
     NSError *error;
+
+    NSData *preparedParameterData;
+    NSURL *preparedRequestURL;
+    NSString *sentAuthToken;
+    NSOperation *runningOperation;
 }
 - (id)initWithAPIContext:(BKAPIContext *)inAPIContext;
 
@@ -44,15 +52,37 @@
 - (void)postprocessError:(NSError *)inError;
 - (id)postprocessResponse:(NSDictionary *)inXMLMappedResponse;
 - (NSError *)validateResponse:(NSDictionary *)inXMLMappedResponse;
+- (NSArray *)fixedParameterKeys;    // parameters (besides cmd and token) that are the same for every request of the class
+- (BOOL)requiresAuthToken;          // YES by default; the token is taken from the API context when the request is sent
+- (BKResponseSchema *)responseSchema;   // how to map the response; defaults to the built-in schema of the command
+- (id)cachedResponse;                   // if not nil (the default), used as the processed response instead of sending the request
+
+// Requests whose response body isn't FogBugz XML (e.g. BKAttachmentDownloadRequest) return a sink for it (the default
+// is nil, i.e. map the XML). BKRequestOperation then streams the decoded body there and calls -finishResponseBody at
+// the end, which sets processedResponse and returns nil, or returns the error.
+- (id <BKByteSink>)responseBodySinkForHTTPResponse:(NSHTTPURLResponse *)inResponse error:(NSError **)outError;
+- (NSError *)finishResponseBody;
+
+// If not nil (the default), BKRequestOperation paces reading the response body to the throttle's rate
+- (BKBandwidthThrottle *)bandwidthThrottle;
+
+// Invoked by BKRequestOperation right before the request goes out (again, when it's retried), and once the operation
+// is done with a request it sent, whether it completed, failed or was cancelled. They do nothing by default.
+- (void)requestWillBeSent;
+- (void)requestDidEnd;
 
 // properties used by request drivers
 @property (readonly, nonatomic) NSString *HTTPRequestContentType;
+@property (readonly, nonatomic) NSDictionary *HTTPRequestHeaders;   // extra headers, e.g. Accept-Encoding
 @property (readonly, nonatomic) NSData *requestData;
 @property (readonly, nonatomic) NSInputStream *requestInputStream;
 @property (readonly, nonatomic) NSUInteger requestInputStreamSize;
 @property (readonly, nonatomic) NSURL *requestURL;
 @property (readonly, nonatomic) BOOL usesPOSTRequest;
 
+@property (readonly, nonatomic) BKAPIContext *APIContext;
+@property (readonly, nonatomic) NSString *sentAuthToken;    // the token the request was last prepared with
+
 // response
 @property (retain, nonatomic) NSDictionary *rawXMLMappedResponse;
 @property (retain, nonatomic) id processedResponse;
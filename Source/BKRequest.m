@@ -27,13 +27,19 @@
 //
 
 #import "BKRequest.h"
+#import "BKRequest+ProtectedMethods.h"
+#import "BKAPIContext+ProtectedMethods.h"
+#import "BKContentDecoder.h"
 #import "BKError.h"
 #import "BKPrivateUtilities.h"
+#import "BKRequestTemplate.h"
+#import "BKResponseSchema.h"
 #import "BKXMLMapper.h"
 
 @interface BKRequest (PrivateMethods)
 - (NSError *)errorFromXMLMappedResponse:(NSDictionary *)inXMLMappedResponse;
-- (NSString *)preparedParameterString;
+- (void)noteResponseError:(NSError *)inError;
+- (NSData *)preparedParameterData;
 @end
 
 
@@ -45,6 +51,9 @@
     [rawXMLMappedResponse release], rawXMLMappedResponse = nil;
 	[processedResponse release], processedResponse = nil;
     [error release], error = nil;
+    [preparedParameterData release], preparedParameterData = nil;
+    [preparedRequestURL release], preparedRequestURL = nil;
+    [sentAuthToken release], sentAuthToken = nil;
     [super dealloc];
 }
 
@@ -81,6 +90,49 @@
 	return nil;
 }
 
+- (NSArray *)fixedParameterKeys
+{
+	return nil;
+}
+
+- (BOOL)requiresAuthToken
+{
+	return YES;
+}
+
+- (BKResponseSchema *)responseSchema
+{
+	return [BKResponseSchema schemaForCommand:[requestParameterDict objectForKey:@"cmd"]];
+}
+
+- (id)cachedResponse
+{
+	return nil;
+}
+
+- (id <BKByteSink>)responseBodySinkForHTTPResponse:(NSHTTPURLResponse *)inResponse error:(NSError **)outError
+{
+	return nil;
+}
+
+- (NSError *)finishResponseBody
+{
+	return nil;
+}
+
+- (BKBandwidthThrottle *)bandwidthThrottle
+{
+	return nil;
+}
+
+- (void)requestWillBeSent
+{
+}
+
+- (void)requestDidEnd
+{
+}
+
 #pragma mark Dynamic properties
 
 - (NSString *)HTTPRequestContentType
@@ -88,10 +140,17 @@
 	return @"application/x-www-form-urlencoded";
 }
 
+- (NSDictionary *)HTTPRequestHeaders
+{
+	// FogBugz XML compresses very well; NSURLConnection inflates it by itself, and BKRequestOperation's raw receiving
+	// methods do it for fetchers that don't
+	return [NSDictionary dictionaryWithObjectsAndKeys:BKAcceptedContentEncodings, @"Accept-Encoding", nil];
+}
+
 - (NSData *)requestData
 {
     if (self.usesPOSTRequest) {
-		return [[self preparedParameterString] dataUsingEncoding:NSUTF8StringEncoding];
+		return [self preparedParameterData];
 	}
 	
 	return nil;
@@ -109,13 +168,25 @@
 
 - (NSURL *)requestURL
 {
+	NSURL *endpoint = APIContext.endpoint;
+	
 	if (!self.usesPOSTRequest) {
-		NSString *paramsString = [self preparedParameterString];
-
-		return [paramsString length] ? [NSURL URLWithString:[@"?" stringByAppendingString:paramsString] relativeToURL:APIContext.endpoint] : APIContext.endpoint;
+		NSData *params = [self preparedParameterData];
+		if (![params length]) {
+			return endpoint;
+		}
+		
+		// the cached URL is only good for the endpoint it was built against
+		if (!preparedRequestURL || ![[preparedRequestURL baseURL] isEqual:endpoint]) {
+			NSString *paramsString = [[NSString alloc] initWithData:params encoding:NSASCIIStringEncoding];
+			BKRetainAssign(preparedRequestURL, [NSURL URLWithString:[@"?" stringByAppendingString:paramsString] relativeToURL:endpoint]);
+			[paramsString release];
+		}
+		
+		return preparedRequestURL;
 	}
 		
-	return APIContext.endpoint;
+	return endpoint;
 }
 
 - (BOOL)usesPOSTRequest
@@ -141,10 +212,19 @@
         BKReleaseClean(rawXMLMappedResponse);
         BKReleaseClean(processedResponse);
 		BKRetainAssign(error, responseError);        
+		[self noteResponseError:responseError];
 		return;
 	}
     
 	BKReleaseClean(error);
+	[APIContext confirmSession];
+    
+    // no one is going to look at what a cancelled operation's postprocessing produces
+    if ([self isCancelled]) {
+        BKReleaseClean(rawXMLMappedResponse);
+        BKReleaseClean(processedResponse);
+        return;
+    }
     
     // TODO: Add a flag saying we don't need to do this--or altogether?
     BKRetainAssign(rawXMLMappedResponse, inMappedXMLDictionary);
@@ -163,14 +243,56 @@
     BKRetainAssign(error, inError);
     BKReleaseClean(rawXMLMappedResponse);
     BKReleaseClean(processedResponse);
+    [self noteResponseError:inError];
 }
 
+@synthesize APIContext;
+@synthesize sentAuthToken;
 @synthesize rawXMLMappedResponse;
 @synthesize processedResponse;
 @synthesize error;
 @end
 
 
+@implementation BKRequest (ProtectedMethods)
+- (NSDictionary *)requestParameterDict
+{
+	return requestParameterDict;
+}
+
+- (NSString *)authTokenForSending
+{
+	NSString *token = [self requiresAuthToken] ? APIContext.authToken : nil;
+	BKRetainAssign(sentAuthToken, token);
+	return token;
+}
+
+- (void)resetForRetry
+{
+    BKReleaseClean(error);
+    BKReleaseClean(rawXMLMappedResponse);
+    BKReleaseClean(processedResponse);
+    BKReleaseClean(preparedParameterData);
+    BKReleaseClean(preparedRequestURL);
+}
+
+- (NSOperation *)runningOperation
+{
+    return runningOperation;
+}
+
+- (void)setRunningOperation:(NSOperation *)inOperation
+{
+    runningOperation = inOperation;
+}
+
+- (BOOL)isCancelled
+{
+    return [runningOperation isCancelled];
+}
+@end
+
+
 @implementation BKRequest (PrivateMethods)
 - (NSError *)errorFromXMLMappedResponse:(NSDictionary *)inXMLMappedResponse
 {
@@ -186,36 +308,62 @@
 	return nil;
 }
 
-- (NSString *)preparedParameterString
+- (void)noteResponseError:(NSError *)inError
+{
+	if (![[inError domain] isEqualToString:BKAPIErrorDomain]) {
+		return;
+	}
+	
+	if ([inError code] == BKNotLoggedOnError) {
+		// the token has expired or was logged off elsewhere
+		[APIContext invalidateSessionOfToken:sentAuthToken requiringDiscovery:NO error:inError];
+	}
+	else if (APIContext.sessionRestored && ([inError code] == BKAPIMalformedResponseError || [inError code] == BKResponseDecodingError)) {
+		// the restored endpoint doesn't speak the API (any more), e.g. the site was moved or upgraded
+		[APIContext invalidateSessionOfToken:sentAuthToken requiringDiscovery:YES error:inError];
+	}
+}
+
+- (NSData *)preparedParameterData
 {
+	// the prepared data is only good for as long as the context's token stays the same
+	NSString *token = [self requiresAuthToken] ? APIContext.authToken : nil;
+	if (preparedParameterData && (token == sentAuthToken || [token isEqualToString:sentAuthToken])) {
+		return preparedParameterData;
+	}
+	
+	BKReleaseClean(preparedParameterData);
+	BKReleaseClean(preparedRequestURL);
+	token = [self authTokenForSending];
+	
 	NSDictionary *dict = requestParameterDict;
-	NSMutableArray *params = [NSMutableArray array];
-	for (NSString *key in dict) {
-		id value = [dict objectForKey:key];
-		
-		if (value == [NSNull null]) {
-			value = @"";
-		}
-		else if ([value isKindOfClass:[NSNumber class]]) {
-			value = [value stringValue];
+	NSMutableData *data = [NSMutableData dataWithCapacity:256];
+	NSString *command = [dict objectForKey:@"cmd"];
+	NSArray *fixedKeys = command ? [self fixedParameterKeys] : nil;
+	
+	if ([fixedKeys count]) {
+		// cmd and the class's fixed parameters come pre-encoded from the template
+		BKRequestTemplate *template = [BKRequestTemplate templateForRequestClass:[self class] command:command fixedParameterKeys:fixedKeys parameters:dict];
+		[template appendEncodedParameters:dict authToken:token toData:data];
+	}
+	else {
+		// a template would save no more than encoding cmd, so it's not worth a cache lookup
+		if (command) {
+			BKAppendEncodedParameter(data, @"cmd", command);
 		}
-		else if ([value isKindOfClass:[NSDate class]]) {
-			CFLocaleRef currentLocale = CFLocaleCopyCurrent();		
-			CFTimeZoneRef timeZone = CFTimeZoneCreateWithName(NULL, (CFStringRef)@"GMT", NO);			
-			CFDateFormatterRef dateFormatter = CFDateFormatterCreate(NULL, currentLocale, kCFDateFormatterFullStyle, kCFDateFormatterFullStyle);		
-			CFDateFormatterSetProperty(dateFormatter, kCFDateFormatterTimeZone, timeZone);
-			CFDateFormatterSetFormat(dateFormatter, (CFStringRef)@"yyyy-MM-dd'T'HH:mm:ss'Z'");			
-            
-			value = [NSMakeCollectable(CFDateFormatterCreateStringWithDate(NULL, dateFormatter, (CFDateRef)value)) autorelease];
-            
-			CFRelease(dateFormatter);
-			CFRelease(timeZone);
-			CFRelease(currentLocale);
+		
+		if (token) {
+			BKAppendEncodedParameter(data, @"token", token);
 		}
 		
-		[params addObject:[NSString stringWithFormat:@"%@=%@", key, BKEscapedURLStringFromNSString(value)]];
+		for (NSString *key in dict) {
+			if (![key isEqualToString:@"cmd"] && (!token || ![key isEqualToString:@"token"])) {
+				BKAppendEncodedParameter(data, key, [dict objectForKey:key]);
+			}
+		}
 	}
 	
-	return [params count] ? [params componentsJoinedByString:@"&"] : nil;
+	preparedParameterData = [data copy];
+	return preparedParameterData;
 }
 @end
@@ -6,9 +6,33 @@
 
 #import "BKRequest.h"
 
+@class BKXMLMapper;
+@class BKContentDecoder;
+@class BKRequestTraceRecorder;
+
 @interface BKRequestOperation : NSOperation
 {
     BKRequest *request;
+
+    BKXMLMapper *responseMapper;
+    BKContentDecoder *responseDecoder;
+    id <BKByteSink> responseBodySink;
+    unsigned long long receivedLength;
+    unsigned long long decodedLength;
+
+    NSMutableArray *pendingReceivedItems;
+    BOOL processingScheduled;
+    BOOL asynchronousExecuting;
+    BOOL asynchronousFinished;
+    BOOL asynchronousFinishing;
+    BOOL retriedAfterReauthentication;
+    CFAbsoluteTime fetchStartTime;
+    BOOL servedFromCache;
+    BOOL requestSent;
+    NSUInteger pendingReceivedLength;
+    BOOL receivingPausedForBacklog;
+    BOOL receivingPausedForThrottle;
+    BOOL receivingPaused;
 }
 - (id)initWithRequest:(BKRequest *)inRequest;
 
@@ -16,13 +40,41 @@
 - (void)fetchMappedXMLData;
 - (void)cancelFetch;
 
+// Asynchronous mode: return YES from -usesAsynchronousFetch and override -beginAsynchronousFetch instead of
+// -fetchMappedXMLData. The operation is then concurrent and doesn't block a queue thread while waiting for the
+// network. -beginAsynchronousFetch (and -cancelFetch) are invoked on a single shared network thread with a running
+// run loop, so e.g. NSURLConnection objects can just be scheduled there. Call the receiving methods below as data
+// arrives, then -asynchronousFetchDidFinish (also after setting the request's error yourself). Decoding, mapping,
+// -processRequestCompletion and the completion handlers are run on a shared processing queue that has as many
+// threads as there are processors, so the number of threads stays the same however many requests are in flight.
+- (BOOL)usesAsynchronousFetch;
+- (void)beginAsynchronousFetch;
+- (void)asynchronousFetchDidFinish;
+
+// Flow control for asynchronous fetches, invoked on the network thread. Once more than
+// BKRequestOperationReceiveBacklogLimit bytes are waiting for the processing queue, the operation asks the fetch to
+// stop reading with -pauseReceiving, and lets it go on with -resumeReceiving when half of that has been processed.
+// The same goes for a request's -bandwidthThrottle: the fetch is paused for as long as the throttle asks. The default
+// implementations do nothing, in which case neither the backlog nor the rate is bounded; with NSURLConnection, take
+// the connection off the run loop and put it back. (Synchronous fetches are throttled by sleeping in
+// -appendReceivedData:, i.e. on the thread that reads the data.)
+- (void)pauseReceiving;
+- (void)resumeReceiving;
+
++ (NSThread *)networkThread;
++ (NSOperationQueue *)processingQueue;
+
+// When set, every request that completes (successfully or not, but not cancelled) is appended to the recorder's trace
++ (BKRequestTraceRecorder *)traceRecorder;
++ (void)setTraceRecorder:(BKRequestTraceRecorder *)inRecorder;
+
 // The default behavior is to invoke the selector in the same thread; you might want to do otherwise (no need to call super if overriden)
 - (void)dispatchSelector:(SEL)inSelector;
 
 // Override these (no need to call super if overriden)
 - (void)handleRequestStarted;
 - (void)handleRequestCancelled;
-- (void)processRequestCompletion;   // invoked in the same thread of the -main
+- (void)processRequestCompletion;   // invoked in the same thread of the -main (the processing queue in asynchronous mode)
 - (void)handleRequestCompleted;     // dispatched, usually in the thread the operation is created 
 - (void)handleRequestFailed;
 - (void)handleRequestOperationEnded;
@@ -30,5 +82,42 @@
 // Internal handler for dependency-caused cancellation, invoked by -main
 - (void)handleDependencyCancellation;
 
+// A request with a -cachedResponse completes with it right away, without -fetchMappedXMLData or
+// -beginAsynchronousFetch being invoked.
+
+// A request that fails with BKNotLoggedOnError is sent once more (-fetchMappedXMLData or -beginAsynchronousFetch is
+// invoked again) after the API context has reauthenticated; see BKAPIContext's reauthenticationHandler. In the
+// synchronous mode the operation's thread waits for the reauthentication, but only until the operation is cancelled
+// or BKRequestOperationReauthenticationTimeout seconds have passed; the request then keeps its BKNotLoggedOnError.
+
+// Helpers for -fetchMappedXMLData implementations that receive the response body piece by piece (e.g. from
+// NSURLConnection callbacks). The body is fed to the XML mapper as it arrives. -finishReceivingResponse sets
+// either the request's rawXMLMappedResponse or its error. In asynchronous mode, call these on the network thread;
+// the data is handed to the processing queue (in order), and -asynchronousFetchDidFinish finishes receiving for you.
+//
+// Use -beginReceivingHTTPResponse: when the fetcher has already undone the Content-Encoding, as NSURLConnection
+// always does. Only a fetcher that hands over the bytes exactly as they came off the wire (e.g. a CFHTTPStream or a
+// socket of your own) should use -beginReceivingRawHTTPResponse: or pass an encoding to
+// -beginReceivingResponseWithContentEncoding:; the body is then inflated as it arrives, and feeding it bytes that
+// are already inflated fails with BKResponseDecodingError. Requests that don't return XML (see
+// BKAttachmentDownloadRequest) need the response object, so use one of the HTTP response variants for those.
+- (void)beginReceivingResponseWithContentEncoding:(NSString *)inContentEncoding;   // nil for a body that's not encoded
+- (void)beginReceivingHTTPResponse:(NSHTTPURLResponse *)inResponse;                // the body is already decoded
+- (void)beginReceivingRawHTTPResponse:(NSHTTPURLResponse *)inResponse;             // decoded per its Content-Encoding
+- (BOOL)appendReceivedData:(NSData *)inData;     // NO if the fetch should stop, e.g. because the operation is cancelled
+- (void)finishReceivingResponse;
+
+// A -fetchMappedXMLData that gets the whole body at once and maps it itself (e.g. with +[BKXMLMapper
+// dictionaryMappedFromXMLData:responseSchema:operation:]) reports the body's length here, so that the trace (see
+// +setTraceRecorder:) doesn't record it as empty. The receiving helpers above keep count by themselves.
+- (void)noteResponseLength:(unsigned long long)inLength;
+
 @property (readonly) BKRequest *request;
+// receivedLength counts the bytes given to -appendReceivedData:, which are the bytes on the wire only with the raw
+// variants; what NSURLConnection hands over is already inflated, so both lengths are the same then
+@property (readonly) unsigned long long receivedLength;
+@property (readonly) unsigned long long decodedLength;     // bytes after decoding
 @end
+
+extern const NSUInteger BKRequestOperationReceiveBacklogLimit;
+extern const NSTimeInterval BKRequestOperationReauthenticationTimeout;
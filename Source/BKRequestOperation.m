@@ -5,12 +5,55 @@
 //
 
 #import "BKRequestOperation.h"
+#import "BKBandwidthThrottle.h"
+#import "BKContentDecoder.h"
+#import "BKError.h"
 #import "BKPrivateUtilities.h"
+#import "BKRequest+ProtectedMethods.h"
+#import "BKRequestTrace.h"
+#import "BKXMLMapper.h"
+#import <dispatch/dispatch.h>
+
+@interface BKRequestOperation (PrivateMethods)
+- (BOOL)dependenciesSucceeded;
+- (void)beginReceivingResponse:(NSHTTPURLResponse *)inResponse contentEncoding:(NSString *)inContentEncoding;
+- (BOOL)loadCachedResponse;
+- (void)completeRequest;
+- (BOOL)needsReauthentication;
+- (BOOL)reauthenticateForRetry;
+- (void)enqueueReceivedItem:(id)inItem;
+- (void)processReceivedItems;
+- (BOOL)decodeReceivedData:(NSData *)inData;
+- (void)finishDecodingResponse;
+- (void)completeAsynchronousFetch;
+- (void)finishAsynchronousOperation;
+- (void)beginAsynchronousFetchUnlessCancelled;
+- (void)updateReceivingPause;
+- (void)throttleReceivedLength:(NSUInteger)inLength;
+- (void)endThrottlePause;
+@end
+
+const NSUInteger BKRequestOperationReceiveBacklogLimit = 1024 * 1024;
+const NSTimeInterval BKRequestOperationReauthenticationTimeout = 60.0;
+
+// markers put in the received item queue along with the NSData chunks
+static NSString *const kFinishReceivingItem = @"finishReceiving";
+static NSString *const kCompleteFetchItem = @"completeFetch";
+
+static BKRequestTraceRecorder *BKRequestOperationTraceRecorder = nil;
 
 @implementation BKRequestOperation
 - (void)dealloc
 {
+    if ([request runningOperation] == self) {
+        [request setRunningOperation:nil];
+    }
+    
     BKReleaseClean(request);
+    BKReleaseClean(responseMapper);
+    BKReleaseClean(responseDecoder);
+    BKReleaseClean(responseBodySink);
+    BKReleaseClean(pendingReceivedItems);
     [super dealloc];
 }
 
@@ -19,6 +62,7 @@
     self = [super init];
     if (self) {
         request = [inRequest retain];
+        [request setRunningOperation:self];
     }
     
     return self;
@@ -32,6 +76,90 @@
 {    
 }
 
+- (BOOL)usesAsynchronousFetch
+{
+    return NO;
+}
+
+- (void)beginAsynchronousFetch
+{
+}
+
+- (void)asynchronousFetchDidFinish
+{
+    [self enqueueReceivedItem:kCompleteFetchItem];
+}
+
+- (void)pauseReceiving
+{
+}
+
+- (void)resumeReceiving
+{
+}
+
++ (void)networkThreadMain:(id)inObject
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    [[NSThread currentThread] setName:@"BKRequestOperation network thread"];
+    
+    // the port keeps the run loop from returning right away when there's nothing scheduled
+    NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+    [runLoop addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+    
+    while (YES) {
+        NSAutoreleasePool *innerPool = [[NSAutoreleasePool alloc] init];
+        [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+        [innerPool drain];
+    }
+    
+    [pool drain];
+}
+
++ (NSThread *)networkThread
+{
+    static NSThread *networkThread = nil;
+    
+    @synchronized([BKRequestOperation class]) {
+        if (!networkThread) {
+            networkThread = [[NSThread alloc] initWithTarget:[BKRequestOperation class] selector:@selector(networkThreadMain:) object:nil];
+            [networkThread start];
+        }
+    }
+    
+    return networkThread;
+}
+
++ (NSOperationQueue *)processingQueue
+{
+    static NSOperationQueue *processingQueue = nil;
+    
+    @synchronized([BKRequestOperation class]) {
+        if (!processingQueue) {
+            processingQueue = [[NSOperationQueue alloc] init];
+            [processingQueue setName:@"BKRequestOperation processing queue"];
+            [processingQueue setMaxConcurrentOperationCount:[[NSProcessInfo processInfo] activeProcessorCount]];
+        }
+    }
+    
+    return processingQueue;
+}
+
++ (BKRequestTraceRecorder *)traceRecorder
+{
+    @synchronized([BKRequestOperation class]) {
+        return [[BKRequestOperationTraceRecorder retain] autorelease];
+    }
+}
+
++ (void)setTraceRecorder:(BKRequestTraceRecorder *)inRecorder
+{
+    @synchronized([BKRequestOperation class]) {
+        BKRetainAssign(BKRequestOperationTraceRecorder, inRecorder);
+    }
+}
+
 // The default behavior is to invoke the selector in the same thread; you might want to do otherwise (no need to call super if overriden)
 - (void)dispatchSelector:(SEL)inSelector
 {
@@ -70,8 +198,78 @@
     [self cancel];    
 }
 
+#pragma mark Receiving the response
+
+- (void)beginReceivingResponseWithContentEncoding:(NSString *)inContentEncoding
+{
+    [self beginReceivingResponse:nil contentEncoding:inContentEncoding];
+}
+
+- (void)beginReceivingHTTPResponse:(NSHTTPURLResponse *)inResponse
+{
+    // the header describes what was on the wire, not what we're given, so it's not looked at
+    [self beginReceivingResponse:inResponse contentEncoding:nil];
+}
+
+- (void)beginReceivingRawHTTPResponse:(NSHTTPURLResponse *)inResponse
+{
+    [self beginReceivingResponse:inResponse contentEncoding:[[inResponse allHeaderFields] objectForKey:@"Content-Encoding"]];
+}
+
+- (BOOL)appendReceivedData:(NSData *)inData
+{
+    if ([self usesAsynchronousFetch]) {
+        if ([self isCancelled]) {
+            return NO;
+        }
+        
+        [self enqueueReceivedItem:inData];
+        [self throttleReceivedLength:[inData length]];
+        return YES;
+    }
+    
+    if (![self decodeReceivedData:inData]) {
+        return NO;
+    }
+    
+    [self throttleReceivedLength:[inData length]];
+    return ![self isCancelled];
+}
+
+- (void)noteResponseLength:(unsigned long long)inLength
+{
+    // the body is whole and not encoded by the time it's mapped
+    receivedLength = inLength;
+    decodedLength = inLength;
+}
+
+- (void)finishReceivingResponse
+{
+    if ([self usesAsynchronousFetch]) {
+        [self enqueueReceivedItem:kFinishReceivingItem];
+        return;
+    }
+    
+    [self finishDecodingResponse];
+}
+
 #pragma mark Overriden NSOperationQueue methods
 
+- (BOOL)isConcurrent
+{
+    return [self usesAsynchronousFetch];
+}
+
+- (BOOL)isExecuting
+{
+    return [self usesAsynchronousFetch] ? asynchronousExecuting : [super isExecuting];
+}
+
+- (BOOL)isFinished
+{
+    return [self usesAsynchronousFetch] ? asynchronousFinished : [super isFinished];
+}
+
 - (void)cancel
 {
 	BOOL alreadyCanceled = [self isCancelled];
@@ -80,48 +278,499 @@
     [super cancel];
 	
     if (!alreadyCanceled && !alreadyFinished) {
-        [self cancelFetch];    
+        if ([self usesAsynchronousFetch]) {
+            if (asynchronousExecuting) {
+                [self performSelector:@selector(cancelFetch) onThread:[BKRequestOperation networkThread] withObject:nil waitUntilDone:NO];
+            }
+        }
+        else {
+            [self cancelFetch];
+        }
+        
         [self dispatchSelector:@selector(handleRequestCancelled)];
         [self dispatchSelector:@selector(handleRequestOperationEnded)];
+        
+        // if we haven't started yet, -start will finish us right away
+        if ([self usesAsynchronousFetch] && asynchronousExecuting) {
+            [self finishAsynchronousOperation];
+        }
     }
 }
 
+- (void)start
+{
+    if (![self usesAsynchronousFetch]) {
+        [super start];
+        return;
+    }
+    
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    [self willChangeValueForKey:@"isExecuting"];
+    asynchronousExecuting = YES;
+    [self didChangeValueForKey:@"isExecuting"];
+    
+    if ([self isCancelled]) {
+        [self finishAsynchronousOperation];
+    }
+    else if (![self dependenciesSucceeded]) {
+        [self handleDependencyCancellation];
+        [self finishAsynchronousOperation];
+    }
+    else {
+        [self dispatchSelector:@selector(handleRequestStarted)];
+        
+        if ([self loadCachedResponse]) {
+            // completed on the processing queue like any other response
+            [self enqueueReceivedItem:kCompleteFetchItem];
+        }
+        else {
+            fetchStartTime = CFAbsoluteTimeGetCurrent();
+            [self performSelector:@selector(beginAsynchronousFetchUnlessCancelled) onThread:[BKRequestOperation networkThread] withObject:nil waitUntilDone:NO];
+        }
+    }
+    
+    [pool drain];
+}
+
 - (void)main
 {
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
 
+    if ([self dependenciesSucceeded]) {    
+        [self dispatchSelector:@selector(handleRequestStarted)];
+
+        if (![self loadCachedResponse]) {
+            fetchStartTime = CFAbsoluteTimeGetCurrent();
+            requestSent = YES;
+            [request requestWillBeSent];
+            [self fetchMappedXMLData];
+            
+            if ([self reauthenticateForRetry]) {
+                [request requestWillBeSent];
+                [self fetchMappedXMLData];
+            }
+        }
+        
+        [self completeRequest];
+    }
+    else {
+        [self handleDependencyCancellation];
+    }
+    
+    [pool drain];
+}
+
+@synthesize request;
+@synthesize receivedLength;
+@synthesize decodedLength;
+@end
+
+@implementation BKRequestOperation (PrivateMethods)
+- (BOOL)dependenciesSucceeded
+{
     // see if any of the dependencies is cancelled or has error
-    BOOL allDependenciesCompleted = YES;
     for (BKRequestOperation *dependency in [self dependencies]) {
         if ([dependency isCancelled] || ([dependency isKindOfClass:[BKRequestOperation class]] && dependency.request.error)) {
-            allDependenciesCompleted = NO;
-            break;
+            return NO;
         }
     }
     
-    if (allDependenciesCompleted) {    
-        [self dispatchSelector:@selector(handleRequestStarted)];
+    return YES;
+}
+
+- (void)beginReceivingResponse:(NSHTTPURLResponse *)inResponse contentEncoding:(NSString *)inContentEncoding
+{
+    BKReleaseClean(responseDecoder);
+    BKReleaseClean(responseMapper);
+    BKReleaseClean(responseBodySink);
+    receivedLength = 0;
+    decodedLength = 0;
+    
+    NSError *sinkError = nil;
+    responseBodySink = [[request responseBodySinkForHTTPResponse:inResponse error:&sinkError] retain];
+    
+    if (sinkError) {
+        request.error = sinkError;
+        return;
+    }
+    
+    if (!responseBodySink) {
+        responseMapper = [[BKXMLMapper alloc] initWithResponseSchema:[request responseSchema]];
+        responseMapper.owningOperation = self;
+    }
+    
+    responseDecoder = [[BKContentDecoder alloc] initWithContentEncoding:inContentEncoding sink:(responseBodySink ? responseBodySink : responseMapper)];
+    
+    if (!responseDecoder) {
+        BKReleaseClean(responseMapper);
+        BKReleaseClean(responseBodySink);
+        request.error = [NSError errorWithDomain:BKAPIErrorDomain code:BKResponseDecodingError userInfo:nil];
+    }
+}
+
+- (BOOL)loadCachedResponse
+{
+    id cachedResponse = [request cachedResponse];
+    if (!cachedResponse) {
+        return NO;
+    }
+    
+    request.processedResponse = cachedResponse;
+    servedFromCache = YES;
+    return YES;
+}
+
+- (void)completeRequest
+{
+    // before any handler runs, so that e.g. a case that was edited is never seen in the cache again
+    if (requestSent) {
+        [request requestDidEnd];
+    }
+    
+    if (![self isCancelled]) {
+        // a trace is of what went over the wire
+        if (!servedFromCache) {
+            [[BKRequestOperation traceRecorder] recordRequest:request startTime:fetchStartTime responseLength:decodedLength];
+        }
+        
+        // requests with a response body sink only have a processed response
+        if (request.error || (!request.rawXMLMappedResponse && !request.processedResponse)) {
+            [self dispatchSelector:@selector(handleRequestFailed)];            
+        }
+        else {
+            [self processRequestCompletion];
+            [self dispatchSelector:@selector(handleRequestCompleted)];            
+        }
+        
+        [self dispatchSelector:@selector(handleRequestOperationEnded)];
+    }
+}
+
+- (BOOL)needsReauthentication
+{
+    NSError *error = request.error;
+    return !retriedAfterReauthentication && ![self isCancelled] && [request requiresAuthToken] && [[error domain] isEqualToString:BKAPIErrorDomain] && [error code] == BKNotLoggedOnError;
+}
+
+- (BOOL)reauthenticateForRetry
+{
+    if (![self needsReauthentication]) {
+        return NO;
+    }
+    
+    retriedAfterReauthentication = YES;
+    
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    __block BOOL renewed = NO;
+    
+    // the completion may come after we've given up waiting, so it keeps the semaphore alive on its own
+    dispatch_retain(semaphore);
+    [request.APIContext reauthenticateAfterRejectionOfToken:request.sentAuthToken completion:^(BOOL inSucceeded) {
+        renewed = inSucceeded;
+        dispatch_semaphore_signal(semaphore);
+        dispatch_release(semaphore);
+    }];
+    
+    // wait in short slices, so a cancellation is noticed, and give up eventually: if the logon was put on the queue
+    // this thread belongs to, it won't run before we return; the request then fails with BKNotLoggedOnError
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + BKRequestOperationReauthenticationTimeout;
+    BOOL signaled = NO;
+    
+    while (!signaled && ![self isCancelled] && CFAbsoluteTimeGetCurrent() < deadline) {
+        signaled = !dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.1 * NSEC_PER_SEC)));
+    }
+    
+    dispatch_release(semaphore);
+    
+    if (!signaled || !renewed || [self isCancelled]) {
+        return NO;
+    }
+    
+    [request resetForRetry];
+    return YES;
+}
+
+- (void)enqueueReceivedItem:(id)inItem
+{
+    BOOL needsProcessing = NO;
+    BOOL needsPause = NO;
+    
+    @synchronized(self) {
+        if (!pendingReceivedItems) {
+            pendingReceivedItems = [[NSMutableArray alloc] init];
+        }
+        
+        [pendingReceivedItems addObject:inItem];
+        
+        if ([inItem isKindOfClass:[NSData class]]) {
+            pendingReceivedLength += [inItem length];
+            
+            if (!receivingPausedForBacklog && pendingReceivedLength >= BKRequestOperationReceiveBacklogLimit) {
+                receivingPausedForBacklog = YES;
+                needsPause = YES;
+            }
+        }
+        
+        if (!processingScheduled) {
+            processingScheduled = YES;
+            needsProcessing = YES;
+        }
+    }
+    
+    if (needsPause) {
+        [self performSelector:@selector(updateReceivingPause) onThread:[BKRequestOperation networkThread] withObject:nil waitUntilDone:NO];
+    }
+    
+    // at most one processing operation per request operation, so the items are always handled in order
+    if (needsProcessing) {
+        NSInvocationOperation *op = [[NSInvocationOperation alloc] initWithTarget:self selector:@selector(processReceivedItems) object:nil];
+        [[BKRequestOperation processingQueue] addOperation:op];
+        [op release];
+    }
+}
 
-        [self fetchMappedXMLData];
+- (void)processReceivedItems
+{
+    while (YES) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        id item = nil;
+        BOOL needsResume = NO;
         
-        if (![self isCancelled]) {
-            if (request.error || !request.rawXMLMappedResponse) {
-                [self dispatchSelector:@selector(handleRequestFailed)];            
+        @synchronized(self) {
+            if ([pendingReceivedItems count]) {
+                item = [[pendingReceivedItems objectAtIndex:0] retain];
+                [pendingReceivedItems removeObjectAtIndex:0];
+                
+                if ([item isKindOfClass:[NSData class]]) {
+                    pendingReceivedLength -= [item length];
+                    
+                    if (receivingPausedForBacklog && pendingReceivedLength <= BKRequestOperationReceiveBacklogLimit / 2) {
+                        receivingPausedForBacklog = NO;
+                        needsResume = YES;
+                    }
+                }
             }
             else {
-                [self processRequestCompletion];
-                [self dispatchSelector:@selector(handleRequestCompleted)];            
+                processingScheduled = NO;
             }
-            
-            [self dispatchSelector:@selector(handleRequestOperationEnded)];
+        }
+        
+        if (needsResume) {
+            [self performSelector:@selector(updateReceivingPause) onThread:[BKRequestOperation networkThread] withObject:nil waitUntilDone:NO];
+        }
+        
+        if (!item) {
+            [pool drain];
+            break;
+        }
+        
+        if (item == kCompleteFetchItem) {
+            [self completeAsynchronousFetch];
+        }
+        else if ([self isCancelled]) {
+            // no point in decoding any further
+            BKReleaseClean(responseDecoder);
+            BKReleaseClean(responseMapper);
+            BKReleaseClean(responseBodySink);
+        }
+        else if (item == kFinishReceivingItem) {
+            [self finishDecodingResponse];
+        }
+        else {
+            [self decodeReceivedData:item];
+        }
+        
+        [item release];
+        [pool drain];
+    }
+}
+
+- (BOOL)decodeReceivedData:(NSData *)inData
+{
+    if (!responseDecoder) {
+        return NO;
+    }
+    
+    // returning NO tells the fetch to stop; what's been decoded so far is of no use
+    if ([self isCancelled]) {
+        BKReleaseClean(responseDecoder);
+        BKReleaseClean(responseMapper);
+        BKReleaseClean(responseBodySink);
+        return NO;
+    }
+    
+    receivedLength += [inData length];
+    BOOL success = [responseDecoder appendBytes:[inData bytes] length:[inData length]];
+    decodedLength = responseDecoder.decodedLength;
+    
+    if (!success) {
+        BKReleaseClean(responseDecoder);
+        BKReleaseClean(responseMapper);
+        BKReleaseClean(responseBodySink);
+        
+        // a body sink that stopped taking bytes (e.g. the disk is full) may have set a more specific error, and a
+        // mapper stops taking them when the operation is cancelled
+        if (!request.error && ![self isCancelled]) {
+            request.error = [NSError errorWithDomain:BKAPIErrorDomain code:BKResponseDecodingError userInfo:nil];
+        }
+    }
+    
+    return success;
+}
+
+- (void)finishDecodingResponse
+{
+    if (!responseDecoder) {
+        return;
+    }
+    
+    // neither finish the body nor map the rest of a cancelled response; just let go of it
+    if ([self isCancelled]) {
+        BKReleaseClean(responseDecoder);
+        BKReleaseClean(responseMapper);
+        BKReleaseClean(responseBodySink);
+        return;
+    }
+    
+    if (responseBodySink) {
+        NSError *bodyError = [responseDecoder finish] ? [request finishResponseBody] : [NSError errorWithDomain:BKAPIErrorDomain code:BKResponseDecodingError userInfo:nil];
+        
+        if (bodyError) {
+            request.error = bodyError;
         }
     }
     else {
-        [self handleDependencyCancellation];
+        NSDictionary *mappedResponse = [responseDecoder finish] ? [responseMapper finishMapping] : nil;
+        
+        // the mapper returns nil once the operation is cancelled; if it got to the end first, there's still no one
+        // to postprocess the response for
+        if (mappedResponse) {
+            if (![self isCancelled]) {
+                request.rawXMLMappedResponse = mappedResponse;
+            }
+        }
+        else if (![self isCancelled]) {
+            request.error = [NSError errorWithDomain:BKAPIErrorDomain code:BKResponseDecodingError userInfo:nil];
+        }
     }
     
-    [pool drain];
+    BKReleaseClean(responseDecoder);
+    BKReleaseClean(responseMapper);
+    BKReleaseClean(responseBodySink);
 }
 
-@synthesize request;
+- (void)completeAsynchronousFetch
+{
+    // the subclass might not have called -finishReceivingResponse itself
+    if (responseDecoder && ![self isCancelled]) {
+        [self finishDecodingResponse];
+    }
+    
+    // don't hold a processing thread while waiting; the fetch starts over (or completes) when the context is done
+    if ([self needsReauthentication]) {
+        retriedAfterReauthentication = YES;
+        
+        [request.APIContext reauthenticateAfterRejectionOfToken:request.sentAuthToken completion:^(BOOL inSucceeded) {
+            if (inSucceeded && ![self isCancelled]) {
+                [request resetForRetry];
+                [self performSelector:@selector(beginAsynchronousFetchUnlessCancelled) onThread:[BKRequestOperation networkThread] withObject:nil waitUntilDone:NO];
+            }
+            else {
+                [self enqueueReceivedItem:kCompleteFetchItem];
+            }
+        }];
+        
+        return;
+    }
+    
+    [self completeRequest];
+    [self finishAsynchronousOperation];
+}
+
+- (void)finishAsynchronousOperation
+{
+    @synchronized(self) {
+        if (asynchronousFinishing) {
+            return;
+        }
+        
+        asynchronousFinishing = YES;
+    }
+    
+    [self willChangeValueForKey:@"isExecuting"];
+    [self willChangeValueForKey:@"isFinished"];
+    asynchronousExecuting = NO;
+    asynchronousFinished = YES;
+    [self didChangeValueForKey:@"isFinished"];
+    [self didChangeValueForKey:@"isExecuting"];
+}
+
+- (void)beginAsynchronousFetchUnlessCancelled
+{
+    // -cancel queues -cancelFetch on this thread only after the operation is marked cancelled, so a fetch that's
+    // begun here is always cancelled afterwards if need be, never before
+    if ([self isCancelled]) {
+        return;
+    }
+    
+    @synchronized(self) {
+        pendingReceivedLength = 0;
+        receivingPausedForBacklog = NO;
+    }
+    
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(endThrottlePause) object:nil];
+    receivingPausedForThrottle = NO;
+    receivingPaused = NO;
+    requestSent = YES;
+    [request requestWillBeSent];
+    [self beginAsynchronousFetch];
+}
+
+- (void)updateReceivingPause
+{
+    BOOL shouldPause = receivingPausedForThrottle;
+    
+    @synchronized(self) {
+        shouldPause = shouldPause || receivingPausedForBacklog;
+    }
+    
+    if (shouldPause != receivingPaused && ![self isCancelled]) {
+        receivingPaused = shouldPause;
+        
+        if (shouldPause) {
+            [self pauseReceiving];
+        }
+        else {
+            [self resumeReceiving];
+        }
+    }
+}
+
+- (void)throttleReceivedLength:(NSUInteger)inLength
+{
+    NSTimeInterval delay = [[request bandwidthThrottle] delayForTransferOfLength:inLength];
+    if (delay <= 0.0) {
+        return;
+    }
+    
+    // a synchronous fetch reads on this very thread, so waiting here holds the reading back
+    if (![self usesAsynchronousFetch]) {
+        [NSThread sleepForTimeInterval:delay];
+        return;
+    }
+    
+    // on the network thread, which serves every other fetch too; stop reading this one for a while instead
+    receivingPausedForThrottle = YES;
+    [self updateReceivingPause];
+    
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(endThrottlePause) object:nil];
+    [self performSelector:@selector(endThrottlePause) withObject:nil afterDelay:delay];
+}
+
+- (void)endThrottlePause
+{
+    receivingPausedForThrottle = NO;
+    [self updateReceivingPause];
+}
 @end
@@ -0,0 +1,67 @@
+//
+// BKRequestTemplate.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+// A request template holds the URL-encoded form of the parameters that are the same for every request of a kind
+// (the command and any fixed parameters), so that building tens of thousands of requests doesn't encode them over
+// and over again. BKRequest looks templates up automatically for the classes that have fixed parameter keys (the
+// others encode their few parameters directly). They are cached per request class, a few per class, and matched by
+// comparing the fixed values themselves, so looking one up builds no key; lookups only take a read lock. Per-request
+// values, the auth token above all, are never part of a template; they are appended when the template is filled in.
+@interface BKRequestTemplate : NSObject
+{
+    NSString *command;
+    NSArray *fixedParameterKeys;
+    NSDictionary *fixedParameters;
+    NSData *encodedParameters;
+}
+// the cached template whose command and fixed values match inParameters, or nil
++ (BKRequestTemplate *)cachedTemplateForRequestClass:(Class)inClass command:(NSString *)inCommand parameters:(NSDictionary *)inParameters;
+
+// the same, but makes (and caches) the template if there isn't one; inKeys are the class's fixed parameter keys
++ (BKRequestTemplate *)templateForRequestClass:(Class)inClass command:(NSString *)inCommand fixedParameterKeys:(NSArray *)inKeys parameters:(NSDictionary *)inParameters;
+
+// the fixed parameters are the values of inKeys in inParameters (keys without a value are left out)
+- (id)initWithCommand:(NSString *)inCommand fixedParameterKeys:(NSArray *)inKeys parameters:(NSDictionary *)inParameters;
+
+// YES if inParameters has the same values for the fixed keys (and none for those the template has no value for)
+- (BOOL)matchesParameters:(NSDictionary *)inParameters;
+
+// appends the encoded template parameters, then the token (if not nil), and then the rest of inParameters (skipping
+// cmd, the fixed ones, and token if one is given)
+- (void)appendEncodedParameters:(NSDictionary *)inParameters authToken:(NSString *)inToken toData:(NSMutableData *)ioData;
+
+@property (readonly) NSString *command;
+@property (readonly) NSArray *fixedParameterKeys;
+@property (readonly) NSDictionary *fixedParameters;    // not including cmd
+@property (readonly) NSData *encodedParameters;        // e.g. cmd=search&cols=sTitle
+@end
+
+// Appends "key=value" to ioData (preceded by "&" if ioData is not empty), percent-encoding both. The value can be
+// an NSString, NSNumber, NSDate (sent as yyyy-MM-ddTHH:mm:ssZ in UTC) or NSNull (sent as an empty string).
+extern void BKAppendEncodedParameter(NSMutableData *ioData, NSString *inKey, id inValue);
@@ -0,0 +1,257 @@
+//
+// BKRequestTemplate.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKRequestTemplate.h"
+#import <pthread.h>
+#import <time.h>
+
+// most classes only ever need one; the oldest ones go beyond this
+static const NSUInteger kTemplatesPerClassLimit = 16;
+
+// request class -> NSMutableArray of its templates, oldest first
+static CFMutableDictionaryRef BKRequestTemplateCache = NULL;
+static pthread_rwlock_t BKRequestTemplateCacheLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// unreserved characters (RFC 3986) are copied as-is, everything else is percent-encoded
+static const uint8_t kUnreservedCharacterTable[128] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,    // - .
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,    // 0-9
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,    // A-O
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,    // P-Z _
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,    // a-o
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0     // p-z ~
+};
+
+static void BKAppendEncodedBytes(NSMutableData *ioData, const char *inBytes, size_t inLength)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    
+    // reserve the worst case (every byte escaped) and shrink afterwards
+    NSUInteger oldLength = [ioData length];
+    [ioData setLength:oldLength + inLength * 3];
+    
+    char *start = (char *)[ioData mutableBytes] + oldLength;
+    char *out = start;
+    
+    for (size_t i = 0; i < inLength; i++) {
+        uint8_t c = (uint8_t)inBytes[i];
+        if (c < 128 && kUnreservedCharacterTable[c]) {
+            *out++ = (char)c;
+        }
+        else {
+            *out++ = '%';
+            *out++ = hexDigits[c >> 4];
+            *out++ = hexDigits[c & 0xf];
+        }
+    }
+    
+    [ioData setLength:oldLength + (NSUInteger)(out - start)];
+}
+
+static void BKAppendEncodedString(NSMutableData *ioData, NSString *inString)
+{
+    const char *bytes = CFStringGetCStringPtr((CFStringRef)inString, kCFStringEncodingUTF8);
+    if (!bytes) {
+        bytes = [inString UTF8String];
+    }
+    
+    if (bytes) {
+        BKAppendEncodedBytes(ioData, bytes, strlen(bytes));
+    }
+}
+
+void BKAppendEncodedParameter(NSMutableData *ioData, NSString *inKey, id inValue)
+{
+    if ([ioData length]) {
+        [ioData appendBytes:"&" length:1];
+    }
+    
+    BKAppendEncodedString(ioData, inKey);
+    [ioData appendBytes:"=" length:1];
+    
+    if (inValue == [NSNull null]) {
+        return;
+    }
+    
+    if ([inValue isKindOfClass:[NSDate class]]) {
+        // formatted by hand: a date formatter is costly to create and not locale-neutral
+        char buffer[32];
+        time_t t = (time_t)[(NSDate *)inValue timeIntervalSince1970];
+        struct tm gmt;
+        gmtime_r(&t, &gmt);
+        int length = snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02dZ", gmt.tm_year + 1900, gmt.tm_mon + 1, gmt.tm_mday, gmt.tm_hour, gmt.tm_min, gmt.tm_sec);
+        BKAppendEncodedBytes(ioData, buffer, (size_t)length);
+        return;
+    }
+    
+    BKAppendEncodedString(ioData, [inValue isKindOfClass:[NSString class]] ? inValue : [inValue description]);
+}
+
+// the cache is read-locked; nothing is moved around on a hit, so lookups from many threads don't wait for each other
+static BKRequestTemplate *BKRequestTemplateCacheLookup(Class inClass, NSString *inCommand, NSDictionary *inParameters)
+{
+    NSArray *templates = BKRequestTemplateCache ? (NSArray *)CFDictionaryGetValue(BKRequestTemplateCache, inClass) : nil;
+    
+    for (BKRequestTemplate *template in templates) {
+        if ([template.command isEqualToString:inCommand] && [template matchesParameters:inParameters]) {
+            return template;
+        }
+    }
+    
+    return nil;
+}
+
+@implementation BKRequestTemplate
+- (void)dealloc
+{
+    [command release];
+    [fixedParameterKeys release];
+    [fixedParameters release];
+    [encodedParameters release];
+    [super dealloc];
+}
+
++ (BKRequestTemplate *)cachedTemplateForRequestClass:(Class)inClass command:(NSString *)inCommand parameters:(NSDictionary *)inParameters
+{
+    pthread_rwlock_rdlock(&BKRequestTemplateCacheLock);
+    BKRequestTemplate *result = [BKRequestTemplateCacheLookup(inClass, inCommand, inParameters) retain];
+    pthread_rwlock_unlock(&BKRequestTemplateCacheLock);
+    
+    return [result autorelease];
+}
+
++ (BKRequestTemplate *)templateForRequestClass:(Class)inClass command:(NSString *)inCommand fixedParameterKeys:(NSArray *)inKeys parameters:(NSDictionary *)inParameters
+{
+    BKRequestTemplate *template = [self cachedTemplateForRequestClass:inClass command:inCommand parameters:inParameters];
+    if (template) {
+        return template;
+    }
+    
+    // made outside the lock, so another thread may have cached the same one meanwhile; then that one is used
+    template = [[[self alloc] initWithCommand:inCommand fixedParameterKeys:inKeys parameters:inParameters] autorelease];
+    
+    pthread_rwlock_wrlock(&BKRequestTemplateCacheLock);
+    
+    BKRequestTemplate *existing = [BKRequestTemplateCacheLookup(inClass, inCommand, inParameters) retain];
+    if (!existing) {
+        if (!BKRequestTemplateCache) {
+            // classes are never deallocated, so they don't need to be retained
+            BKRequestTemplateCache = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        }
+        
+        NSMutableArray *templates = (NSMutableArray *)CFDictionaryGetValue(BKRequestTemplateCache, inClass);
+        if (!templates) {
+            templates = [NSMutableArray array];
+            CFDictionarySetValue(BKRequestTemplateCache, inClass, templates);
+        }
+        
+        // the oldest one goes
+        if ([templates count] >= kTemplatesPerClassLimit) {
+            [templates removeObjectAtIndex:0];
+        }
+        
+        [templates addObject:template];
+    }
+    
+    pthread_rwlock_unlock(&BKRequestTemplateCacheLock);
+    return existing ? [existing autorelease] : template;
+}
+
+- (id)initWithCommand:(NSString *)inCommand fixedParameterKeys:(NSArray *)inKeys parameters:(NSDictionary *)inParameters
+{
+    self = [super init];
+    if (self) {
+        command = [inCommand copy];
+        fixedParameterKeys = inKeys ? [inKeys copy] : [[NSArray alloc] init];
+        
+        NSMutableDictionary *values = [NSMutableDictionary dictionary];
+        NSMutableData *data = [NSMutableData data];
+        BKAppendEncodedParameter(data, @"cmd", command);
+        
+        for (NSString *key in fixedParameterKeys) {
+            id value = [inParameters objectForKey:key];
+            if (value) {
+                [values setObject:value forKey:key];
+                BKAppendEncodedParameter(data, key, value);
+            }
+        }
+        
+        fixedParameters = [values copy];
+        encodedParameters = [data copy];
+    }
+    
+    return self;
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p> {command: %@, fixed params: %@}", [self class], self, command, fixedParameters];
+}
+
+- (BOOL)matchesParameters:(NSDictionary *)inParameters
+{
+    // the values themselves are compared, so no two different sets of values can ever be taken for the same
+    for (NSString *key in fixedParameterKeys) {
+        id value = [inParameters objectForKey:key];
+        id fixedValue = [fixedParameters objectForKey:key];
+        
+        if (value != fixedValue && (!value || !fixedValue || ![value isEqual:fixedValue])) {
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+- (void)appendEncodedParameters:(NSDictionary *)inParameters authToken:(NSString *)inToken toData:(NSMutableData *)ioData
+{
+    if ([ioData length]) {
+        [ioData appendBytes:"&" length:1];
+    }
+    
+    [ioData appendData:encodedParameters];
+    
+    if (inToken) {
+        BKAppendEncodedParameter(ioData, @"token", inToken);
+    }
+    
+    for (NSString *key in inParameters) {
+        if ([key isEqualToString:@"cmd"] || (inToken && [key isEqualToString:@"token"]) || [fixedParameters objectForKey:key]) {
+            continue;
+        }
+        
+        BKAppendEncodedParameter(ioData, key, [inParameters objectForKey:key]);
+    }
+}
+
+@synthesize command;
+@synthesize fixedParameterKeys;
+@synthesize fixedParameters;
+@synthesize encodedParameters;
+@end
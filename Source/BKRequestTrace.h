@@ -0,0 +1,66 @@
+//
+// BKRequestTrace.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+@class BKRequest;
+
+// A request trace is a text file with one line per completed request: when it started (seconds since the recorder
+// was created), how long it took, the decoded length of its response and its URL-encoded parameters, separated by
+// tabs. The token and the password are never written, and neither are logons, which couldn't be replayed without
+// the password. TrafficReplay (in Examples) replays traces against a stub
+// server to measure how many requests per second a client configuration can sustain.
+@interface BKRequestTraceEntry : NSObject
+{
+    NSTimeInterval startOffset;
+    NSTimeInterval duration;
+    unsigned long long responseLength;
+    NSDictionary *parameters;
+}
++ (NSArray *)entriesWithContentsOfFile:(NSString *)inPath error:(NSError **)outError;
+- (id)initWithStartOffset:(NSTimeInterval)inOffset duration:(NSTimeInterval)inDuration responseLength:(unsigned long long)inLength parameters:(NSDictionary *)inParameters;
+
+@property (readonly) NSTimeInterval startOffset;
+@property (readonly) NSTimeInterval duration;
+@property (readonly) unsigned long long responseLength;
+@property (readonly) NSDictionary *parameters;     // all strings, including cmd
+@property (readonly) NSString *command;
+@end
+
+// Appends the requests completed by BKRequestOperation to a trace file once set with
+// +[BKRequestOperation setTraceRecorder:]. Lines are buffered and written in batches, from any thread.
+@interface BKRequestTraceRecorder : NSObject
+{
+    int fileDescriptor;
+    NSMutableData *buffer;
+    CFAbsoluteTime startTime;
+}
+- (id)initWithPath:(NSString *)inPath error:(NSError **)outError;     // truncates the file
+- (void)recordRequest:(BKRequest *)inRequest startTime:(CFAbsoluteTime)inStartTime responseLength:(unsigned long long)inLength;
+- (void)flush;
+- (void)close;
+@end
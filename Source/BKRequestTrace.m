@@ -0,0 +1,245 @@
+//
+// BKRequestTrace.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKRequestTrace.h"
+#import "BKPrivateUtilities.h"
+#import "BKRequest+ProtectedMethods.h"
+#import "BKRequestTemplate.h"
+#import <fcntl.h>
+#import <unistd.h>
+
+static const NSUInteger kTraceWriteBufferSize = 64 * 1024;
+
+@interface BKRequestTraceRecorder (PrivateMethods)
+- (BOOL)writeBuffer;
+@end
+
+
+@implementation BKRequestTraceEntry
+- (void)dealloc
+{
+    BKReleaseClean(parameters);
+    [super dealloc];
+}
+
++ (NSArray *)entriesWithContentsOfFile:(NSString *)inPath error:(NSError **)outError
+{
+    NSString *contents = [NSString stringWithContentsOfFile:inPath encoding:NSUTF8StringEncoding error:outError];
+    if (!contents) {
+        return nil;
+    }
+    
+    NSMutableArray *entries = [NSMutableArray array];
+    NSUInteger lineNumber = 0;
+    
+    for (NSString *line in [contents componentsSeparatedByString:@"\n"]) {
+        lineNumber++;
+        
+        if (![line length] || [line hasPrefix:@"#"]) {
+            continue;
+        }
+        
+        NSArray *fields = [line componentsSeparatedByString:@"\t"];
+        if ([fields count] != 4) {
+            if (outError) {
+                NSString *description = [NSString stringWithFormat:@"Malformed trace line %lu in %@", (unsigned long)lineNumber, inPath];
+                *outError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:description, NSLocalizedDescriptionKey, nil]];
+            }
+            
+            return nil;
+        }
+        
+        NSMutableDictionary *parameters = [NSMutableDictionary dictionary];
+        for (NSString *pair in [[fields objectAtIndex:3] componentsSeparatedByString:@"&"]) {
+            NSRange equalSign = [pair rangeOfString:@"="];
+            if (equalSign.location == NSNotFound) {
+                continue;
+            }
+            
+            NSString *key = [[pair substringToIndex:equalSign.location] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+            NSString *value = [[pair substringFromIndex:NSMaxRange(equalSign)] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+            
+            if (key && value) {
+                [parameters setObject:value forKey:key];
+            }
+        }
+        
+        BKRequestTraceEntry *entry = [[BKRequestTraceEntry alloc] initWithStartOffset:[[fields objectAtIndex:0] doubleValue] duration:[[fields objectAtIndex:1] doubleValue] responseLength:strtoull([[fields objectAtIndex:2] UTF8String], NULL, 10) parameters:parameters];
+        [entries addObject:entry];
+        [entry release];
+    }
+    
+    return entries;
+}
+
+- (id)initWithStartOffset:(NSTimeInterval)inOffset duration:(NSTimeInterval)inDuration responseLength:(unsigned long long)inLength parameters:(NSDictionary *)inParameters
+{
+    self = [super init];
+    if (self) {
+        startOffset = inOffset;
+        duration = inDuration;
+        responseLength = inLength;
+        parameters = [inParameters copy];
+    }
+    
+    return self;
+}
+
+- (NSString *)command
+{
+    return [parameters objectForKey:@"cmd"];
+}
+
+@synthesize startOffset;
+@synthesize duration;
+@synthesize responseLength;
+@synthesize parameters;
+@end
+
+
+@implementation BKRequestTraceRecorder
+- (void)dealloc
+{
+    [self close];
+    BKReleaseClean(buffer);
+    [super dealloc];
+}
+
+- (id)initWithPath:(NSString *)inPath error:(NSError **)outError
+{
+    self = [super init];
+    if (self) {
+        fileDescriptor = open([inPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileDescriptor == -1) {
+            if (outError) {
+                *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+            }
+            
+            [self release];
+            return nil;
+        }
+        
+        buffer = [[NSMutableData alloc] initWithCapacity:kTraceWriteBufferSize];
+        startTime = CFAbsoluteTimeGetCurrent();
+        
+        const char *header = "# BugzKit request trace: start offset, duration, response length, parameters\n";
+        [buffer appendBytes:header length:strlen(header)];
+    }
+    
+    return self;
+}
+
+- (void)recordRequest:(BKRequest *)inRequest startTime:(CFAbsoluteTime)inStartTime responseLength:(unsigned long long)inLength
+{
+    NSDictionary *requestParameters = [inRequest requestParameterDict];
+    if (![requestParameters count]) {
+        return;
+    }
+    
+    // without the password a logon can't be replayed; the replay logs on by itself
+    if ([[requestParameters objectForKey:@"cmd"] isEqualToString:@"logon"]) {
+        return;
+    }
+    
+    // build the line outside the lock; only the append is serialized
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSMutableData *line = [NSMutableData dataWithCapacity:256];
+    char numbers[96];
+    int length = snprintf(numbers, sizeof(numbers), "%.6f\t%.6f\t%llu\t", inStartTime - startTime, now - inStartTime, inLength);
+    [line appendBytes:numbers length:(NSUInteger)length];
+    
+    NSMutableData *encodedParameters = [NSMutableData dataWithCapacity:256];
+    for (NSString *key in requestParameters) {
+        // stubResponseLength is the replay tool's hint to its stub server, not part of the original request
+        if (![key isEqualToString:@"token"] && ![key isEqualToString:@"password"] && ![key isEqualToString:@"stubResponseLength"]) {
+            BKAppendEncodedParameter(encodedParameters, key, [requestParameters objectForKey:key]);
+        }
+    }
+    
+    [line appendData:encodedParameters];
+    [line appendBytes:"\n" length:1];
+    
+    @synchronized(self) {
+        if (fileDescriptor == -1) {
+            return;
+        }
+        
+        [buffer appendData:line];
+        if ([buffer length] >= kTraceWriteBufferSize) {
+            [self writeBuffer];
+        }
+    }
+}
+
+- (void)flush
+{
+    @synchronized(self) {
+        if (fileDescriptor != -1) {
+            [self writeBuffer];
+        }
+    }
+}
+
+- (void)close
+{
+    @synchronized(self) {
+        if (fileDescriptor != -1) {
+            [self writeBuffer];
+            close(fileDescriptor);
+            fileDescriptor = -1;
+        }
+    }
+}
+@end
+
+
+@implementation BKRequestTraceRecorder (PrivateMethods)
+- (BOOL)writeBuffer
+{
+    const uint8_t *bytes = [buffer bytes];
+    NSUInteger remaining = [buffer length];
+    
+    while (remaining) {
+        ssize_t written = write(fileDescriptor, bytes, remaining);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            // a trace is a diagnostic aid; drop what can't be written rather than fail the requests
+            [buffer setLength:0];
+            return NO;
+        }
+        
+        bytes += written;
+        remaining -= (NSUInteger)written;
+    }
+    
+    [buffer setLength:0];
+    return YES;
+}
+@end
@@ -0,0 +1,69 @@
+//
+// BKResponseSchema.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+    BKResponseUnknownElement = 0,      // let BKXMLMapper guess (e.g. <cases><case> becomes an array)
+    BKResponseArrayElement = 1,        // always an array, even if it occurs only once
+    BKResponseScalarElement = 2        // never an array; repeated occurrences after the first are dropped (an assertion in debug builds)
+} BKResponseElementKind;
+
+typedef enum {
+    BKResponseInferredValue = 0,       // inferred from the Hungarian prefix, e.g. ixBug, dtOpened, fOpen
+    BKResponseStringValue,
+    BKResponseIntegerValue,
+    BKResponseUnsignedIntegerValue,
+    BKResponseBooleanValue,
+    BKResponseDateValue,
+    BKResponseDoubleValue
+} BKResponseValueType;
+
+// A response schema tells BKXMLMapper which elements of a command's response are collections and what type their
+// values have, so that the shape of the result doesn't depend on how many rows came back. Elements the schema
+// doesn't know about fall back to the plural-tag heuristics.
+//
+// An element kind can be given for a bare name (e.g. @"case") or for a name under a given parent, as a
+// @"parent/child" path (e.g. @"response/cases"); a path rule wins over a bare one. Scalar rules should be paths,
+// so that a same-named element elsewhere isn't cut down to one. Value types are looked up by bare name only.
+@interface BKResponseSchema : NSObject
+{
+    CFMutableDictionaryRef elementRules;
+    CFMutableDictionaryRef pathRules;       // parent name -> (child name -> rule)
+}
++ (BKResponseSchema *)schemaForCommand:(NSString *)inCommand;     // built-in schemas, nil for an unknown command
+
+// inValueTypes maps element names to NSNumbers of BKResponseValueType
+- (id)initWithArrayElements:(NSArray *)inArrayElements scalarElements:(NSArray *)inScalarElements valueTypes:(NSDictionary *)inValueTypes;
+
+// returns a new schema with the rules of both; the rules of inSchema win
+- (BKResponseSchema *)schemaByAddingSchema:(BKResponseSchema *)inSchema;
+
+- (BKResponseElementKind)kindOfElement:(NSString *)inElementName;       // bare name rules only
+- (BKResponseElementKind)kindOfElement:(NSString *)inElementName parent:(NSString *)inParentName;    // nil for the root
+- (BKResponseValueType)valueTypeOfElement:(NSString *)inElementName;
+@end
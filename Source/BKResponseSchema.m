@@ -0,0 +1,259 @@
+//
+// BKResponseSchema.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKResponseSchema.h"
+
+// a rule is packed into the dictionary value itself: the element kind in the low two bits, the value type above them
+#define BKRuleMake(kind, type)      ((const void *)(uintptr_t)(((uintptr_t)(type) << 2) | (uintptr_t)(kind)))
+#define BKRuleKind(rule)            ((BKResponseElementKind)((uintptr_t)(rule) & 0x3))
+#define BKRuleValueType(rule)       ((BKResponseValueType)((uintptr_t)(rule) >> 2))
+
+static void BKCopyRule(const void *inKey, const void *inValue, void *inContext)
+{
+    CFDictionarySetValue((CFMutableDictionaryRef)inContext, inKey, inValue);
+}
+
+// merges the child rules of one parent into the destination's, which gets its own copy of the inner dictionary
+static void BKCopyPathRules(const void *inKey, const void *inValue, void *inContext)
+{
+    CFMutableDictionaryRef destination = (CFMutableDictionaryRef)inContext;
+    CFMutableDictionaryRef children = (CFMutableDictionaryRef)CFDictionaryGetValue(destination, inKey);
+    
+    if (children) {
+        children = CFDictionaryCreateMutableCopy(NULL, 0, children);
+        CFDictionaryApplyFunction((CFDictionaryRef)inValue, BKCopyRule, children);
+    }
+    else {
+        children = CFDictionaryCreateMutableCopy(NULL, 0, (CFDictionaryRef)inValue);
+    }
+    
+    CFDictionarySetValue(destination, inKey, children);
+    CFRelease(children);
+}
+
+@interface BKResponseSchema (PrivateMethods)
++ (NSDictionary *)builtInSchemaDictionary;
+- (void)setKind:(BKResponseElementKind)inKind forElement:(NSString *)inElementName;
+- (void)setValueType:(BKResponseValueType)inType forElement:(NSString *)inElementName;
+@end
+
+@implementation BKResponseSchema
+- (void)dealloc
+{
+    if (elementRules) {
+        CFRelease(elementRules);
+    }
+    
+    if (pathRules) {
+        CFRelease(pathRules);
+    }
+    
+    [super dealloc];
+}
+
+- (id)init
+{
+    return [self initWithArrayElements:nil scalarElements:nil valueTypes:nil];
+}
+
+- (id)initWithArrayElements:(NSArray *)inArrayElements scalarElements:(NSArray *)inScalarElements valueTypes:(NSDictionary *)inValueTypes
+{
+    self = [super init];
+    if (self) {
+        // keys are retained and hashed as CFStrings; values are the packed rules, not objects
+        elementRules = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        pathRules = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        
+        for (NSString *name in inArrayElements) {
+            [self setKind:BKResponseArrayElement forElement:name];
+        }
+
+        for (NSString *name in inScalarElements) {
+            [self setKind:BKResponseScalarElement forElement:name];
+        }
+        
+        for (NSString *name in inValueTypes) {
+            [self setValueType:(BKResponseValueType)[[inValueTypes objectForKey:name] integerValue] forElement:name];
+        }
+    }
+    
+    return self;
+}
+
++ (BKResponseSchema *)schemaForCommand:(NSString *)inCommand
+{
+    if (!inCommand) {
+        return nil;
+    }
+    
+    return [[self builtInSchemaDictionary] objectForKey:inCommand];
+}
+
+- (BKResponseSchema *)schemaByAddingSchema:(BKResponseSchema *)inSchema
+{
+    BKResponseSchema *schema = [[[BKResponseSchema alloc] init] autorelease];
+    CFRelease(schema->elementRules);
+    schema->elementRules = CFDictionaryCreateMutableCopy(NULL, 0, elementRules);
+    CFDictionaryApplyFunction(pathRules, BKCopyPathRules, schema->pathRules);
+    
+    if (inSchema) {
+        CFDictionaryApplyFunction(inSchema->elementRules, BKCopyRule, schema->elementRules);
+        CFDictionaryApplyFunction(inSchema->pathRules, BKCopyPathRules, schema->pathRules);
+    }
+    
+    return schema;
+}
+
+- (BKResponseElementKind)kindOfElement:(NSString *)inElementName
+{
+    return BKRuleKind(CFDictionaryGetValue(elementRules, (CFStringRef)inElementName));
+}
+
+- (BKResponseElementKind)kindOfElement:(NSString *)inElementName parent:(NSString *)inParentName
+{
+    // no strings are built; it's two lookups for an element with a parent that has path rules, one otherwise
+    CFDictionaryRef children = inParentName ? (CFDictionaryRef)CFDictionaryGetValue(pathRules, (CFStringRef)inParentName) : NULL;
+    const void *rule = NULL;
+    
+    if (children && CFDictionaryGetValueIfPresent(children, (CFStringRef)inElementName, &rule)) {
+        return BKRuleKind(rule);
+    }
+    
+    return BKRuleKind(CFDictionaryGetValue(elementRules, (CFStringRef)inElementName));
+}
+
+- (BKResponseValueType)valueTypeOfElement:(NSString *)inElementName
+{
+    return BKRuleValueType(CFDictionaryGetValue(elementRules, (CFStringRef)inElementName));
+}
+
+#pragma mark NSObject methods
+
+- (NSString *)description
+{
+	return [NSString stringWithFormat:@"<%@: %p> {rules: %ld, parents with path rules: %ld}", [self class], self, (long)CFDictionaryGetCount(elementRules), (long)CFDictionaryGetCount(pathRules)];
+}
+@end
+
+@implementation BKResponseSchema (PrivateMethods)
++ (NSDictionary *)builtInSchemaDictionary
+{
+    static NSDictionary *schemaDictionary = nil;
+    
+    @synchronized(self) {
+        if (!schemaDictionary) {
+            NSMutableDictionary *d = [NSMutableDictionary dictionary];
+            
+            #define NUM(type) [NSNumber numberWithInteger:type]
+            BKResponseSchema *common = [[[BKResponseSchema alloc] initWithArrayElements:nil scalarElements:[NSArray arrayWithObjects:@"response", @"response/error", nil] valueTypes:nil] autorelease];
+            
+            // search: <cases><case> with optional <events><event> and, in an event, <rgAttachments><attachment>;
+            // <c> is the FogBugz 8.0 beta bug that sends the element twice, wherever it is, so it's the one bare
+            // scalar rule
+            BKResponseSchema *search = [[[BKResponseSchema alloc] initWithArrayElements:[NSArray arrayWithObjects:@"case", @"event", @"attachment", @"tag", nil]
+                                                                         scalarElements:[NSArray arrayWithObjects:@"response/cases", @"case/events", @"event/rgAttachments", @"case/tags", @"c", nil]
+                                                                             valueTypes:[NSDictionary dictionaryWithObjectsAndKeys:
+                                                                                         NUM(BKResponseUnsignedIntegerValue), @"c",
+                                                                                         NUM(BKResponseStringValue), @"ixBugChildren",
+                                                                                         NUM(BKResponseStringValue), @"ixRelatedBugs",
+                                                                                         nil]] autorelease];
+            [d setObject:[common schemaByAddingSchema:search] forKey:@"search"];
+            
+            // list commands: <projects><project>, <people><person> and so on
+            NSArray *lists = [NSArray arrayWithObjects:
+                              @"listFilters", @"filters", @"filter",
+                              @"listProjects", @"projects", @"project",
+                              @"listAreas", @"areas", @"area",
+                              @"listCategories", @"categories", @"category",
+                              @"listPriorities", @"priorities", @"priority",
+                              @"listPeople", @"people", @"person",
+                              @"listSnippets", @"snippets", @"snippet",
+                              @"listStatuses", @"statuses", @"status",
+                              @"listFixFors", @"fixfors", @"fixfor",
+                              @"listMailboxes", @"mailboxes", @"mailbox",
+                              nil];
+            
+            for (NSUInteger i = 0; i + 2 < [lists count]; i += 3) {
+                BKResponseSchema *list = [[BKResponseSchema alloc] initWithArrayElements:[NSArray arrayWithObject:[lists objectAtIndex:i + 2]] scalarElements:[NSArray arrayWithObject:[@"response/" stringByAppendingString:[lists objectAtIndex:i + 1]]] valueTypes:nil];
+                [d setObject:[common schemaByAddingSchema:list] forKey:[lists objectAtIndex:i]];
+                [list release];
+            }
+            
+            // working schedule: holidays are a list even if there's only one; the workday hours can be fractional
+            BKResponseSchema *schedule = [[[BKResponseSchema alloc] initWithArrayElements:[NSArray arrayWithObject:@"holiday"]
+                                                                           scalarElements:[NSArray arrayWithObjects:@"response/workingSchedule", @"workingSchedule/rgHolidays", nil]
+                                                                               valueTypes:[NSDictionary dictionaryWithObjectsAndKeys:
+                                                                                           NUM(BKResponseDoubleValue), @"nWorkdayStarts",
+                                                                                           NUM(BKResponseDoubleValue), @"nWorkdayEnds",
+                                                                                           NUM(BKResponseDoubleValue), @"nLunchStarts",
+                                                                                           nil]] autorelease];
+            [d setObject:[common schemaByAddingSchema:schedule] forKey:@"listWorkingSchedule"];
+            
+            // edit actions return the single case that was changed
+            BKResponseSchema *edit = [[[BKResponseSchema alloc] initWithArrayElements:nil scalarElements:[NSArray arrayWithObject:@"response/case"] valueTypes:nil] autorelease];
+            edit = [common schemaByAddingSchema:edit];
+            
+            for (NSString *action in [NSArray arrayWithObjects:@"new", @"edit", @"assign", @"reactivate", @"reopen", @"resolve", @"close", @"email", @"reply", @"forward", nil]) {
+                [d setObject:edit forKey:action];
+            }
+            #undef NUM
+            
+            schemaDictionary = [d copy];
+        }
+    }
+    
+    return schemaDictionary;
+}
+
+- (void)setKind:(BKResponseElementKind)inKind forElement:(NSString *)inElementName
+{
+    NSRange slash = [inElementName rangeOfString:@"/"];
+    if (slash.location != NSNotFound) {
+        NSString *parent = [inElementName substringToIndex:slash.location];
+        NSString *child = [inElementName substringFromIndex:NSMaxRange(slash)];
+        
+        CFMutableDictionaryRef children = (CFMutableDictionaryRef)CFDictionaryGetValue(pathRules, (CFStringRef)parent);
+        if (!children) {
+            children = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+            CFDictionarySetValue(pathRules, (CFStringRef)parent, children);
+            CFRelease(children);
+        }
+        
+        CFDictionarySetValue(children, (CFStringRef)child, BKRuleMake(inKind, BKResponseInferredValue));
+        return;
+    }
+    
+    const void *rule = CFDictionaryGetValue(elementRules, (CFStringRef)inElementName);
+    CFDictionarySetValue(elementRules, (CFStringRef)inElementName, BKRuleMake(inKind, BKRuleValueType(rule)));
+}
+
+- (void)setValueType:(BKResponseValueType)inType forElement:(NSString *)inElementName
+{
+    const void *rule = CFDictionaryGetValue(elementRules, (CFStringRef)inElementName);
+    CFDictionarySetValue(elementRules, (CFStringRef)inElementName, BKRuleMake(BKRuleKind(rule), inType));
+}
+@end
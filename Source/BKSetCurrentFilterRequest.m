@@ -47,7 +47,7 @@
 		
 		// TODO: Check if API keeps the name
 		// TODO: Ask if there's a way to set the sFilter to none
-		requestParameterDict = [[NSDictionary dictionaryWithObjectsAndKeys:@"setCurrentFilter", @"cmd", inAPIContext.authToken, @"token", ([inFilterName length] ? inFilterName : @"inbox"), @"sFilter", nil] retain];
+		requestParameterDict = [[NSDictionary dictionaryWithObjectsAndKeys:@"setCurrentFilter", @"cmd", ([inFilterName length] ? inFilterName : @"inbox"), @"sFilter", nil] retain];
 	}
 	
 	return self;	
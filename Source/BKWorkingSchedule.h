@@ -0,0 +1,99 @@
+//
+// BKWorkingSchedule.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+// A working schedule compiled for arithmetic: how much working time lies between two instants, and when a given
+// amount of working time from an instant runs out. Both take O(log n) in the number of holidays, whatever the
+// distance between the instants, so they're cheap enough to run over every case of a large filter.
+//
+// The model is built from the dictionary BKListWorkingScheduleRequest fetches: the workday runs from nWorkdayStarts
+// to nWorkdayEnds (hours, may be fractional), less the lunch break if fHasLunch, on the days rgWorkdays marks
+// (Monday to Friday if the response doesn't say), and not at all on the days each rgHolidays entry spans from
+// dtHoliday to dtHolidayEnd inclusive. Personal exceptions to the site schedule come back as holidays too, so ask
+// for the schedule of the person you're computing for. The hours are wall clock hours in the given time zone;
+// holidays are whole days in it (the dates are taken as sent, in UTC, and then run from local midnight to midnight).
+//
+// Instances are immutable and can be shared between threads.
+@interface BKWorkingSchedule : NSObject
+{
+    NSTimeZone *timeZone;
+    NSInteger fixedOffsetFromGMT;
+    BOOL hasFixedOffset;
+
+    double workdayStartHour;
+    double workdayEndHour;
+    double lunchStartHour;
+    double lunchLength;                 // in hours, 0 if there's no lunch break
+    NSUInteger workdayMask;             // 1 << weekday, Sunday being 0
+
+    // working intervals of a week, in seconds from the start of the week, and the working time before each
+    NSUInteger weekIntervalCount;
+    double weekIntervalStarts[14];
+    double weekIntervalEnds[14];
+    double weekIntervalCumulative[15];
+
+    // merged holidays, in local seconds since 1970, and the working time they take away up to each
+    NSUInteger holidayCount;
+    double *holidayStarts;
+    double *holidayEnds;
+    double *holidayRemoved;
+}
++ (id)scheduleWithWorkingSchedule:(NSDictionary *)inWorkingSchedule;
+
+// the designated initializer; inTimeZone is the time zone the schedule's hours are in (the default one if nil)
+- (id)initWithWorkingSchedule:(NSDictionary *)inWorkingSchedule timeZone:(NSTimeZone *)inTimeZone;
+
+// the working time between two instants; negative if inEndDate is before inStartDate
+- (NSTimeInterval)workingTimeFromDate:(NSDate *)inStartDate toDate:(NSDate *)inEndDate;
+
+// the instant at which inHours of working time from inDate have passed. Adding runs to the end of the last working
+// period used (5pm, not 9am the next workday); subtracting runs to the beginning of one. Returns inDate for 0
+// and nil if the schedule has no working time at all.
+- (NSDate *)dateByAddingWorkingHours:(double)inHours toDate:(NSDate *)inDate;
+
+- (BOOL)isWorkingTimeAtDate:(NSDate *)inDate;
+
+// Batch versions of the above, for reports over many cases. The NSArray methods take dates (or NSNull, for a case
+// that hasn't got one, e.g. dtClosed of an open case) and return NSNumbers or dates, with NSNull where an input was
+// NSNull. The C array methods take and return times as intervals since 1970, with NAN for nil.
+- (NSArray *)workingTimesFromDates:(NSArray *)inStartDates toDate:(NSDate *)inEndDate;
+- (NSArray *)workingTimesFromDates:(NSArray *)inStartDates toDates:(NSArray *)inEndDates;
+- (NSArray *)datesByAddingWorkingHours:(NSArray *)inHours toDate:(NSDate *)inDate;
+- (NSArray *)datesByAddingWorkingHours:(NSArray *)inHours toDates:(NSArray *)inDates;
+- (void)getWorkingTimes:(NSTimeInterval *)outTimes fromTimes:(const NSTimeInterval *)inStartTimes toTimes:(const NSTimeInterval *)inEndTimes count:(NSUInteger)inCount;
+- (void)getTimes:(NSTimeInterval *)outTimes byAddingWorkingHours:(const double *)inHours toTimes:(const NSTimeInterval *)inTimes count:(NSUInteger)inCount;
+
+@property (readonly) NSTimeZone *timeZone;
+@property (readonly) double workdayStartHour;
+@property (readonly) double workdayEndHour;
+@property (readonly) double lunchStartHour;
+@property (readonly) double lunchLength;
+@property (readonly) double hoursPerWorkday;
+@property (readonly) double hoursPerWeek;
+@property (readonly) NSUInteger holidayCount;      // after overlapping holidays are merged
+@end
@@ -0,0 +1,532 @@
+//
+// BKWorkingSchedule.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKWorkingSchedule.h"
+#import <time.h>
+
+static const double kDay = 86400.0;
+static const double kWeek = 86400.0 * 7.0;
+
+// local seconds since 1970 count from a Thursday
+static const NSUInteger kWeekdayOfFirstDay = 4;
+
+static NSString *const kWeekdayNames[7] = { @"sunday", @"monday", @"tuesday", @"wednesday", @"thursday", @"friday", @"saturday" };
+
+// the first of the n sorted values that is greater than (or, if inOrEqual, at least) inValue; n if there's none
+static NSUInteger BKWorkingScheduleSearch(const double *inValues, NSUInteger n, double inValue, BOOL inOrEqual)
+{
+    NSUInteger low = 0;
+    NSUInteger high = n;
+    while (low < high) {
+        NSUInteger mid = low + (high - low) / 2;
+        if (inValues[mid] > inValue || (inOrEqual && inValues[mid] == inValue)) {
+            high = mid;
+        }
+        else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+static NSTimeInterval BKWorkingScheduleTimeFromObject(id inObject, BOOL *outValid)
+{
+    if ([inObject isKindOfClass:[NSDate class]]) {
+        *outValid = YES;
+        return [inObject timeIntervalSince1970];
+    }
+    
+    // a holiday may come back as a string if the response wasn't mapped with the schema
+    if ([inObject isKindOfClass:[NSString class]] && [inObject length] >= 10) {
+        struct tm t;
+        bzero(&t, sizeof(t));
+        const char *s = [inObject UTF8String];
+        if (sscanf(s, "%4d-%2d-%2d", &t.tm_year, &t.tm_mon, &t.tm_mday) == 3) {
+            t.tm_year -= 1900;
+            t.tm_mon -= 1;
+            if (strlen(s) >= 19) {
+                sscanf(s + 11, "%2d:%2d:%2d", &t.tm_hour, &t.tm_min, &t.tm_sec);
+            }
+            *outValid = YES;
+            return (NSTimeInterval)timegm(&t);
+        }
+    }
+    
+    *outValid = NO;
+    return 0.0;
+}
+
+static int BKWorkingScheduleCompareHolidays(const void *a, const void *b)
+{
+    double x = ((const double *)a)[0];
+    double y = ((const double *)b)[0];
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// The calendar date inTime falls on in UTC, as days since 1970-01-01. FogBugz sends holiday dates as midnight UTC,
+// so this is the date that was entered, whatever the schedule's time zone is.
+static double BKWorkingScheduleUTCDay(NSTimeInterval inTime)
+{
+    time_t t = (time_t)floor(inTime);
+    struct tm gmt;
+    gmtime_r(&t, &gmt);
+    gmt.tm_hour = 0;
+    gmt.tm_min = 0;
+    gmt.tm_sec = 0;
+    return (double)(timegm(&gmt) / (time_t)kDay);
+}
+
+@interface BKWorkingSchedule (PrivateMethods)
+- (void)compileWeekWithWorkdays:(NSDictionary *)inWorkdays hasLunch:(BOOL)inHasLunch;
+- (void)compileHolidays:(NSArray *)inHolidays;
+- (double)localTimeForTime:(NSTimeInterval)inTime;
+- (NSTimeInterval)timeForLocalTime:(double)inLocalTime;
+- (double)weekWorkingTimeBeforeLocalTime:(double)inLocalTime;
+- (double)weekLocalTimeForWorkingTime:(double)inWorkingTime latest:(BOOL)inLatest;
+- (double)workingTimeBeforeLocalTime:(double)inLocalTime;
+- (double)localTimeForWorkingTime:(double)inWorkingTime latest:(BOOL)inLatest;
+- (NSTimeInterval)workingTimeFromTime:(NSTimeInterval)inStartTime toTime:(NSTimeInterval)inEndTime;
+- (NSTimeInterval)timeByAddingWorkingHours:(double)inHours toTime:(NSTimeInterval)inTime;
+@end
+
+@implementation BKWorkingSchedule
+- (void)dealloc
+{
+    [timeZone release];
+    free(holidayStarts);
+    free(holidayEnds);
+    free(holidayRemoved);
+    [super dealloc];
+}
+
++ (id)scheduleWithWorkingSchedule:(NSDictionary *)inWorkingSchedule
+{
+    return [[[self alloc] initWithWorkingSchedule:inWorkingSchedule timeZone:nil] autorelease];
+}
+
+- (id)init
+{
+    return [self initWithWorkingSchedule:nil timeZone:nil];
+}
+
+- (id)initWithWorkingSchedule:(NSDictionary *)inWorkingSchedule timeZone:(NSTimeZone *)inTimeZone
+{
+    self = [super init];
+    if (self) {
+        timeZone = [(inTimeZone ? inTimeZone : [NSTimeZone defaultTimeZone]) retain];
+        
+        // a zone that has never changed its offset needs no lookups
+        if (![timeZone nextDaylightSavingTimeTransitionAfterDate:[NSDate distantPast]]) {
+            hasFixedOffset = YES;
+            fixedOffsetFromGMT = [timeZone secondsFromGMT];
+        }
+        
+        id value = [inWorkingSchedule objectForKey:@"nWorkdayStarts"];
+        workdayStartHour = value ? MIN(MAX([value doubleValue], 0.0), 24.0) : 9.0;
+        value = [inWorkingSchedule objectForKey:@"nWorkdayEnds"];
+        workdayEndHour = value ? MIN(MAX([value doubleValue], workdayStartHour), 24.0) : MAX(17.0, workdayStartHour);
+        
+        BOOL hasLunch = [[inWorkingSchedule objectForKey:@"fHasLunch"] boolValue];
+        if (hasLunch) {
+            lunchStartHour = MIN(MAX([[inWorkingSchedule objectForKey:@"nLunchStarts"] doubleValue], workdayStartHour), workdayEndHour);
+            lunchLength = MIN(MAX([[inWorkingSchedule objectForKey:@"hrsLunchLength"] doubleValue], 0.0), workdayEndHour - lunchStartHour);
+            hasLunch = (lunchLength > 0.0);
+        }
+        
+        if (!hasLunch) {
+            lunchStartHour = workdayEndHour;
+            lunchLength = 0.0;
+        }
+        
+        value = [inWorkingSchedule objectForKey:@"rgWorkdays"];
+        [self compileWeekWithWorkdays:([value isKindOfClass:[NSDictionary class]] ? value : nil) hasLunch:hasLunch];
+        
+        value = [inWorkingSchedule valueForKeyPath:@"rgHolidays.holiday"];
+        if ([value isKindOfClass:[NSDictionary class]]) {
+            value = [NSArray arrayWithObject:value];
+        }
+        [self compileHolidays:([value isKindOfClass:[NSArray class]] ? value : nil)];
+    }
+    
+    return self;
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p> %.2f-%.2f, lunch %.2f+%.2f, %.2f hours per week, %ju holidays, %@", [self class], self, workdayStartHour, workdayEndHour, lunchStartHour, lunchLength, [self hoursPerWeek], (uintmax_t)holidayCount, [timeZone name]];
+}
+
+- (NSTimeInterval)workingTimeFromDate:(NSDate *)inStartDate toDate:(NSDate *)inEndDate
+{
+    return [self workingTimeFromTime:[inStartDate timeIntervalSince1970] toTime:[inEndDate timeIntervalSince1970]];
+}
+
+- (NSDate *)dateByAddingWorkingHours:(double)inHours toDate:(NSDate *)inDate
+{
+    if (inHours == 0.0 || !inDate) {
+        return inDate;
+    }
+    
+    NSTimeInterval t = [self timeByAddingWorkingHours:inHours toTime:[inDate timeIntervalSince1970]];
+    return isnan(t) ? nil : [NSDate dateWithTimeIntervalSince1970:t];
+}
+
+- (BOOL)isWorkingTimeAtDate:(NSDate *)inDate
+{
+    // working time is being spent at an instant if some of it lies in the second that follows
+    double local = [self localTimeForTime:[inDate timeIntervalSince1970]];
+    return [self workingTimeBeforeLocalTime:local + 1.0] > [self workingTimeBeforeLocalTime:local];
+}
+
+- (NSArray *)workingTimesFromDates:(NSArray *)inStartDates toDate:(NSDate *)inEndDate
+{
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:[inStartDates count]];
+    NSTimeInterval end = [inEndDate timeIntervalSince1970];
+    
+    for (id date in inStartDates) {
+        if ([date isKindOfClass:[NSDate class]]) {
+            [result addObject:[NSNumber numberWithDouble:[self workingTimeFromTime:[date timeIntervalSince1970] toTime:end]]];
+        }
+        else {
+            [result addObject:[NSNull null]];
+        }
+    }
+    
+    return result;
+}
+
+- (NSArray *)workingTimesFromDates:(NSArray *)inStartDates toDates:(NSArray *)inEndDates
+{
+    NSUInteger count = [inStartDates count];
+    NSAssert([inEndDates count] == count, @"Must have as many end dates as start dates");
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:count];
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        id start = [inStartDates objectAtIndex:i];
+        id end = [inEndDates objectAtIndex:i];
+        if ([start isKindOfClass:[NSDate class]] && [end isKindOfClass:[NSDate class]]) {
+            [result addObject:[NSNumber numberWithDouble:[self workingTimeFromTime:[start timeIntervalSince1970] toTime:[end timeIntervalSince1970]]]];
+        }
+        else {
+            [result addObject:[NSNull null]];
+        }
+    }
+    
+    return result;
+}
+
+- (NSArray *)datesByAddingWorkingHours:(NSArray *)inHours toDate:(NSDate *)inDate
+{
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:[inHours count]];
+    
+    for (id hours in inHours) {
+        NSDate *date = [hours isKindOfClass:[NSNumber class]] ? [self dateByAddingWorkingHours:[hours doubleValue] toDate:inDate] : nil;
+        [result addObject:(date ? (id)date : (id)[NSNull null])];
+    }
+    
+    return result;
+}
+
+- (NSArray *)datesByAddingWorkingHours:(NSArray *)inHours toDates:(NSArray *)inDates
+{
+    NSUInteger count = [inHours count];
+    NSAssert([inDates count] == count, @"Must have as many dates as hour counts");
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:count];
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        id hours = [inHours objectAtIndex:i];
+        id date = [inDates objectAtIndex:i];
+        NSDate *sum = nil;
+        if ([hours isKindOfClass:[NSNumber class]] && [date isKindOfClass:[NSDate class]]) {
+            sum = [self dateByAddingWorkingHours:[hours doubleValue] toDate:date];
+        }
+        [result addObject:(sum ? (id)sum : (id)[NSNull null])];
+    }
+    
+    return result;
+}
+
+- (void)getWorkingTimes:(NSTimeInterval *)outTimes fromTimes:(const NSTimeInterval *)inStartTimes toTimes:(const NSTimeInterval *)inEndTimes count:(NSUInteger)inCount
+{
+    for (NSUInteger i = 0; i < inCount; i++) {
+        outTimes[i] = [self workingTimeFromTime:inStartTimes[i] toTime:inEndTimes[i]];
+    }
+}
+
+- (void)getTimes:(NSTimeInterval *)outTimes byAddingWorkingHours:(const double *)inHours toTimes:(const NSTimeInterval *)inTimes count:(NSUInteger)inCount
+{
+    for (NSUInteger i = 0; i < inCount; i++) {
+        outTimes[i] = [self timeByAddingWorkingHours:inHours[i] toTime:inTimes[i]];
+    }
+}
+
+- (double)hoursPerWorkday
+{
+    return workdayEndHour - workdayStartHour - lunchLength;
+}
+
+- (double)hoursPerWeek
+{
+    return weekIntervalCumulative[weekIntervalCount] / 3600.0;
+}
+
+@synthesize timeZone;
+@synthesize workdayStartHour;
+@synthesize workdayEndHour;
+@synthesize lunchStartHour;
+@synthesize lunchLength;
+@synthesize holidayCount;
+@end
+
+@implementation BKWorkingSchedule (PrivateMethods)
+- (void)compileWeekWithWorkdays:(NSDictionary *)inWorkdays hasLunch:(BOOL)inHasLunch
+{
+    workdayMask = 0;
+    for (NSUInteger weekday = 0; weekday < 7; weekday++) {
+        id value = [inWorkdays objectForKey:kWeekdayNames[weekday]];
+        if (value ? [value boolValue] : (!inWorkdays && weekday >= 1 && weekday <= 5)) {
+            workdayMask |= (1 << weekday);
+        }
+    }
+    
+    // each workday has one or, with lunch, two working periods
+    weekIntervalCount = 0;
+    weekIntervalCumulative[0] = 0.0;
+    
+    for (NSUInteger day = 0; day < 7; day++) {
+        if (!(workdayMask & (1 << ((day + kWeekdayOfFirstDay) % 7)))) {
+            continue;
+        }
+        
+        double periods[2][2] = {
+            { workdayStartHour, inHasLunch ? lunchStartHour : workdayEndHour },
+            { lunchStartHour + lunchLength, workdayEndHour }
+        };
+        
+        for (NSUInteger p = 0; p < (inHasLunch ? 2 : 1); p++) {
+            if (periods[p][1] <= periods[p][0]) {
+                continue;
+            }
+            
+            NSUInteger i = weekIntervalCount++;
+            weekIntervalStarts[i] = day * kDay + periods[p][0] * 3600.0;
+            weekIntervalEnds[i] = day * kDay + periods[p][1] * 3600.0;
+            weekIntervalCumulative[i + 1] = weekIntervalCumulative[i] + weekIntervalEnds[i] - weekIntervalStarts[i];
+        }
+    }
+}
+
+- (void)compileHolidays:(NSArray *)inHolidays
+{
+    NSUInteger count = [inHolidays count];
+    double *pairs = count ? (double *)calloc(count * 2, sizeof(double)) : NULL;
+    NSUInteger n = 0;
+    
+    for (NSDictionary *holiday in inHolidays) {
+        if (![holiday isKindOfClass:[NSDictionary class]]) {
+            continue;
+        }
+        
+        BOOL valid = NO;
+        NSTimeInterval start = BKWorkingScheduleTimeFromObject([holiday objectForKey:@"dtHoliday"], &valid);
+        if (!valid) {
+            continue;
+        }
+        
+        NSTimeInterval end = BKWorkingScheduleTimeFromObject([holiday objectForKey:@"dtHolidayEnd"], &valid);
+        if (!valid || end < start) {
+            end = start;
+        }
+        
+        // A holiday is a date. Its day number is the same in local seconds, where day * kDay is that date's local
+        // midnight; going through local time instead would move it a day at offsets of 12 hours or more.
+        double firstDay = BKWorkingScheduleUTCDay(start);
+        double lastDay = BKWorkingScheduleUTCDay(end);
+        pairs[n * 2] = firstDay * kDay;
+        pairs[n * 2 + 1] = (lastDay + 1.0) * kDay;
+        n++;
+    }
+    
+    if (n) {
+        qsort(pairs, n, sizeof(double) * 2, BKWorkingScheduleCompareHolidays);
+    }
+    
+    holidayStarts = (double *)calloc(n + 1, sizeof(double));
+    holidayEnds = (double *)calloc(n + 1, sizeof(double));
+    holidayRemoved = (double *)calloc(n + 1, sizeof(double));
+    holidayCount = 0;
+    
+    for (NSUInteger i = 0; i < n; i++) {
+        if (holidayCount && pairs[i * 2] <= holidayEnds[holidayCount - 1]) {
+            holidayEnds[holidayCount - 1] = MAX(holidayEnds[holidayCount - 1], pairs[i * 2 + 1]);
+            continue;
+        }
+        
+        holidayStarts[holidayCount] = pairs[i * 2];
+        holidayEnds[holidayCount] = pairs[i * 2 + 1];
+        holidayCount++;
+    }
+    
+    // holidayRemoved[k] is the working time the holidays before the kth take away
+    for (NSUInteger k = 0; k < holidayCount; k++) {
+        holidayRemoved[k + 1] = holidayRemoved[k] + [self weekWorkingTimeBeforeLocalTime:holidayEnds[k]] - [self weekWorkingTimeBeforeLocalTime:holidayStarts[k]];
+    }
+    
+    free(pairs);
+}
+
+- (double)localTimeForTime:(NSTimeInterval)inTime
+{
+    if (hasFixedOffset) {
+        return inTime + fixedOffsetFromGMT;
+    }
+    
+    return inTime + [timeZone secondsFromGMTForDate:[NSDate dateWithTimeIntervalSince1970:inTime]];
+}
+
+- (NSTimeInterval)timeForLocalTime:(double)inLocalTime
+{
+    if (hasFixedOffset) {
+        return inLocalTime - fixedOffsetFromGMT;
+    }
+    
+    // guess with the offset in effect at the local time read as GMT, then use the offset in effect at the guess
+    NSTimeInterval guess = inLocalTime - [timeZone secondsFromGMTForDate:[NSDate dateWithTimeIntervalSince1970:inLocalTime]];
+    return inLocalTime - [timeZone secondsFromGMTForDate:[NSDate dateWithTimeIntervalSince1970:guess]];
+}
+
+// Working time from local time 0 to inLocalTime, not counting holidays. Negative before 0.
+- (double)weekWorkingTimeBeforeLocalTime:(double)inLocalTime
+{
+    double weeks = floor(inLocalTime / kWeek);
+    double offset = inLocalTime - weeks * kWeek;
+    double result = weeks * weekIntervalCumulative[weekIntervalCount];
+    
+    NSUInteger i = BKWorkingScheduleSearch(weekIntervalStarts, weekIntervalCount, offset, NO);
+    if (i) {
+        i--;
+        result += weekIntervalCumulative[i] + MIN(offset, weekIntervalEnds[i]) - weekIntervalStarts[i];
+    }
+    
+    return result;
+}
+
+// The inverse of the above: the earliest local time by which inWorkingTime is reached or, if inLatest, the latest
+// local time by which it isn't exceeded. The two differ when inWorkingTime falls on the end of a working period.
+- (double)weekLocalTimeForWorkingTime:(double)inWorkingTime latest:(BOOL)inLatest
+{
+    double perWeek = weekIntervalCumulative[weekIntervalCount];
+    double weeks = floor(inWorkingTime / perWeek);
+    double remainder = MIN(MAX(inWorkingTime - weeks * perWeek, 0.0), perWeek);
+    
+    // The earliest time a whole number of weeks is reached is the end of the last period of the week before;
+    // the latest time is the start of the first period of the next week.
+    if (!inLatest && remainder == 0.0) {
+        weeks -= 1.0;
+        remainder = perWeek;
+    }
+    else if (inLatest && remainder == perWeek) {
+        weeks += 1.0;
+        remainder = 0.0;
+    }
+    
+    NSUInteger i = BKWorkingScheduleSearch(weekIntervalCumulative + 1, weekIntervalCount, remainder, !inLatest);
+    if (i >= weekIntervalCount) {
+        i = weekIntervalCount - 1;
+    }
+    
+    return weeks * kWeek + weekIntervalStarts[i] + (remainder - weekIntervalCumulative[i]);
+}
+
+// Working time from local time 0 to inLocalTime with holidays taken out.
+- (double)workingTimeBeforeLocalTime:(double)inLocalTime
+{
+    double result = [self weekWorkingTimeBeforeLocalTime:inLocalTime];
+    
+    NSUInteger k = BKWorkingScheduleSearch(holidayStarts, holidayCount, inLocalTime, NO);
+    if (k) {
+        k--;
+        result -= holidayRemoved[k];
+        if (inLocalTime > holidayStarts[k]) {
+            result -= [self weekWorkingTimeBeforeLocalTime:MIN(inLocalTime, holidayEnds[k])] - [self weekWorkingTimeBeforeLocalTime:holidayStarts[k]];
+        }
+    }
+    
+    return result;
+}
+
+- (double)localTimeForWorkingTime:(double)inWorkingTime latest:(BOOL)inLatest
+{
+    // Between the end of holiday k - 1 and the start of holiday k, working time is the week's less holidayRemoved[k].
+    // Find the first such stretch that reaches inWorkingTime (or, if inLatest, gets past it) by its end.
+    NSUInteger low = 0;
+    NSUInteger high = holidayCount;
+    while (low < high) {
+        NSUInteger mid = low + (high - low) / 2;
+        double reached = [self weekWorkingTimeBeforeLocalTime:holidayStarts[mid]] - holidayRemoved[mid];
+        if (reached > inWorkingTime || (!inLatest && reached == inWorkingTime)) {
+            high = mid;
+        }
+        else {
+            low = mid + 1;
+        }
+    }
+    
+    double result = [self weekLocalTimeForWorkingTime:inWorkingTime + holidayRemoved[low] latest:inLatest];
+    if (low) {
+        result = MAX(result, holidayEnds[low - 1]);
+    }
+    if (low < holidayCount) {
+        result = MIN(result, holidayStarts[low]);
+    }
+    
+    return result;
+}
+
+- (NSTimeInterval)workingTimeFromTime:(NSTimeInterval)inStartTime toTime:(NSTimeInterval)inEndTime
+{
+    if (!weekIntervalCount) {
+        return 0.0;
+    }
+    
+    return [self workingTimeBeforeLocalTime:[self localTimeForTime:inEndTime]] - [self workingTimeBeforeLocalTime:[self localTimeForTime:inStartTime]];
+}
+
+- (NSTimeInterval)timeByAddingWorkingHours:(double)inHours toTime:(NSTimeInterval)inTime
+{
+    if (inHours == 0.0) {
+        return inTime;
+    }
+    
+    if (!weekIntervalCount || isnan(inHours)) {
+        return NAN;
+    }
+    
+    double target = [self workingTimeBeforeLocalTime:[self localTimeForTime:inTime]] + inHours * 3600.0;
+    return [self timeForLocalTime:[self localTimeForWorkingTime:target latest:(inHours < 0.0)]];
+}
+@end
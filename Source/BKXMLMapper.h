@@ -26,22 +26,58 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "BKByteSink.h"
+#import "BKResponseSchema.h"
 
 extern NSString *const BKXMLTextContentKey;
 
 #if MAC_OS_X_VERSION_MIN_REQUIRED > MAC_OS_X_VERSION_10_5
-@interface BKXMLMapper : NSObject <NSXMLParserDelegate>
+@interface BKXMLMapper : NSObject <NSXMLParserDelegate, BKByteSink>
 #else
-@interface BKXMLMapper : NSObject
+@interface BKXMLMapper : NSObject <BKByteSink>
 #endif
 {
     NSMutableDictionary *resultantDictionary;
 	
 	NSMutableArray *elementStack;
+	NSMutableArray *elementNameStack;      // of the open elements, innermost last
 	NSMutableDictionary *currentDictionary;
 	NSString *currentElementName;
+
+    void *incrementalParser;
+    NSMutableData *pendingData;
+
+    BKResponseSchema *responseSchema;
+
+    NSOperation *owningOperation;
+    volatile int32_t cancelled;
+    NSUInteger nodesSinceCheckpoint;
 }
 + (NSDictionary *)dictionaryMappedFromXMLData:(NSData *)inData;
++ (NSDictionary *)dictionaryMappedFromXMLData:(NSData *)inData responseSchema:(BKResponseSchema *)inSchema;
++ (NSDictionary *)dictionaryMappedFromXMLData:(NSData *)inData responseSchema:(BKResponseSchema *)inSchema operation:(NSOperation *)inOperation;    // nil if inOperation is cancelled
+
+// with a schema (see BKRequest's responseSchema), collections and value types are looked up instead of guessed
+- (id)initWithResponseSchema:(BKResponseSchema *)inSchema;
+
+// Large arrays (e.g. cases.case of a big search) are flattened in parallel, with the same row order.
+// Pass NSUIntegerMax to the threshold to turn this off; a concurrency of 0 means one worker per active processor.
++ (void)setParallelFlatteningThreshold:(NSUInteger)inRowCount;
++ (void)setParallelFlatteningConcurrency:(NSUInteger)inWorkerCount;
+
+// Incremental mapping: feed the XML with -appendBytes:length: (see BKByteSink) as it arrives, then call -finishMapping
+// to get the same dictionary +dictionaryMappedFromXMLData: would return, or nil if the XML is malformed.
+// Note that with the default NSXMLParser backend the bytes are still buffered and parsed at the end.
+- (NSDictionary *)finishMapping;
+
+// Cancellation is checked every few hundred elements while parsing and every few dozen rows while flattening. Once
+// cancelled, the mapper stops, releases what it has mapped so far (letting go of the global parsing lock, too),
+// refuses further bytes and returns nil from -finishMapping. -cancel can be called from any thread.
+- (void)cancel;
+
+@property (readonly) BKResponseSchema *responseSchema;
+@property (assign) NSOperation *owningOperation;       // if set, the mapper is cancelled when the operation is
+@property (readonly, getter=isCancelled) BOOL cancelled;
 @end
 
 @interface NSDictionary (BKXMLMapperExtension)
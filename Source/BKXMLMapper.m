@@ -26,6 +26,8 @@
 //
 
 #import "BKXMLMapper.h"
+#import "BKXMLMapper+ProtectedMethods.h"
+#import "BKPrivateUtilities.h"
 
 #define BKXMLMAPPER_USER_NSXMLPARSER
 
@@ -35,12 +37,21 @@
     #import <expat.h>
 #endif
 
+#import <dispatch/dispatch.h>
 #import <libkern/OSAtomic.h>
 #import <time.h>
 
 NSString *const BKXMLMapperExceptionName = @"BKXMLMapperException";
 NSString *const BKXMLTextContentKey = @"_text";
 
+// rows are handed out to the workers in chunks, so that a few slow rows don't hold up the others
+static const NSUInteger kParallelFlatteningChunkSize = 64;
+static NSUInteger BKXMLMapperParallelFlatteningThreshold = 1024;
+static NSUInteger BKXMLMapperParallelFlatteningConcurrency = 0;
+
+// how many parser callbacks go by between two looks at whether the mapper is cancelled
+static const NSUInteger kCancellationCheckInterval = 256;
+
 #ifndef BKXMLMAPPER_USER_NSXMLPARSER
 static void BKXMExpatParserStart(void *inContext, const char *inElement, const char **attributes);
 static void BKXMExpatParserEnd(void *inContext, const char *inElement);
@@ -49,25 +60,105 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 
 @interface BKXMLMapper (Flattener)
 - (NSArray *)flattenedArray:(NSArray *)inArray;
+- (NSArray *)parallelFlattenedArray:(NSArray *)inArray;
 - (id)flattenedDictionary:(NSDictionary *)inDictionary;
 - (id)transformValue:(id)inValue usingTypeInferredFromKey:(NSString *)inKey;
 @end
 
+@interface BKXMLMapper (Cancellation)
+- (BOOL)reachedCancellationCheckpoint:(NSXMLParser *)inParser;
+- (void)discardMappingState;
+@end
+
+static NSDate *BKXMLMapperDateFromString(NSString *inString)
+{
+    struct tm *t = (struct tm *)calloc(1, sizeof(struct tm));
+    time_t gmt = 0;
+
+    // 12345678901234567890
+    // 2011-01-04T10:06:24Z
+    NSUInteger inStringLength = [inString length];
+
+    if (inStringLength >= 10) {
+        t->tm_year = (int)[[inString substringWithRange:NSMakeRange(0, 4)] integerValue] - 1900;
+        t->tm_mon = (int)[[inString substringWithRange:NSMakeRange(5, 2)] integerValue] - 1;
+        t->tm_mday = (int)[[inString substringWithRange:NSMakeRange(8, 2)] integerValue];
+    }
+
+    if (inStringLength >= 16) {
+        t->tm_hour = (int)[[inString substringWithRange:NSMakeRange(11, 2)] integerValue];
+        t->tm_min = (int)[[inString substringWithRange:NSMakeRange(14, 2)] integerValue];
+    }
+
+    if (inStringLength >= 20) {
+        t->tm_sec = (int)[[inString substringWithRange:NSMakeRange(17, 2)] integerValue];
+    }
+
+    gmt = timegm(t);
+    free (t);
+
+    return [[[NSDate alloc] initWithTimeIntervalSince1970:(NSTimeInterval)gmt] autorelease];
+}
+
+static id BKXMLMapperTypedValue(id inValue, BKResponseValueType inType)
+{
+	if (inType == BKResponseStringValue) {
+		// an empty element is mapped to an empty dictionary, but it's still a string
+		return ([inValue isKindOfClass:[NSDictionary class]] && ![inValue count]) ? @"" : inValue;
+	}
+	
+	if (![inValue isKindOfClass:[NSString class]]) {
+		return inValue;
+	}
+	
+	switch (inType) {
+		case BKResponseIntegerValue:
+			return [NSNumber numberWithInteger:[inValue integerValue]];
+		case BKResponseUnsignedIntegerValue:
+			return [NSNumber numberWithUnsignedInteger:[inValue integerValue]];
+		case BKResponseBooleanValue:
+			return [inValue isEqualToString:@"true"] ? (id)kCFBooleanTrue : (id)kCFBooleanFalse;
+		case BKResponseDateValue:
+			return BKXMLMapperDateFromString(inValue);
+		case BKResponseDoubleValue:
+			return [NSNumber numberWithDouble:[inValue doubleValue]];
+		default:
+			return inValue;
+	}
+}
+
 @implementation BKXMLMapper
 - (void)dealloc
 {
+#ifndef BKXMLMAPPER_USER_NSXMLPARSER
+    if (incrementalParser) {
+        XML_ParserFree((XML_Parser)incrementalParser);
+    }
+#endif
+
+    [pendingData release];
+    [responseSchema release];
     [resultantDictionary release];
 	[elementStack release];
+	[elementNameStack release];
 	[currentElementName release];
     [super dealloc];
 }
 
 - (id)init
+{
+    return [self initWithResponseSchema:nil];
+}
+
+- (id)initWithResponseSchema:(BKResponseSchema *)inSchema
 {
     self = [super init];
     if (self) {
         resultantDictionary = [[NSMutableDictionary alloc] init];
         elementStack = [[NSMutableArray alloc] init];
+        elementNameStack = [[NSMutableArray alloc] init];
+        currentDictionary = resultantDictionary;
+        responseSchema = [inSchema retain];
     }
     
     return self;
@@ -78,6 +169,12 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 	currentDictionary = resultantDictionary;
 
 	@synchronized([BKXMLMapper class]) {
+		// we may have waited a while for the lock
+		if ([self isCancelled]) {
+			[self discardMappingState];
+			return;
+		}
+		
 #ifdef BKXMLMAPPER_USER_NSXMLPARSER
 		NSXMLParser *parser = [[NSXMLParser alloc] initWithData:inData];
 		[parser setDelegate:self];
@@ -89,12 +186,106 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 		XML_SetElementHandler(parser, BKXMExpatParserStart, BKXMExpatParserEnd);
 		XML_SetCharacterDataHandler(parser, BKXMExpatParserCharData);
 		XML_SetUserData(parser, self);
+		XML_UseParserAsHandlerArg(parser);
 		XML_Parse(parser, [inData bytes], [inData length], 1);
 		XML_ParserFree(parser);
 #endif
 	}
 }
 
+- (BOOL)appendBytes:(const void *)inBytes length:(NSUInteger)inLength
+{
+    if (!resultantDictionary) {
+        // already failed
+        return NO;
+    }
+    
+    if ([self isCancelled]) {
+        [self discardMappingState];
+        return NO;
+    }
+    
+#ifdef BKXMLMAPPER_USER_NSXMLPARSER
+    // NSXMLParser can't be fed piecemeal (before 10.7), so we have to keep the bytes until -finishMapping
+    if (!pendingData) {
+        pendingData = [[NSMutableData alloc] init];
+    }
+    
+    [pendingData appendBytes:inBytes length:inLength];
+    return YES;
+#else
+    // an expat parser is only used by this mapper, so unlike -runWithData: we don't need the global lock here
+    if (!incrementalParser) {
+        XML_Parser parser = XML_ParserCreate("UTF-8");
+        XML_SetElementHandler(parser, BKXMExpatParserStart, BKXMExpatParserEnd);
+        XML_SetCharacterDataHandler(parser, BKXMExpatParserCharData);
+        XML_SetUserData(parser, self);
+        XML_UseParserAsHandlerArg(parser);
+        incrementalParser = parser;
+    }
+    
+    if (XML_Parse((XML_Parser)incrementalParser, inBytes, (int)inLength, 0) != XML_STATUS_OK) {
+        BKReleaseClean(resultantDictionary);
+        return NO;
+    }
+    
+    return YES;
+#endif
+}
+
+- (NSDictionary *)finishMapping
+{
+    if ([self isCancelled]) {
+        [self discardMappingState];
+    }
+    
+#ifdef BKXMLMAPPER_USER_NSXMLPARSER
+    if (resultantDictionary) {
+        [self runWithData:pendingData ? (NSData *)pendingData : [NSData data]];
+    }
+    
+    BKReleaseClean(pendingData);
+#else
+    if (incrementalParser) {
+        if (resultantDictionary && XML_Parse((XML_Parser)incrementalParser, NULL, 0, 1) != XML_STATUS_OK) {
+            BKReleaseClean(resultantDictionary);
+        }
+        
+        XML_ParserFree((XML_Parser)incrementalParser);
+        incrementalParser = NULL;
+    }
+#endif
+    
+    NSDictionary *result = resultantDictionary ? [self flattenedDictionary:resultantDictionary] : nil;
+    
+    // whatever was flattened before the cancellation is incomplete
+    if ([self isCancelled]) {
+        [self discardMappingState];
+        return nil;
+    }
+    
+    return result;
+}
+
+- (void)cancel
+{
+    OSAtomicCompareAndSwap32Barrier(0, 1, &cancelled);
+}
+
+- (BOOL)isCancelled
+{
+    if (cancelled) {
+        return YES;
+    }
+    
+    if ([owningOperation isCancelled]) {
+        [self cancel];
+        return YES;
+    }
+    
+    return NO;
+}
+
 - (NSMutableDictionary *)resultantDictionary
 {
 	return [[resultantDictionary retain] autorelease];
@@ -105,6 +296,11 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 	// exceptions: s (returned directly), dt (date), hrs (NSTimeInterval), c (integer)
 	// only two exceptions: s (returned directly), dt (date)
 	
+	BKResponseValueType schemaType = responseSchema ? [responseSchema valueTypeOfElement:inKey] : BKResponseInferredValue;
+	if (schemaType != BKResponseInferredValue) {
+		return BKXMLMapperTypedValue(inValue, schemaType);
+	}
+	
 	NSUInteger length = [inKey length];
 	
 	if (length < 2) {
@@ -162,32 +358,7 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 	if (firstChar == 'd' && secondChar == 't' && thirdCharIsUpperCase) {
 		NSAssert([inValue isKindOfClass:[NSString class]], @"must be string");
         
-        struct tm *t = (struct tm *)calloc(1, sizeof(struct tm));
-        time_t gmt = 0;
-        
-        // 12345678901234567890
-        // 2011-01-04T10:06:24Z
-        NSUInteger inValueLength = [inValue length];
-        
-        if (inValueLength >= 10) {
-            t->tm_year = (int)[[inValue substringWithRange:NSMakeRange(0, 4)] integerValue] - 1900;
-            t->tm_mon = (int)[[inValue substringWithRange:NSMakeRange(5, 2)] integerValue] - 1;
-            t->tm_mday = (int)[[inValue substringWithRange:NSMakeRange(8, 2)] integerValue];            
-        }
-        
-        if (inValueLength >= 16) {
-            t->tm_hour = (int)[[inValue substringWithRange:NSMakeRange(11, 2)] integerValue];
-            t->tm_min = (int)[[inValue substringWithRange:NSMakeRange(14, 2)] integerValue];            
-        }
-		
-		if (inValueLength >= 20) {
-			t->tm_sec = (int)[[inValue substringWithRange:NSMakeRange(17, 2)] integerValue];        
-		}
-		
-        gmt = timegm(t);        
-        free (t);
-        
-		return [[[NSDate alloc] initWithTimeIntervalSince1970:(NSTimeInterval)gmt] autorelease];
+		return BKXMLMapperDateFromString(inValue);
 	}
 	
 	// transform 'hrs'
@@ -198,11 +369,78 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 	return inValue;
 }
 
++ (void)setParallelFlatteningThreshold:(NSUInteger)inRowCount
+{
+	BKXMLMapperParallelFlatteningThreshold = inRowCount;
+}
+
++ (void)setParallelFlatteningConcurrency:(NSUInteger)inWorkerCount
+{
+	BKXMLMapperParallelFlatteningConcurrency = inWorkerCount;
+}
+
+- (NSArray *)parallelFlattenedArray:(NSArray *)inArray
+{
+	NSUInteger count = [inArray count];
+	NSUInteger chunkCount = (count + kParallelFlatteningChunkSize - 1) / kParallelFlatteningChunkSize;
+	NSUInteger workerCount = BKXMLMapperParallelFlatteningConcurrency ? BKXMLMapperParallelFlatteningConcurrency : [[NSProcessInfo processInfo] activeProcessorCount];
+	
+	if (workerCount > chunkCount) {
+		workerCount = chunkCount;
+	}
+	
+	id *values = (id *)calloc(count, sizeof(id));
+	id *results = (id *)calloc(count, sizeof(id));
+	[inArray getObjects:values range:NSMakeRange(0, count)];
+	
+	// each worker keeps taking the next chunk until there's none left; results[i] always corresponds to values[i]
+	__block int32_t nextChunk = -1;
+	
+	dispatch_apply(workerCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t worker) {
+		int32_t chunk;
+		while ((chunk = OSAtomicIncrement32(&nextChunk)) < (int32_t)chunkCount) {
+			if ([self isCancelled]) {
+				break;
+			}
+			
+			NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+			
+			NSUInteger end = MIN(((NSUInteger)chunk + 1) * kParallelFlatteningChunkSize, count);
+			for (NSUInteger i = (NSUInteger)chunk * kParallelFlatteningChunkSize; i < end; i++) {
+				id value = values[i];
+				results[i] = [([value isKindOfClass:[NSDictionary class]] ? [self flattenedDictionary:value] : value) retain];
+			}
+			
+			[pool drain];
+		}
+	});
+	
+	// the chunks not taken left holes in the results
+	NSMutableArray *flattenedArray = [self isCancelled] ? nil : [NSMutableArray arrayWithObjects:results count:count];
+	
+	for (NSUInteger i = 0; i < count; i++) {
+		[results[i] release];
+	}
+	
+	free(results);
+	free(values);
+	return flattenedArray;
+}
+
 - (NSArray *)flattenedArray:(NSArray *)inArray
 {
+	if ([inArray count] >= BKXMLMapperParallelFlatteningThreshold && [inArray count] > kParallelFlatteningChunkSize) {
+		return [self parallelFlattenedArray:inArray];
+	}
+	
 	NSMutableArray *flattenedArray = [NSMutableArray array];
+	NSUInteger row = 0;
 	
 	for (id value in inArray) {
+		if ((++row % kParallelFlatteningChunkSize) == 0 && [self isCancelled]) {
+			return nil;
+		}
+		
 		if ([value isKindOfClass:[NSDictionary class]]) {
 			[flattenedArray addObject:[self flattenedDictionary:value]];
 		}
@@ -255,12 +493,27 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 
 + (NSDictionary *)dictionaryMappedFromXMLData:(NSData *)inData
 {
-    BKXMLMapper *mapper = [[BKXMLMapper alloc] init];
+    return [self dictionaryMappedFromXMLData:inData responseSchema:nil];
+}
+
++ (NSDictionary *)dictionaryMappedFromXMLData:(NSData *)inData responseSchema:(BKResponseSchema *)inSchema
+{
+    return [self dictionaryMappedFromXMLData:inData responseSchema:inSchema operation:nil];
+}
+
++ (NSDictionary *)dictionaryMappedFromXMLData:(NSData *)inData responseSchema:(BKResponseSchema *)inSchema operation:(NSOperation *)inOperation
+{
+    BKXMLMapper *mapper = [[BKXMLMapper alloc] initWithResponseSchema:inSchema];
+    mapper.owningOperation = inOperation;
     [mapper runWithData:inData];        
     
     // flattens the text contents	
     NSMutableDictionary *resultantDictionary = [mapper resultantDictionary];	
     NSDictionary *result = [mapper flattenedDictionary:resultantDictionary];
+    if ([mapper isCancelled]) {
+        result = nil;
+    }
+    
     [mapper release];
     mapper = nil;
     return result;
@@ -268,11 +521,42 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 
 - (void)parser:(NSXMLParser *)parser didStartElement:(NSString *)elementName namespaceURI:(NSString *)namespaceURI qualifiedName:(NSString *)qName attributes:(NSDictionary *)attributeDict
 {
+	// the expat callbacks pass no parser and check for themselves
+	if (parser && [self reachedCancellationCheckpoint:parser]) {
+		return;
+	}
+	
 	NSMutableDictionary *mutableAttrDict = attributeDict ? [NSMutableDictionary dictionaryWithDictionary:attributeDict] : [NSMutableDictionary dictionary];
 
-	// see if it's duplicated
-	id element;
-	if ((element = [currentDictionary objectForKey:elementName])) {
+	id element = [currentDictionary objectForKey:elementName];
+
+	// elements known to the schema take a lookup or two; only the unknown ones go through the heuristics below
+	// (currentElementName is the element last started, not necessarily the parent)
+	NSString *parentName = [elementNameStack lastObject];
+	BKResponseElementKind kind = responseSchema ? [responseSchema kindOfElement:elementName parent:parentName] : BKResponseUnknownElement;
+	
+	if (kind == BKResponseArrayElement) {
+		if (!element) {
+			[currentDictionary setObject:[NSMutableArray arrayWithObject:mutableAttrDict] forKey:elementName];
+		}
+		else if ([element isKindOfClass:[NSMutableArray class]]) {
+			[element addObject:mutableAttrDict];
+		}
+		else {
+			// e.g. an attribute of the same name; ignored just like below
+		}
+	}
+	else if (kind == BKResponseScalarElement) {
+		if (!element) {
+			[currentDictionary setObject:mutableAttrDict forKey:elementName];
+		}
+		else {
+			// the first one wins, as with the FogBugz 8.0 beta <c> bug below; anything else means the schema is wrong
+			NSAssert2([elementName isEqualToString:@"c"], @"The schema says <%@> occurs once in <%@>", elementName, parentName);
+		}
+	}
+	else if (element) {
+		// it's duplicated
 		if (![element isKindOfClass:[NSMutableArray class]]) {
 			// FogBugz 8.0 beta bug
 			if ([elementName isEqualToString:@"c"]) {
@@ -326,6 +610,7 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 	}
 	
 	[elementStack insertObject:currentDictionary atIndex:0];
+	[elementNameStack addObject:elementName];
 	currentDictionary = mutableAttrDict;
 	
 	NSString *tmp = currentElementName;
@@ -335,16 +620,25 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 
 - (void)parser:(NSXMLParser *)parser didEndElement:(NSString *)elementName namespaceURI:(NSString *)namespaceURI qualifiedName:(NSString *)qName
 {
+	if (parser && [self reachedCancellationCheckpoint:parser]) {
+		return;
+	}
+	
 	if (![elementStack count]) {
 		@throw [NSException exceptionWithName:BKXMLMapperExceptionName reason:@"Unbalanced XML element tag closing" userInfo:nil];
 	}
 	
 	currentDictionary = [elementStack objectAtIndex:0];
 	[elementStack removeObjectAtIndex:0];
+	[elementNameStack removeLastObject];
 }
 
 - (void)parser:(NSXMLParser *)parser foundCharacters:(NSString *)string
 {
+	if (parser && [self reachedCancellationCheckpoint:parser]) {
+		return;
+	}
+	
 	NSString *existingContent = [currentDictionary objectForKey:BKXMLTextContentKey];
 	if (existingContent) {
 		NSString *newContent = [existingContent stringByAppendingString:string];
@@ -360,6 +654,43 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 	[resultantDictionary release];
 	resultantDictionary = nil;
 }
+
+@synthesize responseSchema;
+@synthesize owningOperation;
+@end
+
+@implementation BKXMLMapper (Cancellation)
+- (BOOL)reachedCancellationCheckpoint:(NSXMLParser *)inParser
+{
+	if (!resultantDictionary) {
+		return YES;
+	}
+	
+	if (++nodesSinceCheckpoint < kCancellationCheckInterval) {
+		return NO;
+	}
+	
+	nodesSinceCheckpoint = 0;
+	
+	if (![self isCancelled]) {
+		return NO;
+	}
+	
+	// with expat, the callbacks stop the parser themselves
+	[inParser abortParsing];
+	[self discardMappingState];
+	return YES;
+}
+
+- (void)discardMappingState
+{
+	currentDictionary = nil;
+	[elementStack removeAllObjects];
+	[elementNameStack removeAllObjects];
+	BKReleaseClean(currentElementName);
+	BKReleaseClean(resultantDictionary);
+	BKReleaseClean(pendingData);
+}
 @end
 
 @implementation NSDictionary (BKXMLMapperExtension)
@@ -381,9 +712,15 @@ static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, i
 
 #ifndef BKXMLMAPPER_USER_NSXMLPARSER
 
+// the parser is the handler argument (see XML_UseParserAsHandlerArg), so that a cancelled mapper can stop it
 static void BKXMExpatParserStart(void *inContext, const char *inElement, const char **attributes)
 {
-    BKXMLMapper *mapper = (BKXMLMapper *)inContext;
+    BKXMLMapper *mapper = (BKXMLMapper *)XML_GetUserData((XML_Parser)inContext);
+    if ([mapper reachedCancellationCheckpoint:nil]) {
+        XML_StopParser((XML_Parser)inContext, XML_FALSE);
+        return;
+    }
+    
     NSString *elementName = [NSString stringWithUTF8String:inElement];
     NSMutableDictionary *attrDict = [NSMutableDictionary dictionary];
     
@@ -399,14 +736,23 @@ static void BKXMExpatParserStart(void *inContext, const char *inElement, const c
 
 static void BKXMExpatParserEnd(void *inContext, const char *inElement)
 {
-    BKXMLMapper *mapper = (BKXMLMapper *)inContext;
+    BKXMLMapper *mapper = (BKXMLMapper *)XML_GetUserData((XML_Parser)inContext);
+    if ([mapper reachedCancellationCheckpoint:nil]) {
+        XML_StopParser((XML_Parser)inContext, XML_FALSE);
+        return;
+    }
+    
     NSString *elementName = [NSString stringWithUTF8String:inElement];
     [mapper parser:nil didEndElement:elementName namespaceURI:nil qualifiedName:nil];
 }
 
 static void BKXMExpatParserCharData(void *inContext, const XML_Char *inString, int inLength)
 {
-    BKXMLMapper *mapper = (BKXMLMapper *)inContext;
+    BKXMLMapper *mapper = (BKXMLMapper *)XML_GetUserData((XML_Parser)inContext);
+    if ([mapper reachedCancellationCheckpoint:nil]) {
+        XML_StopParser((XML_Parser)inContext, XML_FALSE);
+        return;
+    }
     
     NSString *s = [[[NSString alloc] initWithBytes:inString length:inLength encoding:NSUTF8StringEncoding] autorelease];    
     [mapper parser:nil foundCharacters:s];
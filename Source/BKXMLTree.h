@@ -0,0 +1,88 @@
+//
+// BKXMLTree.h
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+@class BKXMLElement;
+
+// BKXMLDocument is a lighter alternative to BKXMLMapper for large responses.
+// Elements, attributes and text are copied into a per-document arena (a few
+// large memory blocks), and the whole tree is freed at once when the document
+// is deallocated. Objective-C objects are only created for the nodes you
+// actually access; use -[BKXMLElement XMLMappedObject] to get the usual
+// BKXMLMapper-style NSDictionary for a subtree, e.g. one case at a time.
+// Parsing goes through the same parser and global lock as BKXMLMapper, so it
+// takes about as long, but the parser's temporary strings are released every
+// few hundred callbacks instead of at the end of the parse, which keeps the
+// peak memory close to the arena size; see "TrafficReplay tree".
+
+#if MAC_OS_X_VERSION_MIN_REQUIRED > MAC_OS_X_VERSION_10_5
+@interface BKXMLDocument : NSObject <NSXMLParserDelegate>
+#else
+@interface BKXMLDocument : NSObject
+#endif
+{
+    void *arena;
+    void *rootNode;
+    void *builder;
+    NSAutoreleasePool *callbackPool;
+    NSUInteger callbacksSinceDrain;
+}
++ (BKXMLDocument *)documentWithXMLData:(NSData *)inData;
+- (id)initWithXMLData:(NSData *)inData;
+
+// the top-level element (e.g. <response>)
+@property (readonly) BKXMLElement *rootElement;
+
+// total bytes held by the arena, for diagnostics
+@property (readonly) NSUInteger allocatedBytes;
+@end
+
+@interface BKXMLElement : NSObject
+{
+    BKXMLDocument *document;
+    void *node;
+}
+- (NSString *)attributeForName:(NSString *)inName;
+- (BKXMLElement *)firstChildNamed:(NSString *)inName;
+- (NSArray *)childrenNamed:(NSString *)inName;
+
+// inKeyPath is dot-separated, e.g. @"cases.case"; intermediate components match the first child of that name,
+// and -elementsAtKeyPath: returns all the children matching the last component
+- (BKXMLElement *)elementAtKeyPath:(NSString *)inKeyPath;
+- (NSArray *)elementsAtKeyPath:(NSString *)inKeyPath;
+
+// the same object BKXMLMapper would produce for this element (NSDictionary, NSString, NSNumber, etc.), or nil if empty
+- (id)XMLMappedObject;
+
+@property (readonly) NSString *name;
+@property (readonly) NSString *textContent;
+@property (readonly) NSDictionary *attributes;
+@property (readonly) NSUInteger childCount;
+@property (readonly) NSArray *children;
+@property (readonly) BKXMLDocument *document;
+@end
@@ -0,0 +1,717 @@
+//
+// BKXMLTree.m
+//
+// Copyright (c) 2009-2011 Lukhnos D. Liu (http://lukhnos.org)
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+
+#import "BKXMLTree.h"
+#import "BKXMLMapper.h"
+#import "BKXMLMapper+ProtectedMethods.h"
+
+#define BKXMLTREE_USE_NSXMLPARSER
+
+#ifndef BKXMLTREE_USE_NSXMLPARSER
+    // see BKXMLMapper.m
+    #define XMLCALL
+    #import <expat.h>
+#endif
+
+// most responses fit in a handful of blocks; anything larger than a quarter block gets its own
+static const size_t kArenaBlockSize = 64 * 1024;
+static const size_t kInitialInternTableCapacity = 256;
+
+// how many NSXMLParser callbacks share one autorelease pool; each callback leaves a few short strings behind
+static const NSUInteger kCallbacksPerPool = 256;
+
+typedef struct BKXMLArenaBlock {
+    struct BKXMLArenaBlock *next;
+    size_t size;
+    size_t used;
+    char bytes[];
+} BKXMLArenaBlock;
+
+typedef struct {
+    BKXMLArenaBlock *head;
+    size_t totalBytes;
+} BKXMLArena;
+
+typedef struct BKXMLAttribute {
+    const char *name;
+    const char *value;
+    struct BKXMLAttribute *next;
+} BKXMLAttribute;
+
+typedef struct BKXMLTextSpan {
+    const char *bytes;
+    size_t length;
+    struct BKXMLTextSpan *next;
+} BKXMLTextSpan;
+
+typedef struct BKXMLNode {
+    const char *name;
+    BKXMLAttribute *firstAttribute;
+    BKXMLAttribute *lastAttribute;
+    BKXMLTextSpan *firstTextSpan;
+    BKXMLTextSpan *lastTextSpan;
+    size_t textLength;
+    struct BKXMLNode *parent;
+    struct BKXMLNode *firstChild;
+    struct BKXMLNode *lastChild;
+    struct BKXMLNode *nextSibling;
+    NSUInteger childCount;
+} BKXMLNode;
+
+typedef struct {
+    BKXMLArena *arena;
+    BKXMLNode *current;
+    const char **internTable;
+    size_t internCapacity;
+    size_t internCount;
+    BOOL failed;
+} BKXMLTreeBuilder;
+
+#pragma mark Arena
+
+static void *BKXMLArenaAllocate(BKXMLArena *inArena, size_t inSize, size_t inAlignment)
+{
+    size_t mask = inAlignment - 1;
+    
+    if (inSize + mask > kArenaBlockSize / 4) {
+        BKXMLArenaBlock *dedicated = (BKXMLArenaBlock *)malloc(sizeof(BKXMLArenaBlock) + inSize + mask);
+        if (!dedicated) {
+            return NULL;
+        }
+        
+        dedicated->size = inSize + mask;
+        dedicated->used = dedicated->size;
+        
+        // keep the current head so that small allocations continue to use it
+        if (inArena->head) {
+            dedicated->next = inArena->head->next;
+            inArena->head->next = dedicated;
+        }
+        else {
+            dedicated->next = NULL;
+            inArena->head = dedicated;
+        }
+        
+        inArena->totalBytes += dedicated->size;
+        return (void *)(((uintptr_t)dedicated->bytes + mask) & ~(uintptr_t)mask);
+    }
+    
+    BKXMLArenaBlock *block = inArena->head;
+    size_t padding = block ? ((inAlignment - ((uintptr_t)(block->bytes + block->used) & mask)) & mask) : 0;
+    
+    if (!block || block->size - block->used < inSize + padding) {
+        block = (BKXMLArenaBlock *)malloc(sizeof(BKXMLArenaBlock) + kArenaBlockSize);
+        if (!block) {
+            return NULL;
+        }
+        
+        block->size = kArenaBlockSize;
+        block->used = 0;
+        block->next = inArena->head;
+        inArena->head = block;
+        inArena->totalBytes += block->size;
+        padding = (inAlignment - ((uintptr_t)block->bytes & mask)) & mask;
+    }
+    
+    void *result = block->bytes + block->used + padding;
+    block->used += padding + inSize;
+    return result;
+}
+
+static void BKXMLArenaFree(BKXMLArena *inArena)
+{
+    BKXMLArenaBlock *block = inArena->head;
+    while (block) {
+        BKXMLArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    
+    free(inArena);
+}
+
+#pragma mark Tree builder
+
+static uint32_t BKXMLHashBytes(const char *inBytes, size_t inLength)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < inLength; i++) {
+        hash ^= (uint8_t)inBytes[i];
+        hash *= 16777619U;
+    }
+    
+    return hash;
+}
+
+static BOOL BKXMLTreeBuilderGrowInternTable(BKXMLTreeBuilder *inBuilder)
+{
+    size_t newCapacity = inBuilder->internCapacity * 2;
+    const char **newTable = (const char **)calloc(newCapacity, sizeof(const char *));
+    if (!newTable) {
+        return NO;
+    }
+    
+    for (size_t i = 0; i < inBuilder->internCapacity; i++) {
+        const char *s = inBuilder->internTable[i];
+        if (s) {
+            size_t index = BKXMLHashBytes(s, strlen(s)) & (newCapacity - 1);
+            while (newTable[index]) {
+                index = (index + 1) & (newCapacity - 1);
+            }
+            newTable[index] = s;
+        }
+    }
+    
+    free(inBuilder->internTable);
+    inBuilder->internTable = newTable;
+    inBuilder->internCapacity = newCapacity;
+    return YES;
+}
+
+// element and attribute names repeat for every row, so we only keep one copy of each
+static const char *BKXMLTreeBuilderIntern(BKXMLTreeBuilder *inBuilder, const char *inBytes, size_t inLength)
+{
+    if (inBuilder->internCount * 2 >= inBuilder->internCapacity && !BKXMLTreeBuilderGrowInternTable(inBuilder)) {
+        return NULL;
+    }
+    
+    size_t mask = inBuilder->internCapacity - 1;
+    size_t index = BKXMLHashBytes(inBytes, inLength) & mask;
+    const char *s;
+    
+    while ((s = inBuilder->internTable[index])) {
+        if (!strncmp(s, inBytes, inLength) && s[inLength] == '\0') {
+            return s;
+        }
+        
+        index = (index + 1) & mask;
+    }
+    
+    char *copy = (char *)BKXMLArenaAllocate(inBuilder->arena, inLength + 1, 1);
+    if (!copy) {
+        return NULL;
+    }
+    
+    memcpy(copy, inBytes, inLength);
+    copy[inLength] = '\0';
+    
+    inBuilder->internTable[index] = copy;
+    inBuilder->internCount++;
+    return copy;
+}
+
+static char *BKXMLTreeBuilderCopyString(BKXMLTreeBuilder *inBuilder, const char *inBytes, size_t inLength)
+{
+    char *copy = (char *)BKXMLArenaAllocate(inBuilder->arena, inLength + 1, 1);
+    if (copy) {
+        memcpy(copy, inBytes, inLength);
+        copy[inLength] = '\0';
+    }
+    
+    return copy;
+}
+
+static BKXMLNode *BKXMLTreeBuilderCreateNode(BKXMLTreeBuilder *inBuilder, const char *inName, size_t inNameLength)
+{
+    BKXMLNode *node = (BKXMLNode *)BKXMLArenaAllocate(inBuilder->arena, sizeof(BKXMLNode), sizeof(void *));
+    const char *name = BKXMLTreeBuilderIntern(inBuilder, inName, inNameLength);
+    
+    if (!node || !name) {
+        inBuilder->failed = YES;
+        return NULL;
+    }
+    
+    memset(node, 0, sizeof(BKXMLNode));
+    node->name = name;
+    return node;
+}
+
+static BKXMLNode *BKXMLTreeBuilderStartElement(BKXMLTreeBuilder *inBuilder, const char *inName, size_t inNameLength)
+{
+    BKXMLNode *node = BKXMLTreeBuilderCreateNode(inBuilder, inName, inNameLength);
+    if (!node) {
+        return NULL;
+    }
+    
+    BKXMLNode *parent = inBuilder->current;
+    node->parent = parent;
+    
+    if (parent->lastChild) {
+        parent->lastChild->nextSibling = node;
+    }
+    else {
+        parent->firstChild = node;
+    }
+    
+    parent->lastChild = node;
+    parent->childCount++;
+    
+    inBuilder->current = node;
+    return node;
+}
+
+static BOOL BKXMLTreeBuilderAddAttribute(BKXMLTreeBuilder *inBuilder, BKXMLNode *inNode, const char *inName, const char *inValue)
+{
+    BKXMLAttribute *attribute = (BKXMLAttribute *)BKXMLArenaAllocate(inBuilder->arena, sizeof(BKXMLAttribute), sizeof(void *));
+    const char *name = BKXMLTreeBuilderIntern(inBuilder, inName, strlen(inName));
+    const char *value = BKXMLTreeBuilderCopyString(inBuilder, inValue, strlen(inValue));
+    
+    if (!attribute || !name || !value) {
+        inBuilder->failed = YES;
+        return NO;
+    }
+    
+    attribute->name = name;
+    attribute->value = value;
+    attribute->next = NULL;
+    
+    if (inNode->lastAttribute) {
+        inNode->lastAttribute->next = attribute;
+    }
+    else {
+        inNode->firstAttribute = attribute;
+    }
+    
+    inNode->lastAttribute = attribute;
+    return YES;
+}
+
+static void BKXMLTreeBuilderEndElement(BKXMLTreeBuilder *inBuilder)
+{
+    if (inBuilder->current->parent) {
+        inBuilder->current = inBuilder->current->parent;
+    }
+}
+
+static BOOL BKXMLTreeBuilderAppendText(BKXMLTreeBuilder *inBuilder, const char *inBytes, size_t inLength)
+{
+    if (!inLength) {
+        return YES;
+    }
+    
+    BKXMLTextSpan *span = (BKXMLTextSpan *)BKXMLArenaAllocate(inBuilder->arena, sizeof(BKXMLTextSpan), sizeof(void *));
+    char *bytes = BKXMLTreeBuilderCopyString(inBuilder, inBytes, inLength);
+    
+    if (!span || !bytes) {
+        inBuilder->failed = YES;
+        return NO;
+    }
+    
+    span->bytes = bytes;
+    span->length = inLength;
+    span->next = NULL;
+    
+    BKXMLNode *node = inBuilder->current;
+    if (node->lastTextSpan) {
+        node->lastTextSpan->next = span;
+    }
+    else {
+        node->firstTextSpan = span;
+    }
+    
+    node->lastTextSpan = span;
+    node->textLength += inLength;
+    return YES;
+}
+
+#ifndef BKXMLTREE_USE_NSXMLPARSER
+static void BKXMLTreeExpatStart(void *inContext, const char *inElement, const char **inAttributes)
+{
+    BKXMLTreeBuilder *builder = (BKXMLTreeBuilder *)inContext;
+    BKXMLNode *node = BKXMLTreeBuilderStartElement(builder, inElement, strlen(inElement));
+    if (!node) {
+        return;
+    }
+    
+    const char **attr = inAttributes;
+    while (*attr) {
+        const char *key = *attr++;
+        const char *value = *attr++;
+        BKXMLTreeBuilderAddAttribute(builder, node, key, value);
+    }
+}
+
+static void BKXMLTreeExpatEnd(void *inContext, const char *inElement)
+{
+    BKXMLTreeBuilderEndElement((BKXMLTreeBuilder *)inContext);
+}
+
+static void BKXMLTreeExpatCharData(void *inContext, const XML_Char *inString, int inLength)
+{
+    BKXMLTreeBuilderAppendText((BKXMLTreeBuilder *)inContext, inString, (size_t)inLength);
+}
+#endif
+
+#pragma mark Node helpers
+
+static NSString *BKXMLNodeCopyTextContent(BKXMLNode *inNode)
+{
+    BKXMLTextSpan *span = inNode->firstTextSpan;
+    if (!span) {
+        return nil;
+    }
+    
+    if (!span->next) {
+        return [[NSString alloc] initWithBytes:span->bytes length:span->length encoding:NSUTF8StringEncoding];
+    }
+    
+    char *buffer = (char *)malloc(inNode->textLength);
+    if (!buffer) {
+        return nil;
+    }
+    
+    size_t offset = 0;
+    for ( ; span ; span = span->next) {
+        memcpy(buffer + offset, span->bytes, span->length);
+        offset += span->length;
+    }
+    
+    return [[NSString alloc] initWithBytesNoCopy:buffer length:offset encoding:NSUTF8StringEncoding freeWhenDone:YES];
+}
+
+static NSMutableDictionary *BKXMLNodeAttributeDictionary(BKXMLNode *inNode)
+{
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    for (BKXMLAttribute *attr = inNode->firstAttribute ; attr ; attr = attr->next) {
+        [result setObject:[NSString stringWithUTF8String:attr->value] forKey:[NSString stringWithUTF8String:attr->name]];
+    }
+    
+    return result;
+}
+
+static BKXMLNode *BKXMLNodeFirstChildNamed(BKXMLNode *inNode, const char *inName)
+{
+    for (BKXMLNode *child = inNode->firstChild ; child ; child = child->nextSibling) {
+        if (!strcmp(child->name, inName)) {
+            return child;
+        }
+    }
+    
+    return NULL;
+}
+
+// feeds the subtree to a BKXMLMapper as if it came from the parser, so that the mapping rules stay in one place
+static void BKXMLNodeReplay(BKXMLNode *inNode, BKXMLMapper *inMapper)
+{
+    NSString *name = [NSString stringWithUTF8String:inNode->name];
+    [inMapper parser:nil didStartElement:name namespaceURI:nil qualifiedName:nil attributes:BKXMLNodeAttributeDictionary(inNode)];
+    
+    NSString *text = BKXMLNodeCopyTextContent(inNode);
+    if (text) {
+        [inMapper parser:nil foundCharacters:text];
+        [text release];
+    }
+    
+    for (BKXMLNode *child = inNode->firstChild ; child ; child = child->nextSibling) {
+        BKXMLNodeReplay(child, inMapper);
+    }
+    
+    [inMapper parser:nil didEndElement:name namespaceURI:nil qualifiedName:nil];
+}
+
+@interface BKXMLElement (PrivateMethods)
+- (id)initWithDocument:(BKXMLDocument *)inDocument node:(BKXMLNode *)inNode;
+@end
+
+@implementation BKXMLDocument
+- (void)dealloc
+{
+    if (arena) {
+        BKXMLArenaFree((BKXMLArena *)arena);
+        arena = NULL;
+    }
+    
+    [super dealloc];
+}
+
++ (BKXMLDocument *)documentWithXMLData:(NSData *)inData
+{
+    return [[[self alloc] initWithXMLData:inData] autorelease];
+}
+
+- (id)initWithXMLData:(NSData *)inData
+{
+    self = [super init];
+    if (self) {
+        arena = calloc(1, sizeof(BKXMLArena));
+        if (!arena) {
+            [self release];
+            return nil;
+        }
+        
+        BKXMLTreeBuilder treeBuilder;
+        memset(&treeBuilder, 0, sizeof(BKXMLTreeBuilder));
+        treeBuilder.arena = (BKXMLArena *)arena;
+        treeBuilder.internCapacity = kInitialInternTableCapacity;
+        treeBuilder.internTable = (const char **)calloc(treeBuilder.internCapacity, sizeof(const char *));
+        
+        BKXMLNode *root = treeBuilder.internTable ? BKXMLTreeBuilderCreateNode(&treeBuilder, "", 0) : NULL;
+        BOOL success = NO;
+        
+        if (root) {
+            treeBuilder.current = root;
+            builder = &treeBuilder;
+            
+            @synchronized([BKXMLMapper class]) {
+#ifdef BKXMLTREE_USE_NSXMLPARSER
+                // NSXMLParser hands us autoreleased strings; the delegate methods recycle
+                // callbackPool so that they don't live until the end of the parse
+                NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+                NSXMLParser *parser = [[NSXMLParser alloc] initWithData:inData];
+                [parser setDelegate:self];
+                callbackPool = [[NSAutoreleasePool alloc] init];
+                callbacksSinceDrain = 0;
+                success = [parser parse];
+                [callbackPool drain];
+                callbackPool = nil;
+                [parser release];
+                parser = nil;
+                [pool drain];
+#else
+                XML_Parser parser = XML_ParserCreate("UTF-8");
+                XML_SetElementHandler(parser, BKXMLTreeExpatStart, BKXMLTreeExpatEnd);
+                XML_SetCharacterDataHandler(parser, BKXMLTreeExpatCharData);
+                XML_SetUserData(parser, &treeBuilder);
+                success = (XML_Parse(parser, [inData bytes], (int)[inData length], 1) == XML_STATUS_OK);
+                XML_ParserFree(parser);
+#endif
+            }
+            
+            builder = NULL;
+        }
+        
+        free(treeBuilder.internTable);
+        
+        if (!success || treeBuilder.failed) {
+            [self release];
+            return nil;
+        }
+        
+        rootNode = root;
+    }
+    
+    return self;
+}
+
+- (BKXMLElement *)rootElement
+{
+    BKXMLNode *top = ((BKXMLNode *)rootNode)->firstChild;
+    return top ? [[[BKXMLElement alloc] initWithDocument:self node:top] autorelease] : nil;
+}
+
+- (NSUInteger)allocatedBytes
+{
+    return ((BKXMLArena *)arena)->totalBytes;
+}
+
+#pragma mark NSXMLParser delegate methods
+
+// called at the end of each delegate method, once the strings have been copied into the arena
+- (void)recycleCallbackPool
+{
+    if (++callbacksSinceDrain < kCallbacksPerPool) {
+        return;
+    }
+    
+    [callbackPool drain];
+    callbackPool = [[NSAutoreleasePool alloc] init];
+    callbacksSinceDrain = 0;
+}
+
+- (void)parser:(NSXMLParser *)parser didStartElement:(NSString *)elementName namespaceURI:(NSString *)namespaceURI qualifiedName:(NSString *)qName attributes:(NSDictionary *)attributeDict
+{
+    BKXMLTreeBuilder *treeBuilder = (BKXMLTreeBuilder *)builder;
+    const char *name = [elementName UTF8String];
+    BKXMLNode *node = BKXMLTreeBuilderStartElement(treeBuilder, name, strlen(name));
+    
+    if (!node) {
+        [parser abortParsing];
+        return;
+    }
+    
+    for (NSString *key in attributeDict) {
+        if (!BKXMLTreeBuilderAddAttribute(treeBuilder, node, [key UTF8String], [[attributeDict objectForKey:key] UTF8String])) {
+            [parser abortParsing];
+            return;
+        }
+    }
+    
+    [self recycleCallbackPool];
+}
+
+- (void)parser:(NSXMLParser *)parser didEndElement:(NSString *)elementName namespaceURI:(NSString *)namespaceURI qualifiedName:(NSString *)qName
+{
+    BKXMLTreeBuilderEndElement((BKXMLTreeBuilder *)builder);
+    [self recycleCallbackPool];
+}
+
+- (void)parser:(NSXMLParser *)parser foundCharacters:(NSString *)string
+{
+    const char *bytes = [string UTF8String];
+    if (!BKXMLTreeBuilderAppendText((BKXMLTreeBuilder *)builder, bytes, strlen(bytes))) {
+        [parser abortParsing];
+        return;
+    }
+    
+    [self recycleCallbackPool];
+}
+@end
+
+@implementation BKXMLElement
+- (void)dealloc
+{
+    [document release];
+    [super dealloc];
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p> {name: %@, children: %ju}", [self class], self, [self name], (uintmax_t)[self childCount]];
+}
+
+- (NSString *)attributeForName:(NSString *)inName
+{
+    const char *name = [inName UTF8String];
+    for (BKXMLAttribute *attr = ((BKXMLNode *)node)->firstAttribute ; attr ; attr = attr->next) {
+        if (!strcmp(attr->name, name)) {
+            return [NSString stringWithUTF8String:attr->value];
+        }
+    }
+    
+    return nil;
+}
+
+- (BKXMLElement *)firstChildNamed:(NSString *)inName
+{
+    BKXMLNode *child = BKXMLNodeFirstChildNamed((BKXMLNode *)node, [inName UTF8String]);
+    return child ? [[[BKXMLElement alloc] initWithDocument:document node:child] autorelease] : nil;
+}
+
+- (NSArray *)childrenNamed:(NSString *)inName
+{
+    const char *name = [inName UTF8String];
+    NSMutableArray *result = [NSMutableArray array];
+    
+    for (BKXMLNode *child = ((BKXMLNode *)node)->firstChild ; child ; child = child->nextSibling) {
+        if (!strcmp(child->name, name)) {
+            BKXMLElement *element = [[BKXMLElement alloc] initWithDocument:document node:child];
+            [result addObject:element];
+            [element release];
+        }
+    }
+    
+    return result;
+}
+
+- (BKXMLElement *)elementAtKeyPath:(NSString *)inKeyPath
+{
+    BKXMLNode *current = (BKXMLNode *)node;
+    for (NSString *component in [inKeyPath componentsSeparatedByString:@"."]) {
+        current = BKXMLNodeFirstChildNamed(current, [component UTF8String]);
+        if (!current) {
+            return nil;
+        }
+    }
+    
+    return [[[BKXMLElement alloc] initWithDocument:document node:current] autorelease];
+}
+
+- (NSArray *)elementsAtKeyPath:(NSString *)inKeyPath
+{
+    NSRange lastDot = [inKeyPath rangeOfString:@"." options:NSBackwardsSearch];
+    if (lastDot.location == NSNotFound) {
+        return [self childrenNamed:inKeyPath];
+    }
+    
+    BKXMLElement *parent = [self elementAtKeyPath:[inKeyPath substringToIndex:lastDot.location]];
+    return parent ? [parent childrenNamed:[inKeyPath substringFromIndex:NSMaxRange(lastDot)]] : [NSArray array];
+}
+
+- (id)XMLMappedObject
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    BKXMLMapper *mapper = [[BKXMLMapper alloc] init];
+    BKXMLNodeReplay((BKXMLNode *)node, mapper);
+    
+    NSDictionary *mapped = [mapper flattenedDictionary:[mapper resultantDictionary]];
+    id result = [[mapped objectForKey:[NSString stringWithUTF8String:((BKXMLNode *)node)->name]] retain];
+    [mapper release];
+    
+    [pool drain];
+    return [result autorelease];
+}
+
+- (NSString *)name
+{
+    return [NSString stringWithUTF8String:((BKXMLNode *)node)->name];
+}
+
+- (NSString *)textContent
+{
+    return [BKXMLNodeCopyTextContent((BKXMLNode *)node) autorelease];
+}
+
+- (NSDictionary *)attributes
+{
+    return BKXMLNodeAttributeDictionary((BKXMLNode *)node);
+}
+
+- (NSUInteger)childCount
+{
+    return ((BKXMLNode *)node)->childCount;
+}
+
+- (NSArray *)children
+{
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:[self childCount]];
+    for (BKXMLNode *child = ((BKXMLNode *)node)->firstChild ; child ; child = child->nextSibling) {
+        BKXMLElement *element = [[BKXMLElement alloc] initWithDocument:document node:child];
+        [result addObject:element];
+        [element release];
+    }
+    
+    return result;
+}
+
+@synthesize document;
+@end
+
+@implementation BKXMLElement (PrivateMethods)
+- (id)initWithDocument:(BKXMLDocument *)inDocument node:(BKXMLNode *)inNode
+{
+    self = [super init];
+    if (self) {
+        // the element keeps the document (and so the arena) alive
+        document = [inDocument retain];
+        node = inNode;
+    }
+    
+    return self;
+}
+@end
@@ -26,13 +26,23 @@
 //
 
 #import "BKAPIContext.h"
+#import "BKBandwidthThrottle.h"
+#import "BKCaseCache.h"
+#import "BKContentDecoder.h"
+#import "BKEntityRegistry.h"
 #import "BKError.h"
 #import "BKRequest.h"
 #import "BKRequestOperation.h"
+#import "BKRequestTemplate.h"
+#import "BKRequestTrace.h"
+#import "BKResponseSchema.h"
+#import "BKWorkingSchedule.h"
 #import "BKXMLMapper.h"
+#import "BKXMLTree.h"
 
 // Request classes
 #import "BKAreaListRequest.h"
+#import "BKAttachmentDownloadRequest.h"
 #import "BKCheckVersionRequest.h"
 #import "BKEditCaseRequest.h"
 #import "BKListRequest.h"